@@ -11,9 +11,16 @@ ARCH=arm
 # Compile with debug information
 CMA_DEBUG?=0
 
+# Backend of the api library: "driver" uses the kernel module, "emu" emulates
+# it in memfd backed memory with fake physical addresses, for hosts and CI
+CMA_BACKEND?=driver
+
 # ==================== DRIVER RELATED SETTINGS ====================
 # Node name used in "/dev" folder
 DRIVER_NODE_NAME="cma"
 
+# compatible string in .dtb file by which this driver is recognized (optional binding)
+COMPATIBLE_STRING="edi,cma"
+
 # Unique (across system) ioctl magic number. Every ioctl interface should have one.
 CMA_IOC_MAGIC=0xf2
@@ -36,11 +36,13 @@
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
+#include <stdint.h>
 #include <sys/types.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
 
 #include "cma.h"
+#include "cma_api.h"
 
 
 #ifndef CMA_DEBUG
@@ -61,8 +63,31 @@
 #define ROUND_UP(N, S) 		((((N) + (S) - 1) / (S)) * (S))
 
 
+/* api flags are passed to the driver as they are */
+_Static_assert(CMA_FLAG_NONCACHED == CMA_ALLOC_FLAG_NONCACHED, "flag mismatch");
+_Static_assert(CMA_FLAG_CARVEOUT == CMA_ALLOC_FLAG_CARVEOUT, "flag mismatch");
+_Static_assert(CMA_FLAG_WRITECOMBINE == CMA_ALLOC_FLAG_WRITECOMBINE, "flag mismatch");
+_Static_assert(CMA_FLAG_HUGEPAGE == CMA_ALLOC_FLAG_HUGEPAGE, "flag mismatch");
+_Static_assert(CMA_FLAG_NOZERO == CMA_ALLOC_FLAG_NOZERO, "flag mismatch");
+_Static_assert(CMA_FLAG_PAGES == CMA_ALLOC_FLAG_PAGES, "flag mismatch");
+_Static_assert(CMA_FLAG_ACP == CMA_ALLOC_FLAG_ACP, "flag mismatch");
+_Static_assert(CMA_FLAG_REGION(2) == CMA_ALLOC_FLAG_REGION(2), "flag mismatch");
+
+/* chunk table is passed to the driver as is */
+_Static_assert(sizeof(struct cma_chunk) == sizeof(struct cma_chunk_entry), "chunk layout mismatch");
+
+/* mmap() allocation offset does not fit in 32-bit off_t */
+_Static_assert(sizeof(off_t) == 8, "build with _FILE_OFFSET_BITS=64");
+
+
 /* Private functions */
-void *cma_alloc(size_t size, unsigned ioctl_cmd);
+int cma_sync(void *mem, size_t offset, size_t len, unsigned ioctl_cmd);
+void cma_slab_release(void);
+void cma_index_add(void *mem, size_t map_size, const struct cma_chunk *chunks, unsigned count, int flags);
+void cma_index_query(void *mem, size_t map_size, int flags);
+void cma_index_remove(void *mem);
+void cma_index_release(void);
+uint64_t cma_query_phy_addr(void *mem);
 
 /* Global file descriptor */
 int cma_fd = 0;
@@ -79,13 +104,30 @@ int cma_init(void)
 		return -1;
 	}
 
+	/* 64-bit ioctls are required */
+	if( ioctl(cma_fd, CMA_GET_VERSION) < CMA_IOCTL_VERSION ){
+		__DEBUG("Failed to initialize api - driver is too old\n");
+		close(cma_fd);
+		errno = EPROTO;
+		return -1;
+	}
+
 	return 0;
 }
 
+int cma_get_version(void)
+{
+	return ioctl(cma_fd, CMA_GET_VERSION);
+}
+
 int cma_release(void)
 {
 	__DEBUG("Closing \"/dev/" DRIVER_NODE_NAME "\" file\n");
 
+	/* arenas of sub-allocated blocks */
+	cma_slab_release();
+	cma_index_release();
+
 	if(close(cma_fd) == -1){
 		__DEBUG("Failed to finilize api - \"%s\"\n", strerror(errno));
 		return -1;
@@ -96,36 +138,379 @@ int cma_release(void)
 
 
 
+/* 64-bit CMA_ALLOC_EXT is used instead of legacy 32-bit ioctls */
 void *cma_alloc_cached(size_t size)
 {
-	return cma_alloc(size, CMA_ALLOC_CACHED);
+	return cma_alloc_ext(size, CMA_FLAG_CACHED);
 }
 
 void *cma_alloc_noncached(size_t size)
 {
-	return cma_alloc(size, CMA_ALLOC_NONCACHED);
+	return cma_alloc_ext(size, CMA_FLAG_NONCACHED);
+}
+
+void *cma_alloc_writecombine(size_t size)
+{
+	return cma_alloc_ext(size, CMA_FLAG_WRITECOMBINE);
+}
+
+
+void *cma_alloc_ext(size_t size, unsigned flags)
+{
+	struct cma_alloc_ext data;
+	struct cma_chunk chunk;
+	void 	*mem;
+	__DEBUG("Allocating 0x%zx bytes of contigous memory, flags 0x%x\n", size, flags);
+
+	/* Page align size */
+	size = ROUND_UP(size, getpagesize());
+
+	/* ioctl cmd to allocate contigous memory */
+	memset(&data, 0, sizeof(data));
+	data.size  = size;
+	data.flags = flags;
+	if( ioctl(cma_fd, CMA_ALLOC_EXT, &data) == -1){
+		__DEBUG("cma_alloc_ext - ioctl command unsuccsessful\n");
+		return NULL;
+	}
+
+	/* mmap memory */
+	mem = mmap(NULL, size, PROT_WRITE | PROT_READ, MAP_SHARED, cma_fd, data.phy_addr);
+	if(mem == MAP_FAILED){
+		__DEBUG("cma_alloc_ext - mmap unsuccsessful\n");
+		return NULL;
+	}
+
+	chunk.phy_addr 	= data.phy_addr;
+	chunk.size 		= size;
+	cma_index_add(mem, size, &chunk, 1, flags);
+
+	return mem;
+}
+
+
+void *cma_alloc_aligned(size_t size, size_t align, uint64_t boundary, unsigned flags)
+{
+	struct cma_alloc_aligned data;
+	struct cma_chunk chunk;
+	void 	*mem;
+	__DEBUG("Allocating 0x%zx bytes of contigous memory, align 0x%zx, boundary 0x%llx, flags 0x%x\n",
+		size, align, (unsigned long long)boundary, flags);
+
+	/* ioctl cmd to allocate placed contigous memory */
+	memset(&data, 0, sizeof(data));
+	data.size 		= ROUND_UP(size, getpagesize());
+	data.align 		= align;
+	data.boundary 	= boundary;
+	data.flags 		= flags;
+	if( ioctl(cma_fd, CMA_ALLOC_ALIGNED, &data) == -1){
+		__DEBUG("cma_alloc_aligned - ioctl command unsuccsessful\n");
+		return NULL;
+	}
+
+	/* mmap memory */
+	mem = mmap(NULL, data.size, PROT_WRITE | PROT_READ, MAP_SHARED, cma_fd, data.phy_addr);
+	if(mem == MAP_FAILED){
+		__DEBUG("cma_alloc_aligned - mmap unsuccsessful\n");
+		return NULL;
+	}
+
+	chunk.phy_addr 	= data.phy_addr;
+	chunk.size 		= data.size;
+	cma_index_add(mem, data.size, &chunk, 1, flags);
+
+	return mem;
+}
+
+
+void *cma_alloc_ring(unsigned count, size_t size, unsigned flags, void **out_ptrs, uint64_t *out_phys)
+{
+	struct cma_alloc_ring data;
+	struct cma_chunk *chunks;
+	uint64_t *phy_table;
+	unsigned i;
+	void 	*mem;
+	__DEBUG("Allocating ring of %u x 0x%zx bytes of contigous memory, flags 0x%x\n", count, size, flags);
+
+	/* Page align size, buffers are mapped back-to-back */
+	size = ROUND_UP(size, getpagesize());
+
+	phy_table = out_phys != NULL ? out_phys : malloc(count * sizeof(uint64_t));
+	if(phy_table == NULL)
+		return NULL;
+
+	/* ioctl cmd to allocate all buffers */
+	memset(&data, 0, sizeof(data));
+	data.size 		= size;
+	data.count 		= count;
+	data.flags 		= flags;
+	data.phy_table 	= (uintptr_t)phy_table;
+	if( ioctl(cma_fd, CMA_ALLOC_RING, &data) == -1){
+		__DEBUG("cma_alloc_ring - ioctl command unsuccsessful\n");
+		mem = NULL;
+		goto leave;
+	}
+
+	/* mmap all buffers at once */
+	mem = mmap(NULL, (size_t)count * size, PROT_WRITE | PROT_READ, MAP_SHARED, cma_fd, data.phy_addr);
+	if(mem == MAP_FAILED){
+		__DEBUG("cma_alloc_ring - mmap unsuccsessful\n");
+		mem = NULL;
+		goto leave;
+	}
+
+	/* buffers are recorded from the table the driver filled */
+	chunks = malloc(count * sizeof(struct cma_chunk));
+	if(chunks != NULL){
+		for(i=0; i<count; i++){
+			chunks[i].phy_addr 	= phy_table[i];
+			chunks[i].size 		= size;
+		}
+		cma_index_add(mem, (size_t)count * size, chunks, count, flags);
+		free(chunks);
+	}
+
+	if(out_ptrs != NULL)
+		for(i=0; i<count; i++)
+			out_ptrs[i] = (char*)mem + (size_t)i * size;
+
+leave:
+	if(phy_table != out_phys)
+		free(phy_table);
+
+	return mem;
+}
+
+
+void *cma_alloc_mirrored(size_t size, unsigned flags)
+{
+	struct cma_alloc_ext data;
+	struct cma_chunk chunk;
+	void 	*mem;
+	__DEBUG("Allocating 0x%zx bytes of mirrored contigous memory, flags 0x%x\n", size, flags);
+
+	/* Page align size, halves of the mapping have to be adjacent */
+	size = ROUND_UP(size, getpagesize());
+
+	/* ioctl cmd to allocate contigous memory */
+	memset(&data, 0, sizeof(data));
+	data.size  = size;
+	data.flags = flags;
+	if( ioctl(cma_fd, CMA_ALLOC_EXT, &data) == -1){
+		__DEBUG("cma_alloc_mirrored - ioctl command unsuccsessful\n");
+		return NULL;
+	}
+
+	/* mapping of twice the size is mirrored by the driver */
+	mem = mmap(NULL, 2 * size, PROT_WRITE | PROT_READ, MAP_SHARED, cma_fd, data.phy_addr);
+	if(mem == MAP_FAILED){
+		__DEBUG("cma_alloc_mirrored - mmap unsuccsessful\n");
+		return NULL;
+	}
+
+	chunk.phy_addr 	= data.phy_addr;
+	chunk.size 		= size;
+	cma_index_add(mem, 2 * size, &chunk, 1, flags);
+
+	return mem;
+}
+
+
+int cma_free_mirrored(void *mem)
+{
+	struct cma_query64 data;
+
+	memset(&data, 0, sizeof(data));
+	data.v_usr_addr = (uintptr_t)mem;
+
+	if( ioctl(cma_fd, CMA_GET_SIZE64, &data) == -1){
+		__DEBUG("cma_free_mirrored - ioctl command unsuccsessful - 0\n");
+		return -1;
+	}
+
+	/* unmap both halves */
+	cma_index_remove(mem);
+	munmap(mem, 2 * data.value);
+
+	if( ioctl(cma_fd, CMA_FREE64, &data) == -1){
+		__DEBUG("cma_free_mirrored - ioctl command unsuccsessful - 1\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+
+void *cma_alloc_chunked(size_t size, size_t min_chunk, unsigned flags,
+						struct cma_chunk *chunks, unsigned max_chunks, unsigned *count)
+{
+	struct cma_alloc_chunked data;
+	void 	*mem;
+	__DEBUG("Allocating 0x%zx bytes of chunked memory, min chunk 0x%zx, flags 0x%x\n", size, min_chunk, flags);
+
+	/* Page align size, chunks are mapped back-to-back */
+	size = ROUND_UP(size, getpagesize());
+
+	/* ioctl cmd to allocate all chunks */
+	memset(&data, 0, sizeof(data));
+	data.size 			= size;
+	data.min_chunk 		= min_chunk;
+	data.chunk_table 	= (uintptr_t)chunks;
+	data.max_chunks 	= max_chunks;
+	data.flags 			= flags;
+	if( ioctl(cma_fd, CMA_ALLOC_CHUNKED, &data) == -1){
+		__DEBUG("cma_alloc_chunked - ioctl command unsuccsessful\n");
+		return NULL;
+	}
+
+	/* mmap all chunks at once */
+	mem = mmap(NULL, size, PROT_WRITE | PROT_READ, MAP_SHARED, cma_fd, data.phy_addr);
+	if(mem == MAP_FAILED){
+		__DEBUG("cma_alloc_chunked - mmap unsuccsessful\n");
+		return NULL;
+	}
+
+	/* driver reports every chunk even if the table is too small for them */
+	if(chunks != NULL && data.count <= max_chunks)
+		cma_index_add(mem, size, chunks, data.count, flags);
+	else
+		cma_index_query(mem, size, flags);
+
+	if(count != NULL)
+		*count = data.count;
+
+	return mem;
+}
+
+
+int cma_get_chunks(void *mem, struct cma_chunk *chunks, unsigned max_chunks)
+{
+	struct cma_get_chunks data;
+
+	memset(&data, 0, sizeof(data));
+	data.v_usr_addr 	= (uintptr_t)mem;
+	data.chunk_table 	= (uintptr_t)chunks;
+	data.max_chunks 	= max_chunks;
+
+	if( ioctl(cma_fd, CMA_GET_CHUNKS, &data) == -1){
+		__DEBUG("cma_get_chunks - ioctl command unsuccsessful\n");
+		return -1;
+	}
+
+	return data.count;
+}
+
+
+void *cma_alloc_mmap(size_t size, unsigned flags)
+{
+	struct cma_chunk chunk;
+	void 	*mem;
+	off_t 	offset;
+	__DEBUG("Allocating 0x%zx bytes of contigous memory with mmap, flags 0x%x\n", size, flags);
+
+	/* Page align size */
+	size = ROUND_UP(size, getpagesize());
+
+	/* driver allocates memory of mapping size */
+	offset = CMA_MMAP_ALLOC_OFFSET | ((off_t)flags << CMA_MMAP_FLAGS_SHIFT);
+
+	mem = mmap(NULL, size, PROT_WRITE | PROT_READ, MAP_SHARED, cma_fd, offset);
+	if(mem == MAP_FAILED){
+		__DEBUG("cma_alloc_mmap - mmap unsuccsessful\n");
+		return NULL;
+	}
+
+	/* physical address is queried on first translation */
+	chunk.phy_addr 	= 0;
+	chunk.size 		= size;
+	cma_index_add(mem, size, &chunk, 1, flags);
+
+	return mem;
+}
+
+
+int cma_free_mmap(void *mem, size_t size)
+{
+	/* driver releases memory together with its last mapping */
+	cma_index_remove(mem);
+	if( munmap(mem, ROUND_UP(size, getpagesize())) == -1){
+		__DEBUG("cma_free_mmap - munmap unsuccsessful\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+
+int cma_export_fd(void *mem)
+{
+	struct cma_export_dmabuf data;
+	int fd;
+
+	memset(&data, 0, sizeof(data));
+	data.v_usr_addr = (uintptr_t)mem;
+	data.flags 		= O_CLOEXEC;
+
+	fd = ioctl(cma_fd, CMA_EXPORT_DMABUF, &data);
+	if( fd == -1){
+		__DEBUG("cma_export_fd - ioctl command unsuccsessful\n");
+		return -1;
+	}
+
+	return fd;
+}
+
+
+void *cma_import_fd(int fd, size_t *size)
+{
+	struct cma_import_dmabuf data;
+	void 	*mem;
+
+	memset(&data, 0, sizeof(data));
+	data.fd = fd;
+
+	if( ioctl(cma_fd, CMA_IMPORT_DMABUF, &data) == -1){
+		__DEBUG("cma_import_fd - ioctl command unsuccsessful\n");
+		return NULL;
+	}
+
+	/* mmap memory, same as for own allocations */
+	mem = mmap(NULL, data.size, PROT_WRITE | PROT_READ, MAP_SHARED, cma_fd, data.phy_addr);
+	if(mem == MAP_FAILED){
+		__DEBUG("cma_import_fd - mmap unsuccsessful\n");
+		return NULL;
+	}
+
+	/* dma-buf of a ring or chunked allocation has several chunks */
+	cma_index_query(mem, data.size, data.flags);
+
+	if(size != NULL)
+		*size = data.size;
+
+	return mem;
 }
 
 
 int cma_free(void *mem)
 {
-	unsigned data, v_addr;
+	struct cma_query64 data;
 
 	/* save user space pointer value */
-	data   = (unsigned)mem;
-	v_addr = (unsigned)mem;
+	memset(&data, 0, sizeof(data));
+	data.v_usr_addr = (uintptr_t)mem;
 
-	if( ioctl(cma_fd, CMA_GET_SIZE, &data) == -1){
+	if( ioctl(cma_fd, CMA_GET_SIZE64, &data) == -1){
 		__DEBUG("cma_free - ioctl command unsuccsessful - 0\n");
 		return -1;
 	}
-	/* data now contains size */
+	/* data.value now contains size */
 
 	/* unmap memory */
-	munmap(mem, data);
+	cma_index_remove(mem);
+	munmap(mem, data.value);
 
 	/* free cma entry */
-	if( ioctl(cma_fd, CMA_FREE, &v_addr) == -1){
+	if( ioctl(cma_fd, CMA_FREE64, &data) == -1){
 		__DEBUG("cma_free - ioctl command unsuccsessful - 1\n");
 		return -1;
 	}
@@ -134,49 +519,125 @@ int cma_free(void *mem)
 }
 
 
+int cma_sync_for_device(void *mem, size_t offset, size_t len)
+{
+	return cma_sync(mem, offset, len, CMA_SYNC_FOR_DEVICE);
+}
+
+int cma_sync_for_cpu(void *mem, size_t offset, size_t len)
+{
+	return cma_sync(mem, offset, len, CMA_SYNC_FOR_CPU);
+}
+
+
+int cma_get_flags(void *mem)
+{
+	struct cma_get_flags data;
+
+	memset(&data, 0, sizeof(data));
+	data.v_usr_addr = (uintptr_t)mem;
+
+	if( ioctl(cma_fd, CMA_GET_FLAGS, &data) == -1){
+		__DEBUG("cma_get_flags - ioctl command unsuccsessful\n");
+		return -1;
+	}
+
+	return data.flags;
+}
+
+
 unsigned cma_get_phy_addr(void *mem)
 {
-	unsigned data;
+	uint64_t phy_addr = cma_get_phy_addr64(mem);
+
+	/* does not fit, caller has to use cma_get_phy_addr64() */
+	if( phy_addr > UINT32_MAX ){
+		__DEBUG("cma_get_phy_addr - physical address above 4 GB\n");
+		return 0;
+	}
+
+	return phy_addr;
+}
+
+
+uint64_t cma_get_phy_addr64(void *mem)
+{
+	uint64_t phy_addr;
+
+	/* memory mapped by this api is translated without a system call */
+	phy_addr = cma_virt_to_phys(mem);
+	if( phy_addr != 0 )
+		return phy_addr;
+
+	return cma_query_phy_addr(mem);
+}
+
+
+/* asks the driver, used by the index for memory allocated by mmap() alone */
+uint64_t cma_query_phy_addr(void *mem)
+{
+	struct cma_query64 data;
 
 	/* save user space pointer value */
-	data = (unsigned)mem;
+	memset(&data, 0, sizeof(data));
+	data.v_usr_addr = (uintptr_t)mem;
 
 	/* get physical address */
-	if( ioctl(cma_fd, CMA_GET_PHY_ADDR, &data) == -1){
-		__DEBUG("cma_free - ioctl command unsuccsessful\n");
+	if( ioctl(cma_fd, CMA_GET_PHY_ADDR64, &data) == -1){
+		__DEBUG("cma_query_phy_addr - ioctl command unsuccsessful\n");
 		return 0;
 	}
-	/* data now contains physical address */
+	/* data.value now contains physical address */
 
-	return data;
+	return data.value;
 }
 
 
-void *cma_alloc(size_t size, unsigned ioctl_cmd)
+uint64_t cma_get_dma_addr(void *mem)
 {
-	unsigned data;
-	void 	*mem;
-	__DEBUG("Allocating 0x%x bytes of uncached contigous memory\n", size);
+	struct cma_query64 data;
 
-	/* Page align size */
-	size = ROUND_UP(size, getpagesize());
+	memset(&data, 0, sizeof(data));
+	data.v_usr_addr = (uintptr_t)mem;
 
-	/* ioctl cmd to allocate contigous memory */
-	data = (unsigned)size;
-	if( ioctl(cma_fd, ioctl_cmd, &data) == -1){
-		__DEBUG("cma_alloc - ioctl command unsuccsessful\n");
-		return NULL;
+	/* get device address */
+	if( ioctl(cma_fd, CMA_GET_DMA_ADDR, &data) == -1){
+		__DEBUG("cma_get_dma_addr - ioctl command unsuccsessful\n");
+		return 0;
 	}
 
-	/* at this point phy_addr is written to data */
+	return data.value;
+}
 
 
-	/* mmap memory */
-	mem = mmap(NULL, size, PROT_WRITE | PROT_READ, MAP_SHARED, cma_fd, data);
-	if(mem == MAP_FAILED){
-		__DEBUG("cma_alloc - mmap unsuccsessful\n");
-		return NULL;
+int cma_get_region(const char *name)
+{
+	struct cma_get_region data;
+
+	memset(&data, 0, sizeof(data));
+	strncpy(data.name, name, sizeof(data.name) - 1);
+
+	if( ioctl(cma_fd, CMA_GET_REGION, &data) == -1){
+		__DEBUG("cma_get_region - ioctl command unsuccsessful\n");
+		return -1;
 	}
 
-	return mem;
+	return data.index;
+}
+
+
+int cma_sync(void *mem, size_t offset, size_t len, unsigned ioctl_cmd)
+{
+	struct cma_sync data;
+
+	data.v_usr_addr = (uintptr_t)mem;
+	data.offset 	= offset;
+	data.len 		= len;
+
+	if( ioctl(cma_fd, ioctl_cmd, &data) == -1){
+		__DEBUG("cma_sync - ioctl command unsuccsessful\n");
+		return -1;
+	}
+
+	return 0;
 }
\ No newline at end of file
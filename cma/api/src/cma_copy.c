@@ -0,0 +1,426 @@
+/* cma_copy.c - copy and fill routines for noncached and write-combined memory.
+ *
+ *
+ * The MIT License (MIT)
+ *
+ * COPYRIGHT (C) 2017 Institute of Electronics and Computer Science (EDI), Latvia.
+ * AUTHOR: Rihards Novickis (rihards.novickis@edi.lv)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ *
+ * DESCRIPTION:
+ * Noncached memory is mapped as device memory on ARM, where every access is a
+ * bus transaction and unaligned accesses fault, and write-combined memory only
+ * performs well with full line writes and no reads. C library routines are
+ * tuned for cached memory and may use unaligned or overlapping accesses, so
+ * they are used only when the buffer is cached or not mapped by this api.
+ *
+ * Otherwise bytes up to the first CMA_COPY_BLOCK boundary of the CMA side and
+ * after the last one are moved with naturally aligned word accesses and the
+ * rest by the widest kernel the CPU supports, which moves whole aligned blocks:
+ * NEON on ARM, non-temporal SSE2/AVX stores and SSE4.1/AVX2 streaming loads on
+ * x86. Mapping type is looked up in the index of cma_index.c, kernels are
+ * chosen once on first use.
+ *
+ * For API interface documentation refer to "include/cma_api.h" header file.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#if defined(__aarch64__)
+	#include <arm_neon.h>
+	#define CMA_COPY_NEON
+	#define CMA_COPY_NEON_TARGET
+#elif defined(__arm__) && defined(__ARM_FP)
+	#include <arm_neon.h>
+	#include <sys/auxv.h>
+	#include <asm/hwcap.h>
+	#define CMA_COPY_NEON
+	#define CMA_COPY_NEON_TARGET 	__attribute__((target("fpu=neon")))
+#elif defined(__x86_64__) || defined(__i386__)
+	#include <immintrin.h>
+	#define CMA_COPY_X86
+#endif
+
+#include "cma.h"
+#include "cma_api.h"
+
+
+#ifndef CMA_DEBUG
+	#define CMA_DEBUG 			0
+#endif
+
+#if CMA_DEBUG == 1
+	#define __DEBUG(fmt, args...)	printf("CMA_API_DEBUG: " fmt, ##args)
+#else
+	#define __DEBUG(fmt,args...)
+#endif
+
+/* kernels move whole blocks, CMA side is aligned to the block */
+#define CMA_COPY_BLOCK 		64
+
+
+/* Copy kernels of one instruction set, n is a multiple of CMA_COPY_BLOCK */
+struct cma_copy_kernels{
+	const char 	*name;
+	void 		(*to_dma)	(void *dst, const void *src, size_t n);
+	void 		(*from_dma)	(void *dst, const void *src, size_t n);
+	void 		(*fill)		(void *dst, int c, size_t n);
+};
+
+
+/* Private functions */
+static void 	cma_copy_init		(void);
+int 			cma_index_flags		(const void *ptr);
+
+/* Global variables */
+static pthread_once_t 	cma_copy_once = PTHREAD_ONCE_INIT;
+static const struct cma_copy_kernels *cma_copy_kernels;
+
+
+
+/* word accesses of CMA memory are naturally aligned, bytes go around them */
+static void cma_copy_words_to(void *dst, const void *src, size_t n)
+{
+	volatile unsigned char *d = dst;
+	const unsigned char *s = src;
+	unsigned long word;
+
+	for( ; n && ((uintptr_t)d & (sizeof(long) - 1)); n--)
+		*d++ = *s++;
+
+	for( ; n >= sizeof(long); n -= sizeof(long), d += sizeof(long), s += sizeof(long)){
+		memcpy(&word, s, sizeof(long));
+		*(volatile unsigned long*)d = word;
+	}
+
+	for( ; n; n--)
+		*d++ = *s++;
+}
+
+
+static void cma_copy_words_from(void *dst, const void *src, size_t n)
+{
+	unsigned char *d = dst;
+	const volatile unsigned char *s = src;
+	unsigned long word;
+
+	for( ; n && ((uintptr_t)s & (sizeof(long) - 1)); n--)
+		*d++ = *s++;
+
+	for( ; n >= sizeof(long); n -= sizeof(long), d += sizeof(long), s += sizeof(long)){
+		word = *(const volatile unsigned long*)s;
+		memcpy(d, &word, sizeof(long));
+	}
+
+	for( ; n; n--)
+		*d++ = *s++;
+}
+
+
+static void cma_copy_words_fill(void *dst, int c, size_t n)
+{
+	volatile unsigned char *d = dst;
+	unsigned long word = ~0UL / 0xff * (unsigned char)c;
+
+	for( ; n && ((uintptr_t)d & (sizeof(long) - 1)); n--)
+		*d++ = c;
+
+	for( ; n >= sizeof(long); n -= sizeof(long), d += sizeof(long))
+		*(volatile unsigned long*)d = word;
+
+	for( ; n; n--)
+		*d++ = c;
+}
+
+
+static const struct cma_copy_kernels cma_copy_generic = {
+	"generic", cma_copy_words_to, cma_copy_words_from, cma_copy_words_fill
+};
+
+
+#ifdef CMA_COPY_NEON
+/* both directions, alignment of the CMA side is all that differs */
+CMA_COPY_NEON_TARGET
+static void cma_copy_neon_move(void *dst, const void *src, size_t n)
+{
+	uint8_t *d = dst;
+	const uint8_t *s = src;
+	uint8x16_t v0, v1, v2, v3;
+
+	for( ; n; n -= CMA_COPY_BLOCK, d += CMA_COPY_BLOCK, s += CMA_COPY_BLOCK){
+		v0 = vld1q_u8(s);
+		v1 = vld1q_u8(s + 16);
+		v2 = vld1q_u8(s + 32);
+		v3 = vld1q_u8(s + 48);
+		vst1q_u8(d, 	 v0);
+		vst1q_u8(d + 16, v1);
+		vst1q_u8(d + 32, v2);
+		vst1q_u8(d + 48, v3);
+	}
+}
+
+
+CMA_COPY_NEON_TARGET
+static void cma_copy_neon_fill(void *dst, int c, size_t n)
+{
+	uint8_t *d = dst;
+	uint8x16_t v = vdupq_n_u8((uint8_t)c);
+
+	for( ; n; n -= CMA_COPY_BLOCK, d += CMA_COPY_BLOCK){
+		vst1q_u8(d, 	 v);
+		vst1q_u8(d + 16, v);
+		vst1q_u8(d + 32, v);
+		vst1q_u8(d + 48, v);
+	}
+}
+
+
+static const struct cma_copy_kernels cma_copy_neon = {
+	"neon", cma_copy_neon_move, cma_copy_neon_move, cma_copy_neon_fill
+};
+#endif
+
+
+#ifdef CMA_COPY_X86
+/* non-temporal stores bypass the cache and combine into full line writes */
+__attribute__((target("sse2")))
+static void cma_copy_sse2_to(void *dst, const void *src, size_t n)
+{
+	__m128i *d = dst;
+	const __m128i *s = src;
+
+	for( ; n; n -= CMA_COPY_BLOCK, d += 4, s += 4){
+		_mm_stream_si128(d, 	_mm_loadu_si128(s));
+		_mm_stream_si128(d + 1, _mm_loadu_si128(s + 1));
+		_mm_stream_si128(d + 2, _mm_loadu_si128(s + 2));
+		_mm_stream_si128(d + 3, _mm_loadu_si128(s + 3));
+	}
+	_mm_sfence();
+}
+
+
+__attribute__((target("sse2")))
+static void cma_copy_sse2_from(void *dst, const void *src, size_t n)
+{
+	__m128i *d = dst;
+	const __m128i *s = src;
+
+	for( ; n; n -= CMA_COPY_BLOCK, d += 4, s += 4){
+		_mm_storeu_si128(d, 	_mm_load_si128(s));
+		_mm_storeu_si128(d + 1, _mm_load_si128(s + 1));
+		_mm_storeu_si128(d + 2, _mm_load_si128(s + 2));
+		_mm_storeu_si128(d + 3, _mm_load_si128(s + 3));
+	}
+}
+
+
+__attribute__((target("sse2")))
+static void cma_copy_sse2_fill(void *dst, int c, size_t n)
+{
+	__m128i *d = dst;
+	__m128i v = _mm_set1_epi8((char)c);
+
+	for( ; n; n -= CMA_COPY_BLOCK, d += 4){
+		_mm_stream_si128(d, 	v);
+		_mm_stream_si128(d + 1, v);
+		_mm_stream_si128(d + 2, v);
+		_mm_stream_si128(d + 3, v);
+	}
+	_mm_sfence();
+}
+
+
+/* streaming loads read write-combined memory a line at a time */
+__attribute__((target("sse4.1")))
+static void cma_copy_sse41_from(void *dst, const void *src, size_t n)
+{
+	__m128i *d = dst;
+	__m128i *s = (__m128i*)src;
+
+	for( ; n; n -= CMA_COPY_BLOCK, d += 4, s += 4){
+		_mm_storeu_si128(d, 	_mm_stream_load_si128(s));
+		_mm_storeu_si128(d + 1, _mm_stream_load_si128(s + 1));
+		_mm_storeu_si128(d + 2, _mm_stream_load_si128(s + 2));
+		_mm_storeu_si128(d + 3, _mm_stream_load_si128(s + 3));
+	}
+}
+
+
+__attribute__((target("avx")))
+static void cma_copy_avx_to(void *dst, const void *src, size_t n)
+{
+	__m256i *d = dst;
+	const __m256i *s = src;
+
+	for( ; n; n -= CMA_COPY_BLOCK, d += 2, s += 2){
+		_mm256_stream_si256(d, 		_mm256_loadu_si256(s));
+		_mm256_stream_si256(d + 1, 	_mm256_loadu_si256(s + 1));
+	}
+	_mm_sfence();
+}
+
+
+__attribute__((target("avx2")))
+static void cma_copy_avx2_from(void *dst, const void *src, size_t n)
+{
+	__m256i *d = dst;
+	__m256i *s = (__m256i*)src;
+
+	for( ; n; n -= CMA_COPY_BLOCK, d += 2, s += 2){
+		_mm256_storeu_si256(d, 		_mm256_stream_load_si256(s));
+		_mm256_storeu_si256(d + 1, 	_mm256_stream_load_si256(s + 1));
+	}
+}
+
+
+__attribute__((target("avx")))
+static void cma_copy_avx_fill(void *dst, int c, size_t n)
+{
+	__m256i *d = dst;
+	__m256i v = _mm256_set1_epi8((char)c);
+
+	for( ; n; n -= CMA_COPY_BLOCK, d += 2){
+		_mm256_stream_si256(d, 		v);
+		_mm256_stream_si256(d + 1, 	v);
+	}
+	_mm_sfence();
+}
+
+
+static const struct cma_copy_kernels cma_copy_sse2 = {
+	"sse2", cma_copy_sse2_to, cma_copy_sse2_from, cma_copy_sse2_fill
+};
+
+static const struct cma_copy_kernels cma_copy_sse41 = {
+	"sse4.1", cma_copy_sse2_to, cma_copy_sse41_from, cma_copy_sse2_fill
+};
+
+static const struct cma_copy_kernels cma_copy_avx2 = {
+	"avx2", cma_copy_avx_to, cma_copy_avx2_from, cma_copy_avx_fill
+};
+#endif
+
+
+static void cma_copy_init(void)
+{
+	cma_copy_kernels = &cma_copy_generic;
+
+#if defined(CMA_COPY_X86)
+	__builtin_cpu_init();
+	if( __builtin_cpu_supports("avx2") )
+		cma_copy_kernels = &cma_copy_avx2;
+	else if( __builtin_cpu_supports("sse4.1") )
+		cma_copy_kernels = &cma_copy_sse41;
+	else if( __builtin_cpu_supports("sse2") )
+		cma_copy_kernels = &cma_copy_sse2;
+#elif defined(CMA_COPY_NEON) && defined(__arm__)
+	if( getauxval(AT_HWCAP) & HWCAP_NEON )
+		cma_copy_kernels = &cma_copy_neon;
+#elif defined(CMA_COPY_NEON)
+	cma_copy_kernels = &cma_copy_neon;
+#endif
+
+	__DEBUG("cma_copy_init - %s kernels\n", cma_copy_kernels->name);
+}
+
+
+/* kernels are used for memory which is not cached */
+static inline int cma_copy_uncached(const void *mem)
+{
+	int flags = cma_index_flags(mem);
+
+	if( flags == -1 || !(flags & (CMA_FLAG_NONCACHED | CMA_FLAG_WRITECOMBINE)) )
+		return 0;
+
+	pthread_once(&cma_copy_once, cma_copy_init);
+	return 1;
+}
+
+
+/* bytes before the first block boundary of CMA memory */
+static inline size_t cma_copy_head(const void *mem, size_t n)
+{
+	size_t head = -(uintptr_t)mem & (CMA_COPY_BLOCK - 1);
+
+	return head < n ? head : n;
+}
+
+
+void *cma_memcpy_to_dma(void *dst, const void *src, size_t n)
+{
+	size_t head, body;
+
+	if( !cma_copy_uncached(dst) )
+		return memcpy(dst, src, n);
+
+	head = cma_copy_head(dst, n);
+	body = (n - head) & ~(size_t)(CMA_COPY_BLOCK - 1);
+
+	cma_copy_words_to(dst, src, head);
+	if( body )
+		cma_copy_kernels->to_dma((char*)dst + head, (const char*)src + head, body);
+	cma_copy_words_to((char*)dst + head + body, (const char*)src + head + body, n - head - body);
+
+	return dst;
+}
+
+
+void *cma_memcpy_from_dma(void *dst, const void *src, size_t n)
+{
+	size_t head, body;
+
+	if( !cma_copy_uncached(src) )
+		return memcpy(dst, src, n);
+
+	head = cma_copy_head(src, n);
+	body = (n - head) & ~(size_t)(CMA_COPY_BLOCK - 1);
+
+	cma_copy_words_from(dst, src, head);
+	if( body )
+		cma_copy_kernels->from_dma((char*)dst + head, (const char*)src + head, body);
+	cma_copy_words_from((char*)dst + head + body, (const char*)src + head + body, n - head - body);
+
+	return dst;
+}
+
+
+void *cma_memset(void *dst, int c, size_t n)
+{
+	size_t head, body;
+
+	if( !cma_copy_uncached(dst) )
+		return memset(dst, c, n);
+
+	head = cma_copy_head(dst, n);
+	body = (n - head) & ~(size_t)(CMA_COPY_BLOCK - 1);
+
+	cma_copy_words_fill(dst, c, head);
+	if( body )
+		cma_copy_kernels->fill((char*)dst + head, c, body);
+	cma_copy_words_fill((char*)dst + head + body, c, n - head - body);
+
+	return dst;
+}
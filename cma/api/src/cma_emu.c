@@ -0,0 +1,1001 @@
+/* cma_emu.c - emulation of the api without the driver, for development hosts.
+ *
+ *
+ * The MIT License (MIT)
+ *
+ * COPYRIGHT (C) 2017 Institute of Electronics and Computer Science (EDI), Latvia.
+ * AUTHOR: Rihards Novickis (rihards.novickis@edi.lv)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ *
+ * DESCRIPTION:
+ * Backend which implements the same interface as cma_api.c with no kernel
+ * module, selected with CMA_BACKEND=emu in Settings.mak. Physical memory is
+ * simulated by a memfd of CMA_EMU_SIZE bytes, its offsets are translated to
+ * fake physical addresses from CMA_EMU_PHY_BASE. Allocations get ranges of it
+ * first fit, the same sequence of calls gets the same addresses, and mappings
+ * are made of the backing file at the offsets of their physical parts, so
+ * mirrored mappings and imports see the same memory. Released ranges are
+ * punched out of the file, which gives memory back and zeroes it for the next
+ * allocation.
+ *
+ * Hugepage allocations are backed by a hugetlbfs memfd covering the same
+ * simulated address space when hugetlbfs pages are available, by transparent
+ * huge pages otherwise. Caching flags are recorded and reported but memory is
+ * always cached. There is no ACP window and no memory-region. Exported
+ * descriptors are handles which can be imported by the same process only, and
+ * only while the memory is mapped.
+ *
+ * For API interface documentation refer to "include/cma_api.h" header file.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+
+#include "cma.h"
+#include "cma_api.h"
+
+
+#ifndef CMA_DEBUG
+	#define CMA_DEBUG 			0
+#endif
+#ifndef CMA_EMU_PHY_BASE
+	#define CMA_EMU_PHY_BASE 	0x20000000ULL
+#endif
+#ifndef CMA_EMU_SIZE
+	#define CMA_EMU_SIZE 		(256ULL*1024*1024)
+#endif
+
+#if CMA_DEBUG == 1
+	#define __DEBUG(fmt, args...)	printf("CMA_API_DEBUG: " fmt, ##args)
+#else
+	#define __DEBUG(fmt,args...)
+#endif
+
+#define ROUND_UP(N, S) 		((((N) + (S) - 1) / (S)) * (S))
+
+#define CMA_EMU_HUGEPAGE_SIZE 	(2*1024*1024)
+#define CMA_EMU_DMABUF_MAGIC 	0x636d6165		/* "cmae" */
+
+
+/* Simulated physical memory of an allocation, shared by its mappings */
+struct cma_emu_block{
+	struct cma_emu_block *next;
+	unsigned 	refcount;	/* mappings */
+	int 		flags;		/* CMA_FLAG_* in effect */
+	int 		hugetlb;	/* mapped from hugetlbfs memfd */
+	size_t 		size;
+	unsigned 	count;
+	struct cma_chunk parts[];	/* physical parts in mapping order */
+};
+
+/* Mapping of a block, parts are repeated for mirrored mappings */
+struct cma_emu_mapping{
+	char 		*mem;
+	size_t 		map_size;
+	struct cma_emu_block *block;
+};
+
+/* Used range of simulated physical memory */
+struct cma_emu_range{
+	uint64_t 	phy_addr;
+	uint64_t 	size;
+};
+
+/* Content of exported descriptor */
+struct cma_emu_dmabuf{
+	uint32_t 	magic;
+	uint32_t 	reserved;
+	uint64_t 	phy_addr;
+};
+
+
+/* Private functions */
+void cma_slab_release(void);
+void cma_index_add(void *mem, size_t map_size, const struct cma_chunk *chunks, unsigned count, int flags);
+void cma_index_remove(void *mem);
+void cma_index_release(void);
+uint64_t cma_query_phy_addr(void *mem);
+
+/* Global variables, all protected by the lock */
+static pthread_mutex_t 	cma_emu_lock = PTHREAD_MUTEX_INITIALIZER;
+static int 				cma_emu_fd = -1;		/* simulated physical memory */
+static int 				cma_emu_huge_fd = -1;	/* same on hugetlbfs, -1 if unavailable */
+static struct cma_emu_block *cma_emu_blocks;
+
+/* sorted by physical address */
+static struct cma_emu_range *cma_emu_ranges;
+static unsigned 		cma_emu_range_count, cma_emu_range_capacity;
+
+/* sorted by user-space address */
+static struct cma_emu_mapping *cma_emu_mappings;
+static unsigned 		cma_emu_mapping_count, cma_emu_mapping_capacity;
+
+
+
+/* room for one more element of sorted array */
+static int cma_emu_grow(void **array, unsigned *capacity, unsigned count, size_t elem_size)
+{
+	unsigned new_capacity;
+	void *grown;
+
+	if( count < *capacity )
+		return 0;
+
+	new_capacity = *capacity ? 2 * *capacity : 64;
+	grown = realloc(*array, new_capacity * elem_size);
+	if( grown == NULL )
+		return -1;
+
+	*array 		= grown;
+	*capacity 	= new_capacity;
+
+	return 0;
+}
+
+
+/* first fit of simulated physical memory, called with the lock held */
+static int cma_emu_phys_alloc(uint64_t size, uint64_t align, uint64_t boundary, uint64_t *phy_addr)
+{
+	uint64_t start = CMA_EMU_PHY_BASE, end;
+	unsigned i;
+
+	for(i=0; i<=cma_emu_range_count; i++){
+		end = i < cma_emu_range_count ? cma_emu_ranges[i].phy_addr : CMA_EMU_PHY_BASE + CMA_EMU_SIZE;
+
+		/* boundary is a multiple of align */
+		start = ROUND_UP(start, align);
+		if( boundary && start / boundary != (start + size - 1) / boundary )
+			start = ROUND_UP(start, boundary);
+
+		if( start + size <= end ){
+			if( cma_emu_grow((void**)&cma_emu_ranges, &cma_emu_range_capacity, cma_emu_range_count,
+							 sizeof(struct cma_emu_range)) )
+				return -1;
+
+			memmove(&cma_emu_ranges[i+1], &cma_emu_ranges[i], (cma_emu_range_count - i) * sizeof(struct cma_emu_range));
+			cma_emu_ranges[i].phy_addr 	= start;
+			cma_emu_ranges[i].size 		= size;
+			cma_emu_range_count++;
+
+			*phy_addr = start;
+			return 0;
+		}
+
+		if( i < cma_emu_range_count )
+			start = cma_emu_ranges[i].phy_addr + cma_emu_ranges[i].size;
+	}
+
+	errno = ENOMEM;
+	return -1;
+}
+
+
+/* called with the lock held */
+static void cma_emu_phys_free(uint64_t phy_addr, int hugetlb)
+{
+	unsigned low = 0, high = cma_emu_range_count, mid;
+
+	while( low < high ){
+		mid = low + (high - low) / 2;
+		if( cma_emu_ranges[mid].phy_addr < phy_addr )
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	if( low == cma_emu_range_count || cma_emu_ranges[low].phy_addr != phy_addr )
+		return;
+
+	/* memory is given back and reads as zeroes when allocated again */
+	fallocate(hugetlb ? cma_emu_huge_fd : cma_emu_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+			  phy_addr - CMA_EMU_PHY_BASE, cma_emu_ranges[low].size);
+
+	cma_emu_range_count--;
+	memmove(&cma_emu_ranges[low], &cma_emu_ranges[low+1], (cma_emu_range_count - low) * sizeof(struct cma_emu_range));
+}
+
+
+/* flags checked as by the driver, there is no ACP window and no memory-region */
+static int cma_emu_flags_check(unsigned flags)
+{
+	if( (flags & ~CMA_ALLOC_FLAG_MASK) ||
+		((flags & CMA_FLAG_NONCACHED) && (flags & CMA_FLAG_WRITECOMBINE)) ||
+		((flags & CMA_FLAG_ACP) && (flags & (CMA_FLAG_NONCACHED | CMA_FLAG_WRITECOMBINE))) ){
+		errno = EINVAL;
+		return -1;
+	}
+
+	if( flags & (CMA_FLAG_ACP | CMA_FLAG_CARVEOUT | CMA_ALLOC_FLAG_REGION_MASK) ){
+		errno = ENODEV;
+		return -1;
+	}
+
+	return 0;
+}
+
+
+/* large pages are used for parts of at least a large page, as by the driver */
+static inline int cma_emu_hugepage(unsigned flags, uint64_t size)
+{
+	return (flags & CMA_FLAG_HUGEPAGE) && !(flags & CMA_FLAG_PAGES) && size >= CMA_EMU_HUGEPAGE_SIZE;
+}
+
+
+/* called with the lock held, block is released with cma_emu_block_put() */
+static struct cma_emu_block *cma_emu_block_create(size_t size, unsigned flags, unsigned count)
+{
+	struct cma_emu_block *block;
+
+	block = calloc(1, sizeof(struct cma_emu_block) + count * sizeof(struct cma_chunk));
+	if( block == NULL )
+		return NULL;
+
+	block->refcount = 1;
+	block->flags 	= flags & ~(CMA_FLAG_NOZERO | CMA_FLAG_HUGEPAGE);
+	block->size 	= size;
+
+	block->next 	= cma_emu_blocks;
+	cma_emu_blocks 	= block;
+
+	return block;
+}
+
+
+/* adds physical part to the block, called with the lock held */
+static int cma_emu_block_add(struct cma_emu_block *block, uint64_t size, uint64_t align, uint64_t boundary,
+							 unsigned flags)
+{
+	struct cma_chunk *part = &block->parts[block->count];
+
+	if( align < (uint64_t)getpagesize() )
+		align = getpagesize();
+	if( cma_emu_hugepage(flags, size) && align < CMA_EMU_HUGEPAGE_SIZE )
+		align = CMA_EMU_HUGEPAGE_SIZE;
+
+	if( cma_emu_phys_alloc(size, align, boundary, &part->phy_addr) )
+		return -1;
+
+	part->size = size;
+	block->count++;
+
+	/* large pages are mapped where a part allows it */
+	if( cma_emu_hugepage(flags, size) )
+		block->flags |= CMA_FLAG_HUGEPAGE;
+
+	return 0;
+}
+
+
+/* called with the lock held */
+static void cma_emu_block_put(struct cma_emu_block *block)
+{
+	struct cma_emu_block **link;
+	unsigned i;
+
+	if( --block->refcount )
+		return;
+
+	for(link=&cma_emu_blocks; *link!=block; link=&(*link)->next);
+	*link = block->next;
+
+	for(i=0; i<block->count; i++)
+		cma_emu_phys_free(block->parts[i].phy_addr, block->hugetlb);
+
+	free(block);
+}
+
+
+/* position of the mapping at mem or where it belongs, called with the lock held */
+static unsigned cma_emu_mapping_find(const void *mem)
+{
+	unsigned low = 0, high = cma_emu_mapping_count, mid;
+
+	while( low < high ){
+		mid = low + (high - low) / 2;
+		if( cma_emu_mappings[mid].mem < (const char*)mem )
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	return low;
+}
+
+
+/* block of the mapping at mem, NULL with errno set if there is none */
+static struct cma_emu_block *cma_emu_block_get(const void *mem, size_t *map_size)
+{
+	unsigned pos = cma_emu_mapping_find(mem);
+
+	if( pos == cma_emu_mapping_count || cma_emu_mappings[pos].mem != (const char*)mem ){
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if( map_size != NULL )
+		*map_size = cma_emu_mappings[pos].map_size;
+
+	return cma_emu_mappings[pos].block;
+}
+
+
+/* maps parts of the block back-to-back repeat times */
+static char *cma_emu_map_parts(struct cma_emu_block *block, size_t map_size)
+{
+	size_t align = (block->flags & CMA_FLAG_HUGEPAGE) ? CMA_EMU_HUGEPAGE_SIZE : 0;
+	char *area, *mem, *addr;
+	unsigned i;
+	int fd = block->hugetlb ? cma_emu_huge_fd : cma_emu_fd;
+
+	/* reserve the range first, large pages need it aligned */
+	area = mmap(NULL, map_size + align, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if( area == MAP_FAILED )
+		return NULL;
+
+	mem = align ? (char*)ROUND_UP((uintptr_t)area, align) : area;
+	if( mem != area )
+		munmap(area, mem - area);
+	if( area + align != mem )
+		munmap(mem + map_size, area + align - mem);
+
+	for(addr=mem; addr<mem+map_size; ){
+		for(i=0; i<block->count; i++){
+			if( mmap(addr, block->parts[i].size, PROT_WRITE | PROT_READ, MAP_SHARED | MAP_FIXED, fd,
+					 block->parts[i].phy_addr - CMA_EMU_PHY_BASE) == MAP_FAILED ){
+				munmap(mem, map_size);
+				return NULL;
+			}
+			addr += block->parts[i].size;
+		}
+	}
+
+	if( (block->flags & CMA_FLAG_HUGEPAGE) && !block->hugetlb )
+		madvise(mem, map_size, MADV_HUGEPAGE);
+
+	return mem;
+}
+
+
+/* maps the block, reference of the caller is passed to the mapping */
+static void *cma_emu_map(struct cma_emu_block *block, unsigned repeat)
+{
+	size_t map_size = repeat * block->size;
+	unsigned i, pos;
+	char 	*mem;
+
+	/* hugetlbfs is tried for the first mapping, it fails without free large pages */
+	if( block->refcount == 1 && (block->flags & CMA_FLAG_HUGEPAGE) && cma_emu_huge_fd != -1 ){
+		block->hugetlb = 1;
+		for(i=0; i<block->count; i++)
+			if( (block->parts[i].phy_addr | block->parts[i].size) & (CMA_EMU_HUGEPAGE_SIZE - 1) )
+				block->hugetlb = 0;
+	}
+
+	mem = cma_emu_map_parts(block, map_size);
+	if( mem == NULL && block->hugetlb && block->refcount == 1 ){
+		block->hugetlb = 0;
+		mem = cma_emu_map_parts(block, map_size);
+	}
+
+	pthread_mutex_lock(&cma_emu_lock);
+
+	if( mem == NULL )
+		goto error;
+
+	if( cma_emu_grow((void**)&cma_emu_mappings, &cma_emu_mapping_capacity, cma_emu_mapping_count,
+					 sizeof(struct cma_emu_mapping)) ){
+		munmap(mem, map_size);
+		goto error;
+	}
+
+	pos = cma_emu_mapping_find(mem);
+	memmove(&cma_emu_mappings[pos+1], &cma_emu_mappings[pos], (cma_emu_mapping_count - pos) * sizeof(struct cma_emu_mapping));
+	cma_emu_mappings[pos].mem 		= mem;
+	cma_emu_mappings[pos].map_size 	= map_size;
+	cma_emu_mappings[pos].block 	= block;
+	cma_emu_mapping_count++;
+
+	pthread_mutex_unlock(&cma_emu_lock);
+
+	/* parts of a mapped block do not change */
+	cma_index_add(mem, map_size, block->parts, block->count, block->flags);
+
+	return mem;
+
+
+error:
+	__DEBUG("cma_emu_map - mapping unsuccsessful\n");
+	cma_emu_block_put(block);
+	pthread_mutex_unlock(&cma_emu_lock);
+
+	return NULL;
+}
+
+
+static int cma_emu_unmap(void *mem)
+{
+	struct cma_emu_block *block;
+	size_t 	map_size;
+	unsigned pos;
+
+	pthread_mutex_lock(&cma_emu_lock);
+
+	block = cma_emu_block_get(mem, &map_size);
+	if( block == NULL ){
+		pthread_mutex_unlock(&cma_emu_lock);
+		__DEBUG("cma_emu_unmap - %p is not mapped\n", mem);
+		return -1;
+	}
+
+	pos = cma_emu_mapping_find(mem);
+	cma_emu_mapping_count--;
+	memmove(&cma_emu_mappings[pos], &cma_emu_mappings[pos+1], (cma_emu_mapping_count - pos) * sizeof(struct cma_emu_mapping));
+
+	pthread_mutex_unlock(&cma_emu_lock);
+
+	/* physical memory is reused only after it is unmapped */
+	cma_index_remove(mem);
+	munmap(mem, map_size);
+
+	pthread_mutex_lock(&cma_emu_lock);
+	cma_emu_block_put(block);
+	pthread_mutex_unlock(&cma_emu_lock);
+
+	return 0;
+}
+
+
+
+int cma_init(void)
+{
+	__DEBUG("Creating 0x%llx bytes of simulated memory at 0x%llx\n",
+		(unsigned long long)CMA_EMU_SIZE, (unsigned long long)CMA_EMU_PHY_BASE);
+
+	cma_emu_fd = memfd_create("cma_emu", MFD_CLOEXEC);
+	if( cma_emu_fd == -1 ){
+		__DEBUG("Failed to initialize api - \"%s\"\n", strerror(errno));
+		return -1;
+	}
+
+	if( ftruncate(cma_emu_fd, CMA_EMU_SIZE) == -1 ){
+		__DEBUG("Failed to initialize api - \"%s\"\n", strerror(errno));
+		close(cma_emu_fd);
+		cma_emu_fd = -1;
+		return -1;
+	}
+
+	/* optional, hugepage allocations fall back to transparent huge pages */
+	cma_emu_huge_fd = memfd_create("cma_emu_huge", MFD_CLOEXEC | MFD_HUGETLB);
+	if( cma_emu_huge_fd != -1 && ftruncate(cma_emu_huge_fd, CMA_EMU_SIZE) == -1 ){
+		close(cma_emu_huge_fd);
+		cma_emu_huge_fd = -1;
+	}
+
+	return 0;
+}
+
+/* emulation follows the interface of the current driver */
+int cma_get_version(void)
+{
+	return CMA_IOCTL_VERSION;
+}
+
+int cma_release(void)
+{
+	struct cma_emu_block *block;
+
+	__DEBUG("Releasing simulated memory\n");
+
+	/* arenas of sub-allocated blocks */
+	cma_slab_release();
+	cma_index_release();
+
+	pthread_mutex_lock(&cma_emu_lock);
+
+	/* as with the driver, memory which is still mapped stays valid */
+	while( (block = cma_emu_blocks) != NULL ){
+		cma_emu_blocks = block->next;
+		free(block);
+	}
+
+	free(cma_emu_ranges);
+	free(cma_emu_mappings);
+	cma_emu_ranges 		= NULL;
+	cma_emu_mappings 	= NULL;
+	cma_emu_range_count = cma_emu_range_capacity = 0;
+	cma_emu_mapping_count = cma_emu_mapping_capacity = 0;
+
+	if( cma_emu_huge_fd != -1 )
+		close(cma_emu_huge_fd);
+	close(cma_emu_fd);
+	cma_emu_fd = cma_emu_huge_fd = -1;
+
+	pthread_mutex_unlock(&cma_emu_lock);
+
+	return 0;
+}
+
+
+
+void *cma_alloc_cached(size_t size)
+{
+	return cma_alloc_ext(size, CMA_FLAG_CACHED);
+}
+
+void *cma_alloc_noncached(size_t size)
+{
+	return cma_alloc_ext(size, CMA_FLAG_NONCACHED);
+}
+
+void *cma_alloc_writecombine(size_t size)
+{
+	return cma_alloc_ext(size, CMA_FLAG_WRITECOMBINE);
+}
+
+
+void *cma_alloc_ext(size_t size, unsigned flags)
+{
+	return cma_alloc_aligned(size, 0, 0, flags);
+}
+
+
+void *cma_alloc_aligned(size_t size, size_t align, uint64_t boundary, unsigned flags)
+{
+	struct cma_emu_block *block;
+	__DEBUG("Allocating 0x%zx bytes of simulated memory, align 0x%zx, boundary 0x%llx, flags 0x%x\n",
+		size, align, (unsigned long long)boundary, flags);
+
+	/* Page align size */
+	size = ROUND_UP(size, getpagesize());
+
+	if( size == 0 || (align & (align - 1)) || (boundary & (boundary - 1)) ||
+		(boundary && (boundary < size || boundary < align)) ){
+		errno = EINVAL;
+		return NULL;
+	}
+	if( cma_emu_flags_check(flags) )
+		return NULL;
+
+	pthread_mutex_lock(&cma_emu_lock);
+
+	block = cma_emu_block_create(size, flags, 1);
+	if( block == NULL )
+		goto error;
+
+	if( cma_emu_block_add(block, size, align, boundary, flags) ){
+		cma_emu_block_put(block);
+		goto error;
+	}
+
+	pthread_mutex_unlock(&cma_emu_lock);
+
+	return cma_emu_map(block, 1);
+
+
+error:
+	pthread_mutex_unlock(&cma_emu_lock);
+	__DEBUG("cma_alloc_aligned - no simulated memory\n");
+
+	return NULL;
+}
+
+
+void *cma_alloc_ring(unsigned count, size_t size, unsigned flags, void **out_ptrs, uint64_t *out_phys)
+{
+	struct cma_emu_block *block;
+	unsigned i;
+	char 	*mem;
+	__DEBUG("Allocating ring of %u x 0x%zx bytes of simulated memory, flags 0x%x\n", count, size, flags);
+
+	/* Page align size, buffers are mapped back-to-back */
+	size = ROUND_UP(size, getpagesize());
+
+	if( size == 0 || count == 0 || count > CMA_RING_MAX_COUNT ){
+		errno = EINVAL;
+		return NULL;
+	}
+	if( cma_emu_flags_check(flags) )
+		return NULL;
+
+	pthread_mutex_lock(&cma_emu_lock);
+
+	block = cma_emu_block_create((size_t)count * size, flags, count);
+	if( block == NULL ){
+		pthread_mutex_unlock(&cma_emu_lock);
+		return NULL;
+	}
+
+	for(i=0; i<count; i++){
+		if( cma_emu_block_add(block, size, 0, 0, flags) ){
+			cma_emu_block_put(block);
+			pthread_mutex_unlock(&cma_emu_lock);
+			return NULL;
+		}
+	}
+
+	pthread_mutex_unlock(&cma_emu_lock);
+
+	mem = cma_emu_map(block, 1);
+	if( mem == NULL )
+		return NULL;
+
+	for(i=0; i<count; i++){
+		if(out_ptrs != NULL)
+			out_ptrs[i] = mem + (size_t)i * size;
+		if(out_phys != NULL)
+			out_phys[i] = block->parts[i].phy_addr;
+	}
+
+	return mem;
+}
+
+
+void *cma_alloc_mirrored(size_t size, unsigned flags)
+{
+	struct cma_emu_block *block;
+	__DEBUG("Allocating 0x%zx bytes of mirrored simulated memory, flags 0x%x\n", size, flags);
+
+	/* Page align size, halves of the mapping have to be adjacent */
+	size = ROUND_UP(size, getpagesize());
+
+	if( size == 0 ){
+		errno = EINVAL;
+		return NULL;
+	}
+	if( cma_emu_flags_check(flags) )
+		return NULL;
+
+	pthread_mutex_lock(&cma_emu_lock);
+
+	block = cma_emu_block_create(size, flags, 1);
+	if( block == NULL || cma_emu_block_add(block, size, 0, 0, flags) ){
+		if( block != NULL )
+			cma_emu_block_put(block);
+		pthread_mutex_unlock(&cma_emu_lock);
+		return NULL;
+	}
+
+	pthread_mutex_unlock(&cma_emu_lock);
+
+	return cma_emu_map(block, 2);
+}
+
+
+int cma_free_mirrored(void *mem)
+{
+	return cma_emu_unmap(mem);
+}
+
+
+void *cma_alloc_chunked(size_t size, size_t min_chunk, unsigned flags,
+						struct cma_chunk *chunks, unsigned max_chunks, unsigned *count)
+{
+	struct cma_emu_block *block;
+	size_t 	remaining, chunk;
+	char 	*mem;
+	__DEBUG("Allocating 0x%zx bytes of chunked simulated memory, min chunk 0x%zx, flags 0x%x\n", size, min_chunk, flags);
+
+	/* Page align size, chunks are mapped back-to-back */
+	size = ROUND_UP(size, getpagesize());
+
+	if( size == 0 || max_chunks == 0 || max_chunks > CMA_CHUNK_MAX_COUNT ||
+		(min_chunk & (min_chunk - 1)) || min_chunk > size ){
+		errno = EINVAL;
+		return NULL;
+	}
+	if( cma_emu_flags_check(flags) )
+		return NULL;
+
+	if( min_chunk < (size_t)getpagesize() )
+		min_chunk = getpagesize();
+
+	pthread_mutex_lock(&cma_emu_lock);
+
+	block = cma_emu_block_create(size, flags, max_chunks);
+	if( block == NULL )
+		goto error;
+
+	/* as by the driver, chunk which failed is not tried again and the
+	 * following ones are at most of the size which succeeded last */
+	remaining 	= size;
+	chunk 		= size;
+	while( remaining > 0 ){
+		if( block->count == max_chunks ){
+			errno = ENOSPC;
+			goto error_block;
+		}
+
+		if( chunk > remaining )
+			chunk = remaining;
+
+		if( cma_emu_block_add(block, chunk, 0, 0, flags) ){
+			if( errno != ENOMEM || chunk <= min_chunk )
+				goto error_block;
+
+			/* largest power of two below chunk */
+			for(chunk=chunk-1; chunk & (chunk - 1); chunk &= chunk - 1);
+			if( chunk < min_chunk )
+				chunk = min_chunk;
+			continue;
+		}
+
+		remaining -= chunk;
+	}
+
+	pthread_mutex_unlock(&cma_emu_lock);
+
+	mem = cma_emu_map(block, 1);
+	if( mem == NULL )
+		return NULL;
+
+	memcpy(chunks, block->parts, block->count * sizeof(struct cma_chunk));
+	if(count != NULL)
+		*count = block->count;
+
+	return mem;
+
+
+error_block:
+	cma_emu_block_put(block);
+error:
+	pthread_mutex_unlock(&cma_emu_lock);
+	__DEBUG("cma_alloc_chunked - no simulated memory\n");
+
+	return NULL;
+}
+
+
+int cma_get_chunks(void *mem, struct cma_chunk *chunks, unsigned max_chunks)
+{
+	struct cma_emu_block *block;
+	int count;
+
+	pthread_mutex_lock(&cma_emu_lock);
+
+	block = cma_emu_block_get(mem, NULL);
+	if( block == NULL ){
+		pthread_mutex_unlock(&cma_emu_lock);
+		return -1;
+	}
+
+	memcpy(chunks, block->parts, (max_chunks < block->count ? max_chunks : block->count) * sizeof(struct cma_chunk));
+	count = block->count;
+
+	pthread_mutex_unlock(&cma_emu_lock);
+
+	return count;
+}
+
+
+void *cma_alloc_mmap(size_t size, unsigned flags)
+{
+	return cma_alloc_ext(size, flags);
+}
+
+
+int cma_free_mmap(void *mem, size_t size)
+{
+	struct cma_emu_block *block;
+	size_t 	map_size = 0;
+
+	/* mappings are released whole, size has to cover the allocation */
+	pthread_mutex_lock(&cma_emu_lock);
+	block = cma_emu_block_get(mem, &map_size);
+	pthread_mutex_unlock(&cma_emu_lock);
+
+	if( block == NULL || size == 0 || ROUND_UP(size, getpagesize()) > map_size ){
+		__DEBUG("cma_free_mmap - %p is not mapped with size %zu\n", mem, size);
+		errno = EINVAL;
+		return -1;
+	}
+
+	return cma_emu_unmap(mem);
+}
+
+
+int cma_export_fd(void *mem)
+{
+	struct cma_emu_block *block;
+	struct cma_emu_dmabuf handle;
+	int fd;
+
+	memset(&handle, 0, sizeof(handle));
+	handle.magic = CMA_EMU_DMABUF_MAGIC;
+
+	pthread_mutex_lock(&cma_emu_lock);
+	block = cma_emu_block_get(mem, NULL);
+	if( block != NULL )
+		handle.phy_addr = block->parts[0].phy_addr;
+	pthread_mutex_unlock(&cma_emu_lock);
+
+	if( block == NULL )
+		return -1;
+
+	/* memory is identified by its physical address */
+	fd = memfd_create("cma_emu_dmabuf", MFD_CLOEXEC);
+	if( fd == -1 )
+		return -1;
+
+	if( pwrite(fd, &handle, sizeof(handle), 0) != sizeof(handle) ){
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+
+void *cma_import_fd(int fd, size_t *size)
+{
+	struct cma_emu_block *block;
+	struct cma_emu_dmabuf handle;
+	char 	*mem;
+
+	if( pread(fd, &handle, sizeof(handle), 0) != sizeof(handle) || handle.magic != CMA_EMU_DMABUF_MAGIC ){
+		errno = EINVAL;
+		return NULL;
+	}
+
+	pthread_mutex_lock(&cma_emu_lock);
+
+	for(block=cma_emu_blocks; block!=NULL; block=block->next)
+		if( block->parts[0].phy_addr == handle.phy_addr )
+			break;
+
+	if( block == NULL ){
+		pthread_mutex_unlock(&cma_emu_lock);
+		__DEBUG("cma_import_fd - memory is not mapped anymore\n");
+		errno = ENOENT;
+		return NULL;
+	}
+	block->refcount++;
+
+	pthread_mutex_unlock(&cma_emu_lock);
+
+	mem = cma_emu_map(block, 1);
+	if( mem == NULL )
+		return NULL;
+
+	if(size != NULL)
+		*size = block->size;
+
+	return mem;
+}
+
+
+int cma_free(void *mem)
+{
+	return cma_emu_unmap(mem);
+}
+
+
+/* memory of the host is coherent, only the range is checked */
+static int cma_emu_sync(void *mem, size_t offset, size_t len)
+{
+	size_t map_size = 0;
+	int err = 0;
+
+	pthread_mutex_lock(&cma_emu_lock);
+	if( cma_emu_block_get(mem, &map_size) == NULL )
+		err = -1;
+	pthread_mutex_unlock(&cma_emu_lock);
+
+	if( !err && (offset > map_size || len > map_size - offset) ){
+		errno = EINVAL;
+		err = -1;
+	}
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	return err;
+}
+
+int cma_sync_for_device(void *mem, size_t offset, size_t len)
+{
+	return cma_emu_sync(mem, offset, len);
+}
+
+int cma_sync_for_cpu(void *mem, size_t offset, size_t len)
+{
+	return cma_emu_sync(mem, offset, len);
+}
+
+
+int cma_get_flags(void *mem)
+{
+	struct cma_emu_block *block;
+	int flags = -1;
+
+	pthread_mutex_lock(&cma_emu_lock);
+	block = cma_emu_block_get(mem, NULL);
+	if( block != NULL )
+		flags = block->flags;
+	pthread_mutex_unlock(&cma_emu_lock);
+
+	return flags;
+}
+
+
+unsigned cma_get_phy_addr(void *mem)
+{
+	uint64_t phy_addr = cma_get_phy_addr64(mem);
+
+	/* does not fit, caller has to use cma_get_phy_addr64() */
+	if( phy_addr > UINT32_MAX ){
+		__DEBUG("cma_get_phy_addr - physical address above 4 GB\n");
+		return 0;
+	}
+
+	return phy_addr;
+}
+
+
+uint64_t cma_get_phy_addr64(void *mem)
+{
+	uint64_t phy_addr;
+
+	phy_addr = cma_virt_to_phys(mem);
+	if( phy_addr != 0 )
+		return phy_addr;
+
+	return cma_query_phy_addr(mem);
+}
+
+
+uint64_t cma_query_phy_addr(void *mem)
+{
+	struct cma_emu_block *block;
+	uint64_t phy_addr = 0;
+
+	pthread_mutex_lock(&cma_emu_lock);
+	block = cma_emu_block_get(mem, NULL);
+	if( block != NULL )
+		phy_addr = block->parts[0].phy_addr;
+	pthread_mutex_unlock(&cma_emu_lock);
+
+	return phy_addr;
+}
+
+
+/* there is no ACP window, device sees physical addresses */
+uint64_t cma_get_dma_addr(void *mem)
+{
+	return cma_get_phy_addr64(mem);
+}
+
+
+/* there is no memory-region */
+int cma_get_region(const char *name)
+{
+	(void)name;
+
+	errno = ENOENT;
+	return -1;
+}
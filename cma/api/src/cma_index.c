@@ -0,0 +1,433 @@
+/* cma_index.c - user-space index of allocations by virtual address.
+ *
+ *
+ * The MIT License (MIT)
+ *
+ * COPYRIGHT (C) 2017 Institute of Electronics and Computer Science (EDI), Latvia.
+ * AUTHOR: Rihards Novickis (rihards.novickis@edi.lv)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ *
+ * DESCRIPTION:
+ * Every mapping made by the api is recorded as physically contigous intervals
+ * of user-space addresses, one per chunk of the allocation (two per chunk for
+ * mirrored mappings), kept in an array sorted by address. Address inside any
+ * interval is translated by binary search without a system call. Flags of the
+ * allocation are recorded too, copy routines choose kernels by them.
+ *
+ * Allocation calls hand over what the driver returned, only chunked
+ * allocations with too small a chunk table and imported dma-bufs are queried.
+ * Physical address of memory allocated by mmap() alone is not known, it is
+ * queried and recorded on its first translation.
+ *
+ * Readers take no lock. Writers are serialized by a mutex and publish changes
+ * through a sequence counter, readers retry when it changed during the search.
+ * Array which is too small is replaced by a larger copy, old one is kept until
+ * cma_release() since readers can still be searching it.
+ *
+ * For API interface documentation refer to "include/cma_api.h" header file.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "cma.h"
+#include "cma_api.h"
+
+
+#ifndef CMA_DEBUG
+	#define CMA_DEBUG 			0
+#endif
+
+#if CMA_DEBUG == 1
+	#define __DEBUG(fmt, args...)	printf("CMA_API_DEBUG: " fmt, ##args)
+#else
+	#define __DEBUG(fmt,args...)
+#endif
+
+#define CMA_INDEX_MIN_CAPACITY 	64
+#define CMA_INDEX_CHUNKS 		16		/* chunks queried without heap allocation */
+
+
+/* Physically contigous interval [start, end) of a mapping */
+struct cma_index_entry{
+	uintptr_t 	start;
+	uintptr_t 	end;
+	uint64_t 	phy_addr;	/* physical address of start */
+	uintptr_t 	owner;		/* address the allocation was mapped at */
+	int 		flags;		/* CMA_FLAG_* of the allocation */
+};
+
+struct cma_index_table{
+	struct cma_index_table *retired;	/* replaced tables, freed on release */
+	unsigned 	count;
+	unsigned 	capacity;
+	struct cma_index_entry entries[];
+};
+
+
+/* Private functions */
+void 	cma_index_add		(void *mem, size_t map_size, const struct cma_chunk *chunks, unsigned count, int flags);
+void 	cma_index_query		(void *mem, size_t map_size, int flags);
+void 	cma_index_remove	(void *mem);
+void 	cma_index_release	(void);
+int 	cma_index_flags		(const void *ptr);
+uint64_t cma_query_phy_addr	(void *mem);
+
+/* Global variables */
+static pthread_mutex_t 	cma_index_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct cma_index_table *cma_index_table;
+static unsigned 		cma_index_seq;		/* odd while table is being modified */
+
+
+
+/* entries are accessed atomically, they are read while being shifted */
+static inline void cma_index_entry_store(struct cma_index_entry *dst, const struct cma_index_entry *src)
+{
+	__atomic_store_n(&dst->start, 	 src->start, 	__ATOMIC_RELAXED);
+	__atomic_store_n(&dst->end, 	 src->end, 		__ATOMIC_RELAXED);
+	__atomic_store_n(&dst->phy_addr, src->phy_addr, __ATOMIC_RELAXED);
+	__atomic_store_n(&dst->owner, 	 src->owner, 	__ATOMIC_RELAXED);
+	__atomic_store_n(&dst->flags, 	 src->flags, 	__ATOMIC_RELAXED);
+}
+
+
+static inline void cma_index_write_begin(void)
+{
+	__atomic_store_n(&cma_index_seq, cma_index_seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+
+static inline void cma_index_write_end(void)
+{
+	__atomic_store_n(&cma_index_seq, cma_index_seq + 1, __ATOMIC_RELEASE);
+}
+
+
+/* first entry which starts above the address */
+static unsigned cma_index_upper(const struct cma_index_table *table, unsigned count, uintptr_t addr)
+{
+	unsigned low = 0, high = count, mid;
+
+	while( low < high ){
+		mid = low + (high - low) / 2;
+		if( __atomic_load_n(&table->entries[mid].start, __ATOMIC_RELAXED) <= addr )
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	return low;
+}
+
+
+/* called with the lock held, table is replaced if it is full */
+static int cma_index_insert(const struct cma_index_entry *entry)
+{
+	struct cma_index_table *table = cma_index_table, *grown;
+	unsigned capacity, pos, i;
+
+	if( table == NULL || table->count == table->capacity ){
+		capacity = table != NULL ? 2 * table->capacity : CMA_INDEX_MIN_CAPACITY;
+
+		grown = malloc(sizeof(struct cma_index_table) + capacity * sizeof(struct cma_index_entry));
+		if( grown == NULL )
+			return -1;
+
+		grown->retired 	= table;
+		grown->count 	= 0;
+		grown->capacity = capacity;
+		if( table != NULL ){
+			memcpy(grown->entries, table->entries, table->count * sizeof(struct cma_index_entry));
+			grown->count = table->count;
+		}
+
+		/* copy is complete before readers can see it, old one stays intact */
+		__atomic_store_n(&cma_index_table, grown, __ATOMIC_RELEASE);
+		table = grown;
+	}
+
+	pos = cma_index_upper(table, table->count, entry->start);
+
+	cma_index_write_begin();
+	for(i=table->count; i>pos; i--)
+		cma_index_entry_store(&table->entries[i], &table->entries[i-1]);
+	cma_index_entry_store(&table->entries[pos], entry);
+	__atomic_store_n(&table->count, table->count + 1, __ATOMIC_RELAXED);
+	cma_index_write_end();
+
+	return 0;
+}
+
+
+/* records chunks of the mapping, map_size is twice the allocation size for
+ * mirrored mapping. Chunk with physical address 0 is resolved on translation.
+ * Memory which is not indexed is translated by the driver. */
+void cma_index_add(void *mem, size_t map_size, const struct cma_chunk *chunks, unsigned count, int flags)
+{
+	struct cma_index_entry entry;
+	uintptr_t start = (uintptr_t)mem;
+	unsigned i;
+	int err = 0;
+
+	if( count == 0 )
+		return;
+
+	entry.owner = (uintptr_t)mem;
+	entry.flags = flags;
+
+	pthread_mutex_lock(&cma_index_lock);
+
+	while( start < (uintptr_t)mem + map_size && !err ){
+		for(i=0; i<count && !err; i++){
+			entry.start 	= start;
+			entry.end 		= start + chunks[i].size;
+			entry.phy_addr 	= chunks[i].phy_addr;
+			err = cma_index_insert(&entry);
+
+			start = entry.end;
+		}
+	}
+
+	pthread_mutex_unlock(&cma_index_lock);
+
+	/* partially indexed mapping would be translated only partially */
+	if( err )
+		cma_index_remove(mem);
+}
+
+
+/* records chunks the driver reports, for allocations whose chunks the caller
+ * does not know */
+void cma_index_query(void *mem, size_t map_size, int flags)
+{
+	struct cma_chunk local[CMA_INDEX_CHUNKS], *chunks = local;
+	int count;
+
+	count = cma_get_chunks(mem, chunks, CMA_INDEX_CHUNKS);
+	if( count > CMA_INDEX_CHUNKS ){
+		chunks = malloc(count * sizeof(struct cma_chunk));
+		if( chunks == NULL )
+			return;
+
+		count = cma_get_chunks(mem, chunks, count);
+	}
+
+	if( count > 0 )
+		cma_index_add(mem, map_size, chunks, count, flags);
+
+	if( chunks != local )
+		free(chunks);
+}
+
+
+/* records physical address of a single chunk allocation mapped at owner */
+static int cma_index_resolve(uintptr_t owner)
+{
+	struct cma_index_table *table;
+	struct cma_index_entry *entry;
+	uint64_t phy_addr;
+	unsigned i;
+
+	phy_addr = cma_query_phy_addr((void*)owner);
+	if( phy_addr == 0 )
+		return -1;
+
+	pthread_mutex_lock(&cma_index_lock);
+
+	table = cma_index_table;
+	cma_index_write_begin();
+	for(i=0; table!=NULL && i<table->count; i++){
+		entry = &table->entries[i];
+		if( entry->owner == owner && entry->phy_addr == 0 )
+			__atomic_store_n(&entry->phy_addr, phy_addr + (entry->start - owner), __ATOMIC_RELAXED);
+	}
+	cma_index_write_end();
+
+	pthread_mutex_unlock(&cma_index_lock);
+
+	return 0;
+}
+
+
+void cma_index_remove(void *mem)
+{
+	struct cma_index_table *table;
+	unsigned i, kept = 0;
+
+	pthread_mutex_lock(&cma_index_lock);
+
+	table = cma_index_table;
+	if( table == NULL )
+		goto leave;
+
+	cma_index_write_begin();
+	for(i=0; i<table->count; i++){
+		if( table->entries[i].owner == (uintptr_t)mem )
+			continue;
+
+		if( kept != i )
+			cma_index_entry_store(&table->entries[kept], &table->entries[i]);
+		kept++;
+	}
+	__atomic_store_n(&table->count, kept, __ATOMIC_RELAXED);
+	cma_index_write_end();
+
+leave:
+	pthread_mutex_unlock(&cma_index_lock);
+}
+
+
+/* called by cma_release(), no other thread may translate anymore */
+void cma_index_release(void)
+{
+	struct cma_index_table *table, *retired;
+
+	pthread_mutex_lock(&cma_index_lock);
+
+	table = cma_index_table;
+	__atomic_store_n(&cma_index_table, NULL, __ATOMIC_RELEASE);
+
+	while( table != NULL ){
+		retired = table->retired;
+		free(table);
+		table = retired;
+	}
+
+	pthread_mutex_unlock(&cma_index_lock);
+}
+
+
+/* interval containing addr, NULL if there is none */
+static inline const struct cma_index_entry *cma_index_find(const struct cma_index_table *table, unsigned count, uintptr_t addr)
+{
+	const struct cma_index_entry *entry;
+	unsigned pos = cma_index_upper(table, count, addr);
+
+	if( pos == 0 )
+		return NULL;
+
+	entry = &table->entries[pos-1];
+	if( addr >= __atomic_load_n(&entry->end, __ATOMIC_RELAXED) )
+		return NULL;
+
+	return entry;
+}
+
+
+/* mapping type for copy kernels, -1 for memory not mapped by this api */
+int cma_index_flags(const void *ptr)
+{
+	const struct cma_index_table *table;
+	const struct cma_index_entry *entry;
+	unsigned seq, entries;
+	int flags;
+
+	do{
+		seq = __atomic_load_n(&cma_index_seq, __ATOMIC_ACQUIRE);
+		if( seq & 1 )
+			continue;
+
+		table 	= __atomic_load_n(&cma_index_table, __ATOMIC_ACQUIRE);
+		entries = table != NULL ? __atomic_load_n(&table->count, __ATOMIC_RELAXED) : 0;
+		entry 	= entries ? cma_index_find(table, entries, (uintptr_t)ptr) : NULL;
+		flags 	= entry != NULL ? __atomic_load_n(&entry->flags, __ATOMIC_RELAXED) : -1;
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while( (seq & 1) || __atomic_load_n(&cma_index_seq, __ATOMIC_RELAXED) != seq );
+
+	return flags;
+}
+
+
+/* translates the array against one state of the index, owner of an entry
+ * whose physical address is not known yet is stored in unresolved */
+static void cma_index_translate(void *const *ptrs, uint64_t *phy_addrs, unsigned count, uintptr_t *unresolved)
+{
+	const struct cma_index_table *table;
+	const struct cma_index_entry *entry;
+	unsigned seq, entries, i;
+	uint64_t phy_addr;
+
+	do{
+		seq = __atomic_load_n(&cma_index_seq, __ATOMIC_ACQUIRE);
+		if( seq & 1 )
+			continue;
+
+		table 	= __atomic_load_n(&cma_index_table, __ATOMIC_ACQUIRE);
+		entries = table != NULL ? __atomic_load_n(&table->count, __ATOMIC_RELAXED) : 0;
+		*unresolved = 0;
+
+		for(i=0; i<count; i++){
+			entry 	 = entries ? cma_index_find(table, entries, (uintptr_t)ptrs[i]) : NULL;
+			phy_addr = entry != NULL ? __atomic_load_n(&entry->phy_addr, __ATOMIC_RELAXED) : 0;
+			if( entry != NULL && phy_addr == 0 )
+				*unresolved = __atomic_load_n(&entry->owner, __ATOMIC_RELAXED);
+
+			phy_addrs[i] = phy_addr == 0 ? 0 : phy_addr +
+				((uintptr_t)ptrs[i] - __atomic_load_n(&entry->start, __ATOMIC_RELAXED));
+		}
+
+		/* searched entries were not shifted meanwhile */
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while( (seq & 1) || __atomic_load_n(&cma_index_seq, __ATOMIC_RELAXED) != seq );
+}
+
+
+unsigned cma_virt_to_phys_bulk(void *const *ptrs, uint64_t *phy_addrs, unsigned count)
+{
+	uintptr_t unresolved, owner;
+	unsigned i, found;
+
+	cma_index_translate(ptrs, phy_addrs, count, &unresolved);
+
+	/* memory allocated by mmap() alone is resolved on its first translation */
+	for(i=0; i<count && unresolved != 0; i++){
+		if( phy_addrs[i] != 0 )
+			continue;
+
+		cma_index_translate(&ptrs[i], &phy_addrs[i], 1, &owner);
+		if( owner != 0 && cma_index_resolve(owner) == 0 )
+			cma_index_translate(&ptrs[i], &phy_addrs[i], 1, &owner);
+	}
+
+	for(i=0, found=0; i<count; i++)
+		if( phy_addrs[i] != 0 )
+			found++;
+
+	return found;
+}
+
+
+uint64_t cma_virt_to_phys(const void *ptr)
+{
+	uint64_t phy_addr;
+	void *mem = (void*)ptr;
+
+	cma_virt_to_phys_bulk(&mem, &phy_addr, 1);
+
+	return phy_addr;
+}
@@ -0,0 +1,495 @@
+/* cma_slab.c - sub-allocator of small blocks from large CMA arenas.
+ *
+ *
+ * The MIT License (MIT)
+ *
+ * COPYRIGHT (C) 2017 Institute of Electronics and Computer Science (EDI), Latvia.
+ * AUTHOR: Rihards Novickis (rihards.novickis@edi.lv)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ *
+ * DESCRIPTION:
+ * Arenas of CMA_SLAB_ARENA_SIZE are allocated with cma_alloc_ext() per memory
+ * type and cut into slabs of CMA_SLAB_SIZE. Every slab serves a single power
+ * of two size class, starting from the cache line size, so blocks never share
+ * a cache line. Free blocks are tracked out of band in ordinary memory, the
+ * contigous memory itself is never touched by the allocator, which matters for
+ * noncached memory.
+ *
+ * Each thread keeps a small stack of free blocks per size class and exchanges
+ * batches of CMA_SLAB_BATCH blocks with the global list of the class under its
+ * lock, so most allocations and releases take neither lock nor system call.
+ * Thread caches are given back when the thread exits. Slabs are not returned
+ * to the driver before cma_release().
+ *
+ * For API interface documentation refer to "include/cma_api.h" header file.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "cma.h"
+#include "cma_api.h"
+
+
+#ifndef CMA_DEBUG
+	#define CMA_DEBUG 			0
+#endif
+
+#if CMA_DEBUG == 1
+	#define __DEBUG(fmt, args...)	printf("CMA_API_DEBUG: " fmt, ##args)
+#else
+	#define __DEBUG(fmt,args...)
+#endif
+
+#define CMA_SLAB_ARENA_SIZE 	(2*1024*1024)
+#define CMA_SLAB_SIZE 			(64*1024)
+#define CMA_SLAB_PER_ARENA 		(CMA_SLAB_ARENA_SIZE / CMA_SLAB_SIZE)
+#define CMA_SLAB_MAX_ARENAS 	256
+
+/* size classes, from cache line to half of the slab */
+#define CMA_SLAB_MIN_SHIFT 		6
+#define CMA_SLAB_MAX_SHIFT 		15
+#define CMA_SLAB_CLASSES 		(CMA_SLAB_MAX_SHIFT - CMA_SLAB_MIN_SHIFT + 1)
+
+/* cached, noncached and write-combined arenas */
+#define CMA_SLAB_TYPES 			3
+
+/* blocks moved between thread cache and global list at once */
+#define CMA_SLAB_BATCH 			16
+#define CMA_SLAB_TCACHE_SIZE 	(2*CMA_SLAB_BATCH)
+
+
+/* Contigous allocation slabs are cut from */
+struct cma_slab_arena{
+	char 		*base;		/* user-space address */
+	uint64_t 	phy_addr;	/* physical address */
+	int 		type;		/* index of cma_slab_type_flags */
+	unsigned 	used;		/* slabs given to size classes */
+	unsigned char cls[CMA_SLAB_PER_ARENA];	/* size class of every used slab */
+};
+
+/* Free blocks of one type and size class */
+struct cma_slab_list{
+	pthread_mutex_t lock;
+	void 		**blocks;
+	unsigned 	count;
+	unsigned 	capacity;
+};
+
+/* Free blocks cached by a thread */
+struct cma_slab_tcache{
+	void 		*blocks[CMA_SLAB_TCACHE_SIZE];
+	unsigned 	count;
+};
+
+
+/* Private functions */
+static void 	cma_slab_init			(void);
+static void 	cma_slab_thread_init	(void);
+static void 	cma_slab_thread_exit	(void *tcache);
+static int 		cma_slab_refill			(int type, int cls, struct cma_slab_tcache *tc);
+static void 	cma_slab_flush			(int type, int cls, struct cma_slab_tcache *tc, unsigned count);
+static struct cma_slab_arena *cma_slab_take	(int type, int cls, unsigned *slab);
+void 			cma_slab_release		(void);
+
+/* Global variables */
+static const unsigned 	cma_slab_type_flags[CMA_SLAB_TYPES] = {CMA_FLAG_CACHED, CMA_FLAG_NONCACHED, CMA_FLAG_WRITECOMBINE};
+static pthread_once_t 	cma_slab_once = PTHREAD_ONCE_INIT;
+static pthread_key_t 	cma_slab_key;
+static pthread_mutex_t 	cma_slab_arena_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct cma_slab_list cma_slab_lists[CMA_SLAB_TYPES][CMA_SLAB_CLASSES];
+
+/* arenas are only appended until cma_release(), readers do not lock */
+static struct cma_slab_arena *cma_slab_arenas[CMA_SLAB_MAX_ARENAS];
+static unsigned 		cma_slab_arena_count;
+
+/* thread caches of previous generation are dropped, it changes on release */
+static unsigned 		cma_slab_generation = 1;
+static __thread unsigned cma_slab_thread_generation;
+static __thread struct cma_slab_tcache cma_slab_tcaches[CMA_SLAB_TYPES][CMA_SLAB_CLASSES];
+
+
+
+static void cma_slab_init(void)
+{
+	int type, cls;
+
+	for(type=0; type<CMA_SLAB_TYPES; type++)
+		for(cls=0; cls<CMA_SLAB_CLASSES; cls++)
+			pthread_mutex_init(&cma_slab_lists[type][cls].lock, NULL);
+
+	pthread_key_create(&cma_slab_key, cma_slab_thread_exit);
+}
+
+
+static void cma_slab_thread_init(void)
+{
+	pthread_once(&cma_slab_once, cma_slab_init);
+
+	memset(cma_slab_tcaches, 0, sizeof(cma_slab_tcaches));
+	cma_slab_thread_generation = __atomic_load_n(&cma_slab_generation, __ATOMIC_ACQUIRE);
+
+	/* destructor runs only for non-NULL value */
+	pthread_setspecific(cma_slab_key, cma_slab_tcaches);
+}
+
+
+/* cached blocks are given back, other threads can use them */
+static void cma_slab_thread_exit(void *tcache)
+{
+	struct cma_slab_tcache (*tc)[CMA_SLAB_CLASSES] = tcache;
+	int type, cls;
+
+	if( cma_slab_thread_generation != __atomic_load_n(&cma_slab_generation, __ATOMIC_ACQUIRE) )
+		return;
+
+	for(type=0; type<CMA_SLAB_TYPES; type++)
+		for(cls=0; cls<CMA_SLAB_CLASSES; cls++)
+			cma_slab_flush(type, cls, &tc[type][cls], tc[type][cls].count);
+}
+
+
+static inline struct cma_slab_tcache *cma_slab_tcache(int type, int cls)
+{
+	if( cma_slab_thread_generation != __atomic_load_n(&cma_slab_generation, __ATOMIC_ACQUIRE) )
+		cma_slab_thread_init();
+
+	return &cma_slab_tcaches[type][cls];
+}
+
+
+static inline int cma_slab_type(unsigned flags)
+{
+	int type;
+
+	for(type=0; type<CMA_SLAB_TYPES; type++)
+		if( flags == cma_slab_type_flags[type] )
+			return type;
+
+	return -1;
+}
+
+
+/* smallest class the size fits in */
+static inline int cma_slab_class(size_t size)
+{
+	if( size <= (1 << CMA_SLAB_MIN_SHIFT) )
+		return 0;
+
+	return (int)(sizeof(unsigned long)*8 - __builtin_clzl(size - 1)) - CMA_SLAB_MIN_SHIFT;
+}
+
+
+/* arena containing the address, NULL if it is not a slab block */
+static struct cma_slab_arena *cma_slab_arena_of(const void *mem)
+{
+	unsigned i, count = __atomic_load_n(&cma_slab_arena_count, __ATOMIC_ACQUIRE);
+	struct cma_slab_arena *arena;
+
+	for(i=0; i<count; i++){
+		arena = cma_slab_arenas[i];
+		if( (const char*)mem >= arena->base && (const char*)mem < arena->base + CMA_SLAB_ARENA_SIZE )
+			return arena;
+	}
+
+	return NULL;
+}
+
+
+/* unused slab of the type, new arena is allocated when all are used */
+static struct cma_slab_arena *cma_slab_take(int type, int cls, unsigned *slab)
+{
+	struct cma_slab_arena *arena = NULL;
+	unsigned i;
+
+	pthread_mutex_lock(&cma_slab_arena_lock);
+
+	for(i=0; i<cma_slab_arena_count; i++){
+		if( cma_slab_arenas[i]->type == type && cma_slab_arenas[i]->used < CMA_SLAB_PER_ARENA ){
+			arena = cma_slab_arenas[i];
+			break;
+		}
+	}
+
+	if( arena == NULL ){
+		if( cma_slab_arena_count == CMA_SLAB_MAX_ARENAS ){
+			errno = ENOMEM;
+			goto error;
+		}
+
+		arena = calloc(1, sizeof(struct cma_slab_arena));
+		if( arena == NULL )
+			goto error;
+
+		arena->type = type;
+		arena->base = cma_alloc_ext(CMA_SLAB_ARENA_SIZE, cma_slab_type_flags[type] | CMA_FLAG_HUGEPAGE);
+		if( arena->base == NULL ){
+			free(arena);
+			goto error;
+		}
+		arena->phy_addr = cma_get_phy_addr64(arena->base);
+
+		__DEBUG("cma_slab_take - new arena at %p, phy_addr 0x%llx\n", arena->base, (unsigned long long)arena->phy_addr);
+
+		/* published only when complete */
+		cma_slab_arenas[cma_slab_arena_count] = arena;
+		__atomic_store_n(&cma_slab_arena_count, cma_slab_arena_count + 1, __ATOMIC_RELEASE);
+	}
+
+	*slab = arena->used;
+	arena->cls[*slab] = cls;
+	__atomic_store_n(&arena->used, *slab + 1, __ATOMIC_RELEASE);
+
+	pthread_mutex_unlock(&cma_slab_arena_lock);
+
+	return arena;
+
+
+error:
+	pthread_mutex_unlock(&cma_slab_arena_lock);
+
+	return NULL;
+}
+
+
+/* moves a batch from the global list to empty thread cache */
+static int cma_slab_refill(int type, int cls, struct cma_slab_tcache *tc)
+{
+	struct cma_slab_list *list = &cma_slab_lists[type][cls];
+	struct cma_slab_arena *arena;
+	size_t block_size = (size_t)1 << (cls + CMA_SLAB_MIN_SHIFT);
+	unsigned slab, count, i;
+	void **blocks;
+	char *base;
+
+	pthread_mutex_lock(&list->lock);
+
+	/* cut a new slab into blocks */
+	if( list->count == 0 ){
+		count = CMA_SLAB_SIZE / block_size;
+
+		if( list->capacity < count ){
+			blocks = realloc(list->blocks, count * sizeof(void*));
+			if( blocks == NULL )
+				goto error;
+
+			list->blocks 	= blocks;
+			list->capacity 	= count;
+		}
+
+		arena = cma_slab_take(type, cls, &slab);
+		if( arena == NULL )
+			goto error;
+
+		/* lowest address is handed out first */
+		base = arena->base + (size_t)slab * CMA_SLAB_SIZE;
+		for(i=0; i<count; i++)
+			list->blocks[i] = base + (count - 1 - i) * block_size;
+		list->count = count;
+	}
+
+	count = list->count < CMA_SLAB_BATCH ? list->count : CMA_SLAB_BATCH;
+	list->count -= count;
+	memcpy(tc->blocks, &list->blocks[list->count], count * sizeof(void*));
+	tc->count = count;
+
+	pthread_mutex_unlock(&list->lock);
+
+	return 0;
+
+
+error:
+	pthread_mutex_unlock(&list->lock);
+
+	return -1;
+}
+
+
+/* moves oldest blocks of thread cache to the global list */
+static void cma_slab_flush(int type, int cls, struct cma_slab_tcache *tc, unsigned count)
+{
+	struct cma_slab_list *list = &cma_slab_lists[type][cls];
+	void **blocks;
+	unsigned capacity;
+
+	if( count == 0 )
+		return;
+
+	pthread_mutex_lock(&list->lock);
+
+	if( list->count + count > list->capacity ){
+		capacity = 2*list->capacity > list->count + count ? 2*list->capacity : list->count + count;
+
+		/* blocks stay in the thread cache if there is no memory to track them */
+		blocks = realloc(list->blocks, capacity * sizeof(void*));
+		if( blocks == NULL ){
+			pthread_mutex_unlock(&list->lock);
+			return;
+		}
+
+		list->blocks 	= blocks;
+		list->capacity 	= capacity;
+	}
+
+	memcpy(&list->blocks[list->count], tc->blocks, count * sizeof(void*));
+	list->count += count;
+
+	pthread_mutex_unlock(&list->lock);
+
+	tc->count -= count;
+	memmove(tc->blocks, &tc->blocks[count], tc->count * sizeof(void*));
+}
+
+
+void *cma_slab_alloc(size_t size, unsigned flags)
+{
+	struct cma_slab_tcache *tc;
+	int type, cls;
+
+	type = cma_slab_type(flags);
+	if( type == -1 || size == 0 ){
+		errno = EINVAL;
+		return NULL;
+	}
+
+	/* large blocks are allocations of their own */
+	if( size > (1 << CMA_SLAB_MAX_SHIFT) )
+		return cma_alloc_ext(size, flags);
+
+	cls 	= cma_slab_class(size);
+	tc 		= cma_slab_tcache(type, cls);
+
+	if( tc->count == 0 && cma_slab_refill(type, cls, tc) == -1 ){
+		__DEBUG("cma_slab_alloc - no memory for 0x%zx bytes\n", size);
+		return NULL;
+	}
+
+	return tc->blocks[--tc->count];
+}
+
+
+int cma_slab_free(void *mem)
+{
+	struct cma_slab_arena *arena;
+	struct cma_slab_tcache *tc;
+	size_t offset;
+	int cls;
+
+	arena = cma_slab_arena_of(mem);
+	if( arena == NULL )
+		return cma_free(mem);
+
+	/* only block start of a used slab can be released */
+	offset = (char*)mem - arena->base;
+	if( offset / CMA_SLAB_SIZE >= __atomic_load_n(&arena->used, __ATOMIC_ACQUIRE) ){
+		errno = EINVAL;
+		return -1;
+	}
+
+	cls = arena->cls[offset / CMA_SLAB_SIZE];
+	if( offset & ((1 << (cls + CMA_SLAB_MIN_SHIFT)) - 1) ){
+		errno = EINVAL;
+		return -1;
+	}
+
+	tc = cma_slab_tcache(arena->type, cls);
+	if( tc->count == CMA_SLAB_TCACHE_SIZE )
+		cma_slab_flush(arena->type, cls, tc, CMA_SLAB_BATCH);
+
+	/* thread cache is still full if the global list could not grow */
+	if( tc->count == CMA_SLAB_TCACHE_SIZE ){
+		errno = ENOMEM;
+		return -1;
+	}
+
+	tc->blocks[tc->count++] = mem;
+
+	return 0;
+}
+
+
+uint64_t cma_slab_get_phy_addr(void *mem)
+{
+	struct cma_slab_arena *arena = cma_slab_arena_of(mem);
+
+	if( arena == NULL )
+		return cma_get_phy_addr64(mem);
+
+	return arena->phy_addr + ((char*)mem - arena->base);
+}
+
+
+int cma_slab_sync_for_device(void *mem, size_t len)
+{
+	struct cma_slab_arena *arena = cma_slab_arena_of(mem);
+
+	if( arena == NULL )
+		return cma_sync_for_device(mem, 0, len);
+
+	return cma_sync_for_device(arena->base, (char*)mem - arena->base, len);
+}
+
+
+int cma_slab_sync_for_cpu(void *mem, size_t len)
+{
+	struct cma_slab_arena *arena = cma_slab_arena_of(mem);
+
+	if( arena == NULL )
+		return cma_sync_for_cpu(mem, 0, len);
+
+	return cma_sync_for_cpu(arena->base, (char*)mem - arena->base, len);
+}
+
+
+/* called by cma_release(), no other thread may use slab blocks anymore */
+void cma_slab_release(void)
+{
+	int type, cls;
+	unsigned i;
+
+	pthread_once(&cma_slab_once, cma_slab_init);
+
+	/* list lock is taken before the arena lock */
+	for(type=0; type<CMA_SLAB_TYPES; type++){
+		for(cls=0; cls<CMA_SLAB_CLASSES; cls++){
+			pthread_mutex_lock(&cma_slab_lists[type][cls].lock);
+			cma_slab_lists[type][cls].count = 0;
+			pthread_mutex_unlock(&cma_slab_lists[type][cls].lock);
+		}
+	}
+
+	pthread_mutex_lock(&cma_slab_arena_lock);
+
+	for(i=0; i<cma_slab_arena_count; i++){
+		cma_free(cma_slab_arenas[i]->base);
+		free(cma_slab_arenas[i]);
+		cma_slab_arenas[i] = NULL;
+	}
+	__atomic_store_n(&cma_slab_arena_count, 0, __ATOMIC_RELEASE);
+	__atomic_add_fetch(&cma_slab_generation, 1, __ATOMIC_RELEASE);
+
+	pthread_mutex_unlock(&cma_slab_arena_lock);
+}
@@ -29,8 +29,118 @@
  * In some DMA use cases there is a need or it is more efficient to use large
  * physically contigous memory regions. When Linux kernel is compiled with CMA
  * (Contigous Memory Allocator) feature, this module allows to allocate this 
- * contigous memory and pass it to the user space. Memory can be either cached
- * or uncached. 
+ * contigous memory and pass it to the user space. Memory can be either cached,
+ * uncached or write-combined. 
+ *
+ * Driver can be bound to device tree node, which makes memory allocated for
+ * that device, with DMA mask and dma-ranges translation of its bus. Node can
+ * reference reserved memory regions, each selected by CMA_ALLOC_FLAG_REGION()
+ * with index of the region in "memory-region". Index is looked up by
+ * "memory-region-names" entry with CMA_GET_REGION, e.g.:
+ *
+ *	reserved-memory {
+ *		#address-cells = <1>;
+ *		#size-cells = <1>;
+ *		ranges;
+ *
+ *		cma_carveout: carveout@30000000 {
+ *			reg = <0x30000000 0x08000000>;
+ *		};
+ *
+ *		cma_fpga: fpga@38000000 {
+ *			compatible = "shared-dma-pool";
+ *			reusable;
+ *			reg = <0x38000000 0x04000000>;
+ *		};
+ *	};
+ *
+ *	cma {
+ *		compatible = "edi,cma";
+ *		memory-region = <&cma_carveout>, <&cma_fpga>;
+ *		memory-region-names = "carveout", "fpga";
+ *	};
+ *
+ * "shared-dma-pool" region (CMA area or coherent pool) gets own device and is
+ * allocated from by DMA API. Other region is a carveout, allocated by the
+ * driver with deterministic allocation time. Carveout must stay in kernel
+ * linear mapping (no "no-map" property), where it is mapped cached, so its
+ * memory is cached only, noncached or write-combined user mapping would alias
+ * it with different attributes. CMA_ALLOC_FLAG_CARVEOUT selects the first
+ * carveout. Only the default area is kept in the recycling cache. Binding is
+ * described in "edi,cma.txt".
+ *
+ * Buffers allocated with CMA_ALLOC_FLAG_HUGEPAGE which are at least PMD_SIZE
+ * large and PMD_SIZE aligned physically are mapped to the user space with PMD
+ * sized entries. It requires transparent hugepage support ("always" or
+ * "madvise" mode). Physical alignment of the CMA area allocations is limited by
+ * CONFIG_CMA_ALIGNMENT, carveout allocations are always aligned.
+ *
+ * Allocation can be exported as dma-buf file descriptor (CMA_EXPORT_DMABUF),
+ * passed to other process or driver and imported back (CMA_IMPORT_DMABUF).
+ * Memory stays allocated until both the owner and all dma-buf references
+ * release it. Only dma-bufs exported by this driver can be imported.
+ *
+ * Memory, including that of exported dma-bufs, can only be mapped with
+ * MAP_SHARED, private mappings are refused with -EINVAL.
+ *
+ * mmap() with CMA_MMAP_ALLOC_OFFSET offset allocates memory of the mapping
+ * size and maps it in a single call. Such memory is released when the last
+ * mapping of it is removed, so munmap() is enough to free it.
+ *
+ * CMA_ALLOC_ALIGNED places allocation at physical address of given alignment
+ * which does not cross given boundary. Carveout satisfies any constraint. CMA
+ * area allocations are naturally aligned to their order, alignment above it is
+ * requested from the CMA area directly and only the buffer size is reserved.
+ * Alignment is limited by CONFIG_CMA_ALIGNMENT, larger one is refused, as is
+ * alignment above the order of coherent pool ("no-map" "shared-dma-pool")
+ * allocations.
+ *
+ * Memory is never handed over to a process with data of another one in it.
+ * Released memory kept in the recycling cache is zeroed by a low priority
+ * kernel thread, which also keeps pool_buffer_count zeroed buffers of
+ * pool_buffer_size bytes in the cache, so such allocations are served without
+ * waiting for zeroing. CMA_ALLOC_FLAG_NOZERO skips zeroing of memory which was
+ * released through the same open file, newly allocated memory is always
+ * zeroed. Files are told apart by id which is never reused, unlike pid.
+ *
+ * Allocations with CMA_ALLOC_FLAG_PAGES are mapped with vm_insert_page()
+ * instead of remap_pfn_range(), so user mappings are backed by struct pages
+ * and can be pinned with get_user_pages() by O_DIRECT, vmsplice or io_uring
+ * fixed buffers. Such mappings never use large pages. Memory with pages still
+ * pinned when it is released is not recycled. Carveout can not serve such
+ * allocations, its allocator would hand pinned memory out again.
+ *
+ * On SoCs with Accelerator Coherency Port (e.g. Cyclone V and Arria V HPS) a
+ * bus window aliases part of the memory coherently with the CPU caches. With
+ * acp_bus_base, acp_phys_base and acp_size parameters describing the window,
+ * e.g. acp_bus_base=0x80000000 acp_size=0x40000000 for the first GB of SDRAM
+ * on Cyclone V, CMA_ALLOC_FLAG_ACP allocations are mapped cached and need no
+ * cache maintenance, provided the device uses the address returned by
+ * CMA_GET_DMA_ADDR and issues cacheable transactions. Window is a placement
+ * constraint of such allocations, carveout places them in it, CMA area ones
+ * fail if they are not in it. They are never taken from the recycling cache.
+ *
+ * Allocation can be mapped with twice its size. Such mapping is mirrored, the
+ * second half maps the allocation again, so a ring buffer is read through the
+ * wrap without copying. CMA_SYNC_* ranges wrap past the end accordingly.
+ *
+ * CMA_ALLOC_RING allocates a number of equally sized buffers at once. They are
+ * registered as a single entry made of separately allocated parts, which is
+ * mapped back-to-back into one virtual range.
+ *
+ * CMA_ALLOC_CHUNKED builds such an entry out of as few contigous chunks as
+ * the fragmentation allows, halving the chunk size while allocations fail.
+ * Physical address and size of every chunk are returned for scatter-gather
+ * DMA, CMA_GET_CHUNKS reports them for any allocation.
+ *
+ * Usage statistics are reported in debugfs "cma" directory:
+ *	stats 			- live bytes, buffer counts and high-water marks per memory
+ *					  type, free memory and largest free extent of the carveout,
+ *					  base, size and type of every region
+ *	processes 		- live bytes and buffer counts per open file and its owner
+ *	alloc_latency 	- log2 histogram of new allocation (dma_alloc_coherent or
+ *					  carveout) latency in nanoseconds
+ *	ioctl_latency 	- log2 histogram of ioctl service time in nanoseconds
  *
  * For api description, see "cma_api.h" header file.
  *
@@ -42,8 +152,36 @@
 #include <linux/fs.h>
 #include <linux/device.h>
 #include <linux/slab.h>
+#include <linux/vmalloc.h>
 #include <linux/uaccess.h>
 #include <linux/mutex.h>
+#include <linux/rbtree.h>
+#include <linux/list.h>
+#include <linux/sched.h>
+#include <linux/shrinker.h>
+#include <linux/mm.h>
+#include <linux/mman.h>
+#include <linux/huge_mm.h>
+#include <linux/pfn_t.h>
+#include <linux/kref.h>
+#include <linux/dma-buf.h>
+#include <linux/scatterlist.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/ktime.h>
+#include <linux/log2.h>
+#include <linux/spinlock.h>
+#include <linux/vmstat.h>
+#include <linux/kthread.h>
+#include <linux/wait.h>
+
+/* Platform driver specific includes */
+#include <linux/platform_device.h>
+#include <linux/of.h>
+#include <linux/of_reserved_mem.h>
+#include <linux/of_device.h>
+#include <linux/genalloc.h>
+#include <linux/io.h>
 
 /* CMA specific includes */
 #include <linux/dma-mapping.h>
@@ -63,6 +201,9 @@
 #ifndef DRIVER_NODE_NAME
 	#define DRIVER_NODE_NAME 	"cma"
 #endif
+#ifndef COMPATIBLE_STRING
+	#define COMPATIBLE_STRING 	"edi,cma"
+#endif
 
 
 /* Commonly used printk statements */
@@ -80,50 +221,300 @@
 #define CMA_ENTRY_CACHED 		0
 #define CMA_ENTRY_MAPPED		(1<<0)
 #define CMA_ENTRY_NONCACHED 	(1<<1)
+#define CMA_ENTRY_CARVEOUT 		(1<<2)
+#define CMA_ENTRY_WRITECOMBINE 	(1<<3)
+#define CMA_ENTRY_HUGEPAGE 		(1<<4)
+#define CMA_ENTRY_AUTOFREE 		(1<<5)
+#define CMA_ENTRY_NOZERO 		(1<<6)
+#define CMA_ENTRY_SCRUBBED 		(1<<7)
+#define CMA_ENTRY_PAGES 		(1<<8)
+#define CMA_ENTRY_ACP 			(1<<9)
+#define CMA_ENTRY_CONTIG 		(1<<10)	/* pages of CMA area, not recycled */
+
+/* memory-region index + 1 of the allocation, 0 - default area */
+#define CMA_ENTRY_REGION_SHIFT 	12
+#define CMA_ENTRY_REGION_MASK 	(0xf<<CMA_ENTRY_REGION_SHIFT)
+
+/* entries with these flags are never held in CPU caches */
+#define CMA_ENTRY_UNCACHED 		(CMA_ENTRY_NONCACHED | CMA_ENTRY_WRITECOMBINE)
+
+/* Entry flags of memory which needs no cache maintenance for the device */
+#define CMA_ENTRY_COHERENT 		(CMA_ENTRY_UNCACHED | CMA_ENTRY_ACP)
+
+/* Recycling cache size classes, by allocation order. Last class collects
+ * everything larger. */
+#define CMA_CACHE_CLASSES 		20
+
+/* Statistics memory types and log2 latency histogram buckets */
+#define CMA_STAT_TYPES 			3
+#define CMA_STAT_HIST_BUCKETS 	32
+
+/* Largest physical alignment of CMA area allocations */
+#ifdef CONFIG_CMA_ALIGNMENT
+#define CMA_ALIGN_MAX 			((u64)PAGE_SIZE << CONFIG_CMA_ALIGNMENT)
+#else
+#define CMA_ALIGN_MAX 			((u64)PAGE_SIZE << (MAX_ORDER-1))
+#endif
+
+
+/* Module parameters */
+static unsigned long cache_max_bytes = 64*1024*1024;
+module_param(cache_max_bytes, ulong, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(cache_max_bytes, "Maximum size of released memory kept for reuse, 0 disables the cache");
+
+static unsigned long pool_buffer_size;
+module_param(pool_buffer_size, ulong, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(pool_buffer_size, "Size of buffers kept zeroed in the cache ahead of allocation, 0 disables the pool");
+
+static unsigned int pool_buffer_count;
+module_param(pool_buffer_count, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(pool_buffer_count, "Number of buffers kept zeroed in the cache ahead of allocation");
+
+static unsigned long acp_bus_base;
+module_param(acp_bus_base, ulong, S_IRUGO);
+MODULE_PARM_DESC(acp_bus_base, "Device address of the ACP window");
+
+static unsigned long acp_phys_base;
+module_param(acp_phys_base, ulong, S_IRUGO);
+MODULE_PARM_DESC(acp_phys_base, "Physical address of memory aliased by the ACP window");
+
+static unsigned long acp_size;
+module_param(acp_size, ulong, S_IRUGO);
+MODULE_PARM_DESC(acp_size, "Size of the ACP window, 0 disables ACP allocations");
 
 
 /* fops declarations */
+static int cma_open(struct inode *inode, struct file *filp);
+static int cma_file_release(struct inode *inode, struct file *filp);
 static long cma_ioctl(struct file *filp, unsigned int cmd, unsigned long arg);
+static long cma_ioctl_dispatch(struct file *filp, unsigned int cmd, unsigned long arg);
 static int cma_mmap(struct file *filp, struct vm_area_struct *vm_area_dscr);
 
 /* ioctl interface commands */
 static long cma_ioctl_alloc 			(struct file *filp, unsigned int cmd, unsigned long arg, int cached_flag);
+static long cma_ioctl_alloc_ext 		(struct file *filp, unsigned int cmd, unsigned long arg);
+static long cma_ioctl_alloc_ring 		(struct file *filp, unsigned int cmd, unsigned long arg);
+static long cma_ioctl_alloc_aligned 	(struct file *filp, unsigned int cmd, unsigned long arg);
+static long cma_ioctl_alloc_chunked 	(struct file *filp, unsigned int cmd, unsigned long arg);
+static long cma_ioctl_get_chunks		(struct file *filp, unsigned int cmd, unsigned long arg);
+static int 	cma_ioctl_get_v_usr_addr	(unsigned int cmd, unsigned long arg, unsigned long *v_usr_addr);
+static int 	cma_ioctl_put_value			(unsigned int cmd, unsigned long arg, __u64 value);
 static long cma_ioctl_free 				(struct file *filp, unsigned int cmd, unsigned long arg);
 static long cma_ioctl_get_phy_addr 		(struct file *filp, unsigned int cmd, unsigned long arg);
 static long cma_ioctl_get_size			(struct file *filp, unsigned int cmd, unsigned long arg);
-
-/* CMA entry specific functions */
-struct cma_entry 	*cma_entry_get_by_phy_addr		(unsigned long phy_addr);
-struct cma_entry 	*cma_entry_get_by_v_usr_addr	(unsigned v_usr_addr);
-static int 			cma_entry_add				(struct cma_entry *entry);
-static int 			cma_entry_release			(unsigned v_usr_addr);
+static long cma_ioctl_sync				(struct file *filp, unsigned int cmd, unsigned long arg);
+static long cma_ioctl_get_flags			(struct file *filp, unsigned int cmd, unsigned long arg);
+static long cma_ioctl_export_dmabuf		(struct file *filp, unsigned int cmd, unsigned long arg);
+static long cma_ioctl_import_dmabuf		(struct file *filp, unsigned int cmd, unsigned long arg);
+static long cma_ioctl_get_region		(struct file *filp, unsigned int cmd, unsigned long arg);
+
+/* CMA entry specific functions, called with cma_file_data lock held */
+struct cma_file_data;
+static struct cma_entry *cma_entry_get_by_phy_addr		(struct cma_file_data *data, dma_addr_t phy_addr);
+static struct cma_entry *cma_entry_get_by_v_usr_addr	(struct cma_file_data *data, unsigned long v_usr_addr);
+static void 			cma_entry_set_v_usr_addr		(struct cma_file_data *data, struct cma_entry *entry, unsigned long v_usr_addr);
+
+/* CMA entry specific functions, take cma_file_data lock */
+static int 			cma_entry_add				(struct cma_file_data *data, struct cma_entry *entry);
+static int 			cma_entry_release			(struct cma_file_data *data, unsigned long v_usr_addr);
+static void 		cma_entry_remove			(struct cma_file_data *data, struct cma_entry *entry);
+static void 		cma_entry_discard			(struct cma_file_data *data, dma_addr_t phy_addr);
+static void 		cma_file_data_free			(struct cma_file_data *data);
+
+/* CMA entry memory management */
+struct cma_constraint;
+struct cma_region;
+static long 			cma_alloc_entry			(struct file *filp, size_t size, int flags, dma_addr_t *phy_addr);
+static struct cma_entry *cma_entry_obtain		(size_t size, int flags, const struct cma_constraint *c, u64 owner);
+static struct cma_entry *cma_entry_compose		(size_t size, int flags, unsigned max_parts);
+static int 				cma_alloc_flags_to_entry(__u32 alloc_flags, int *flags);
+static struct cma_region *cma_region_select	(int *flags);
+static struct cma_entry *cma_entry_create		(struct cma_region *region, size_t size, int flags,
+												 const struct cma_constraint *c);
+static bool 			cma_constraint_met		(const struct cma_constraint *c, dma_addr_t phy_addr, size_t size);
+static void 			cma_entry_check_hugepage(struct cma_entry *entry);
+static void 			*cma_contig_alloc		(struct device *dev, size_t size, u64 align, int flags,
+												 dma_addr_t *phy_addr);
+static void 			cma_contig_free			(struct device *dev, void *v_ptr, dma_addr_t phy_addr, size_t size);
+static void 			cma_entry_destroy		(struct cma_entry *entry);
+static void 			cma_entry_free			(struct cma_entry *entry);
+static void 			cma_entry_put			(struct cma_entry *entry);
+static void 			cma_entry_set_pgprot	(struct cma_entry *entry, struct vm_area_struct *vma);
+static struct cma_entry *cma_entry_part_at		(struct cma_entry *entry, unsigned long *offset);
+static int 				cma_entry_remap			(struct cma_entry *entry, struct vm_area_struct *vma, unsigned long offset);
+static void 			cma_entry_sync			(struct cma_entry *entry, unsigned long offset, unsigned long len,
+												 int for_device, enum dma_data_direction dir);
+
+/* Recycling cache functions */
+static struct cma_entry *cma_cache_get			(size_t size, int flags, u64 owner);
+static int 				cma_cache_put			(struct cma_entry *entry);
+static unsigned long 	cma_cache_shrink		(unsigned long nr_bytes);
+static unsigned long 	cma_cache_shrinker_count(struct shrinker *shrinker, struct shrink_control *sc);
+static unsigned long 	cma_cache_shrinker_scan	(struct shrinker *shrinker, struct shrink_control *sc);
+
+/* Background zeroing functions */
+static void 			cma_entry_scrub			(struct cma_entry *entry);
+static void 			cma_scrub_kick			(void);
+static int 				cma_scrub_thread		(void *unused);
+
+/* statistics declarations */
+static void cma_stats_account	(struct cma_entry *entry, int sign);
+static void cma_debugfs_init	(void);
 
 /* mmap ops declarations */
+void cma_mmap_open(struct vm_area_struct *vma);
 void cma_mmap_close(struct vm_area_struct *vma);
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+static int cma_mmap_fault(struct vm_fault *vmf);
+static int cma_mmap_huge_fault(struct vm_fault *vmf, enum page_entry_size pe_size);
+static unsigned long cma_get_unmapped_area(struct file *filp, unsigned long addr, unsigned long len,
+										   unsigned long pgoff, unsigned long flags);
+#endif
+
+/* platform device specific functions */
+static int cma_probe(struct platform_device *pdev);
+static int cma_remove(struct platform_device *pdev);
+
+/* dma-buf exporter declarations */
+static struct sg_table *cma_dmabuf_map		(struct dma_buf_attachment *attach, enum dma_data_direction dir);
+static void 	cma_dmabuf_unmap			(struct dma_buf_attachment *attach, struct sg_table *sgt, enum dma_data_direction dir);
+static void 	cma_dmabuf_release			(struct dma_buf *dmabuf);
+static int 		cma_dmabuf_begin_cpu_access	(struct dma_buf *dmabuf, enum dma_data_direction dir);
+static int 		cma_dmabuf_end_cpu_access	(struct dma_buf *dmabuf, enum dma_data_direction dir);
+static void 	*cma_dmabuf_kmap			(struct dma_buf *dmabuf, unsigned long page_num);
+static void 	*cma_dmabuf_vmap			(struct dma_buf *dmabuf);
+static int 		cma_dmabuf_mmap				(struct dma_buf *dmabuf, struct vm_area_struct *vma);
 
 
 /* File operations */
 struct file_operations fops = {
 	.owner 				= THIS_MODULE,
+	.open 				= cma_open,
+	.release 			= cma_file_release,
 	.unlocked_ioctl 	= cma_ioctl,
-	.mmap 				= cma_mmap
+#ifdef CONFIG_COMPAT
+	.compat_ioctl 		= cma_ioctl,	/* arguments have the same layout */
+#endif
+	.mmap 				= cma_mmap,
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+	.get_unmapped_area 	= cma_get_unmapped_area
+#endif
 };
 
 /* mmap operation structure */
 static struct vm_operations_struct cma_ops = {
+	.open 		= cma_mmap_open,
 	.close 		= cma_mmap_close
 };
 
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+/* mmap operation structure, hugepage entries are mapped on fault */
+static struct vm_operations_struct cma_huge_ops = {
+	.open 		= cma_mmap_open,
+	.close 		= cma_mmap_close,
+	.fault 		= cma_mmap_fault,
+	.huge_fault = cma_mmap_huge_fault
+};
+#endif
+
+/* dma-buf exporter operations, kernel mappings are permanent */
+static const struct dma_buf_ops cma_dmabuf_ops = {
+	.map_dma_buf 		= cma_dmabuf_map,
+	.unmap_dma_buf 		= cma_dmabuf_unmap,
+	.release 			= cma_dmabuf_release,
+	.begin_cpu_access 	= cma_dmabuf_begin_cpu_access,
+	.end_cpu_access 	= cma_dmabuf_end_cpu_access,
+	.map_atomic 		= cma_dmabuf_kmap,
+	.map 				= cma_dmabuf_kmap,
+	.vmap 				= cma_dmabuf_vmap,
+	.mmap 				= cma_dmabuf_mmap
+};
+
+/* Platform Driver structures */
+static const struct of_device_id cma_id[] = {
+	{.compatible = COMPATIBLE_STRING},
+	{}
+};
+static struct platform_driver cma_driver = {
+	.driver = {
+		.name 	= DRIVER_NODE_NAME,
+		.owner	= THIS_MODULE,
+		.of_match_table	= of_match_ptr(cma_id),
+		.suppress_bind_attrs = true		/* regions have to outlive their allocations */
+	},
+	.probe 	= cma_probe,
+	.remove = cma_remove
+};
+
+/* Give cached memory back under memory pressure */
+static struct shrinker cma_cache_shrinker = {
+	.count_objects 	= cma_cache_shrinker_count,
+	.scan_objects 	= cma_cache_shrinker_scan,
+	.seeks 			= DEFAULT_SEEKS
+};
+
 
-/* List structure for containing memory allocation information */
+/* Structure for containing memory allocation information */
 struct cma_entry{
-	struct cma_entry *next;
-	pid_t	 	pid;		/* calling process id */
-	unsigned 	size;		/* size of allocation */
+	struct rb_node 	phy_node;	/* cma_file_data phy_root node */
+	struct rb_node 	va_node;	/* cma_file_data va_root node, empty until mapped */
+	struct mm_struct *mm;	/* address space of v_usr_addr, only compared */
+	size_t 		size;		/* size of allocation */
 	dma_addr_t	phy_addr;	/* physical address */
 	void 	 	*v_ptr;		/* kernel-space pointer */
-	unsigned 	v_usr_addr; /* user-space addr */
+	struct cma_region *region;	/* memory allocated from, NULL for composed entry */
+	unsigned long v_usr_addr; /* user-space addr */
 	int 		flags;		/* memory allocation related flags */
+	int 		map_count;	/* number of vmas mapping the entry */
+	u64 		owner;		/* id of the file which allocated the memory last */
+	struct kref ref;		/* registry and exported dma-bufs hold references */
+	struct dma_buf *dmabuf;	/* imported dma-buf which owns the memory, or NULL */
+	struct cma_entry **parts;	/* allocations mapped back-to-back, NULL if the
+								 * entry is a single allocation itself */
+	unsigned 	nparts;		/* number of parts, 1 for single allocation */
+	struct list_head cache_node;	/* recycling cache size class list node */
+	struct list_head lru_node;		/* recycling cache LRU list node */
+};
+
+/* Per open file allocation registry, owns all of its entries */
+struct cma_file_data{
+	struct list_head list;		/* cma_files node */
+	u64 			id;			/* owner of entries allocated through the file */
+	pid_t 			pid;		/* process which opened the file */
+	char 			comm[TASK_COMM_LEN];
+	struct mutex 	lock;		/* protects both trees and their entries */
+	struct rb_root 	phy_root;	/* entries indexed by physical address */
+	struct rb_root 	va_root;	/* entries indexed by (mm, user-space addr) */
+};
+
+
+/* physical placement of allocation, align and boundary are powers of two,
+ * boundary 0 - none, allocation lies in [start, end), end 0 - anywhere */
+struct cma_constraint{
+	u64 			align;
+	u64 			boundary;
+	u64 			start;
+	u64 			end;
+};
+
+/* genalloc algorithm data, constraint and physical address of bit 0 of the map */
+struct cma_genpool_fit{
+	struct cma_constraint c;
+	phys_addr_t 	phy_base;
+};
+
+/* Memory allocations are served from, by the device of the region or by the
+ * carveout allocator */
+struct cma_region{
+	int 			index;		/* memory-region index, -1 for the default area */
+	char 			name[CMA_REGION_NAME_LEN];	/* memory-region-names entry */
+	struct device 	*dev;		/* device of dma_* calls, NULL if not bound */
+	struct device 	region_dev;	/* own device of "shared-dma-pool" region */
+	bool 			no_map;		/* memory is not in kernel linear mapping */
+	struct gen_pool *pool;		/* carveout allocator, NULL if memory comes from dev */
+	void 			*v_base;	/* kernel-space pointer of carveout */
+	phys_addr_t 	phy_base;	/* physical address, 0 for the default area */
+	size_t 			size;		/* size of the region, 0 for the default area */
 };
 
 
@@ -131,340 +522,2836 @@ struct cma_entry{
 int major;
 static struct class 	*class;
 static struct device 	*device;
-struct cma_entry 		*cma_start = NULL;
-static struct mutex 	mutex_cma_list_modify;
+static LIST_HEAD(cma_files);
+static DEFINE_MUTEX(mutex_cma_files);
+static atomic64_t 		cma_file_ids 		= ATOMIC64_INIT(0);
+
+/* Recycling cache, [size class][cached/uncached] */
+static struct list_head cma_cache[CMA_CACHE_CLASSES][2];
+static LIST_HEAD(cma_cache_lru);
+static DEFINE_MUTEX(mutex_cma_cache);
+static unsigned long 	cma_cache_bytes;
+static atomic_long_t 	cma_cache_hits 		= ATOMIC_LONG_INIT(0);
+static atomic_long_t 	cma_cache_misses 	= ATOMIC_LONG_INIT(0);
+
+/* Background zeroing of the cache, NULL if the thread is not running */
+static struct task_struct *cma_scrub_task;
+static DECLARE_WAIT_QUEUE_HEAD(cma_scrub_wait);
+static atomic_t 		cma_scrub_pending 	= ATOMIC_INIT(0);
+
+/* Default area, global CMA area until driver is bound to device tree node */
+static struct cma_region 	cma_region_unbound = { .index = -1, .name = "default" };
+static struct cma_region 	*cma_region_default = &cma_region_unbound;
+
+/* memory-regions of the device tree node by index, first carveout among them
+ * serves CMA_ALLOC_FLAG_CARVEOUT, NULL if there is none */
+static struct cma_region 	*cma_regions[CMA_REGION_MAX_COUNT];
+static unsigned 			cma_region_count;
+static struct cma_region 	*carveout;
+
+/* Statistics, [cached/noncached/write-combined] */
+static const char 		*cma_stat_names[CMA_STAT_TYPES] = {"cached", "noncached", "writecombine"};
+static DEFINE_SPINLOCK(cma_stats_lock);
+static unsigned long 	cma_stats_bytes[CMA_STAT_TYPES];
+static unsigned long 	cma_stats_count[CMA_STAT_TYPES];
+static unsigned long 	cma_stats_bytes_hwm[CMA_STAT_TYPES];
+static unsigned long 	cma_stats_count_hwm[CMA_STAT_TYPES];
+static unsigned long 	cma_stats_total_hwm;
+static atomic_long_t 	cma_stats_alloc_hist[CMA_STAT_HIST_BUCKETS];
+static atomic_long_t 	cma_stats_ioctl_hist[CMA_STAT_HIST_BUCKETS];
+static struct dentry 	*cma_debugfs;
+
+
+/* inline function for readability, orders entries in va_root */
+static inline int cma_entry_va_cmp(struct mm_struct *mm, unsigned long v_usr_addr, struct cma_entry *entry)
+{
+	if( mm != entry->mm )
+		return mm < entry->mm ? -1 : 1;
+
+	if( v_usr_addr != entry->v_usr_addr )
+		return v_usr_addr < entry->v_usr_addr ? -1 : 1;
+
+	return 0;
+}
 
 
-struct cma_entry *cma_entry_get_by_phy_addr(unsigned long phy_addr)
+static struct cma_entry *cma_entry_get_by_phy_addr(struct cma_file_data *data, dma_addr_t phy_addr)
 {
-	struct cma_entry *walk = cma_start;
-	
-	__DEBUG("cma_entry_get_by_phy_addr()\n");
+	struct rb_node *node = data->phy_root.rb_node;
+	struct cma_entry *entry;
 
-	if(mutex_lock_interruptible(&mutex_cma_list_modify))
-		return NULL;
+	__DEBUG("cma_entry_get_by_phy_addr()\n");
 
 	/* search for physical address */
-	while(walk != NULL){
-		if( (walk->pid == current->pid) && (walk->phy_addr == phy_addr))
-			goto leave;
-
-		walk = walk->next;
+	while(node != NULL){
+		entry = rb_entry(node, struct cma_entry, phy_node);
+
+		if( phy_addr < entry->phy_addr )
+			node = node->rb_left;
+		else if( phy_addr > entry->phy_addr )
+			node = node->rb_right;
+		else
+			return entry;
 	}
 
-leave:
-	mutex_unlock(&mutex_cma_list_modify);
-	return walk;
+	return NULL;
 }
 
 
-struct cma_entry *cma_entry_get_by_v_usr_addr(unsigned v_usr_addr)
+static struct cma_entry *cma_entry_get_by_v_usr_addr(struct cma_file_data *data, unsigned long v_usr_addr)
 {
-	struct cma_entry *walk = cma_start;
-	
-	__DEBUG("cma_entry_get_by_v_usr_addr()\n");
+	struct rb_node *node = data->va_root.rb_node;
+	struct cma_entry *entry;
+	int cmp;
 
-	if(mutex_lock_interruptible(&mutex_cma_list_modify))
-		return NULL;
+	__DEBUG("cma_entry_get_by_v_usr_addr()\n");
 
 	/* search for user virtual address */
-	while(walk != NULL){
-		if( (walk->pid == current->pid) && (walk->v_usr_addr == v_usr_addr))
-			goto leave;
-
-		walk = walk->next;
+	while(node != NULL){
+		entry = rb_entry(node, struct cma_entry, va_node);
+
+		cmp = cma_entry_va_cmp(current->mm, v_usr_addr, entry);
+		if( cmp < 0 )
+			node = node->rb_left;
+		else if( cmp > 0 )
+			node = node->rb_right;
+		else
+			return entry;
 	}
 
-leave:
-	mutex_unlock(&mutex_cma_list_modify);
-	return walk;
+	return NULL;
 }
 
 
-static int cma_entry_add(struct cma_entry *entry)
+static void cma_entry_set_v_usr_addr(struct cma_file_data *data, struct cma_entry *entry, unsigned long v_usr_addr)
 {
-	__DEBUG("cma_entry_add() - phy_addr 0x%x; pid 0x%x\n", entry->phy_addr, entry->pid);
+	struct rb_node **link = &data->va_root.rb_node, *parent = NULL;
+	struct cma_entry *walk;
+	int cmp;
 
-	if(mutex_lock_interruptible(&mutex_cma_list_modify))
-		return -EAGAIN;
+	__DEBUG("cma_entry_set_v_usr_addr() - v_usr_addr 0x%lx\n", v_usr_addr);
+
+	/* entry is being remapped, drop old address */
+	if( !RB_EMPTY_NODE(&entry->va_node) ){
+		rb_erase(&entry->va_node, &data->va_root);
+		RB_CLEAR_NODE(&entry->va_node);
+	}
 
-	/* add entry in start - this is more effective */
-	entry->next = cma_start;
-	cma_start = entry;
+	entry->mm 			= current->mm;
+	entry->v_usr_addr 	= v_usr_addr;
 
-	mutex_unlock(&mutex_cma_list_modify);
+	while(*link != NULL){
+		parent = *link;
+		walk = rb_entry(parent, struct cma_entry, va_node);
 
-	return 0;
+		cmp = cma_entry_va_cmp(entry->mm, v_usr_addr, walk);
+		if( cmp < 0 ){
+			link = &parent->rb_left;
+		}
+		else if( cmp > 0 ){
+			link = &parent->rb_right;
+		}
+		else{
+			/* address belonged to an already unmapped entry, it is stale now */
+			rb_replace_node(&walk->va_node, &entry->va_node, &data->va_root);
+			RB_CLEAR_NODE(&walk->va_node);
+			walk->v_usr_addr = 0;
+			return;
+		}
+	}
+
+	rb_link_node(&entry->va_node, parent, link);
+	rb_insert_color(&entry->va_node, &data->va_root);
 }
 
 
-static int cma_entry_release(unsigned v_usr_addr)
+static int cma_entry_add(struct cma_file_data *data, struct cma_entry *entry)
 {
-	int err;
-	struct cma_entry *walk_prev, *walk_curr;
+	struct rb_node **link = &data->phy_root.rb_node, *parent = NULL;
+	struct cma_entry *walk;
 
-	__DEBUG("cma_entry_release() - v_usr_addr 0x%x; pid 0x%x\n", v_usr_addr, current->pid);
+	__DEBUG("cma_entry_add() - phy_addr %pad\n", &entry->phy_addr);
 
-	if(mutex_lock_interruptible(&mutex_cma_list_modify))
+	RB_CLEAR_NODE(&entry->va_node);
+
+	if(mutex_lock_interruptible(&data->lock))
 		return -EAGAIN;
 
-	walk_prev = NULL;
-	walk_curr = cma_start;
-
-	while(walk_curr != NULL){
-		if( (walk_curr->pid == current->pid) && (walk_curr->v_usr_addr == v_usr_addr) ){
-			
-			/* Check if mapped */
-			if(walk_curr->flags & CMA_ENTRY_MAPPED){
-				err = -1;
-				goto leave;
-			}
-
-			/* Check if not the first entry */
-			if(walk_prev != NULL)
-				walk_prev->next = walk_curr->next;
-			
-			dma_free_coherent(NULL, walk_curr->size, walk_curr->v_ptr, walk_curr->phy_addr);
-			kfree(walk_curr);
-			err = 0;
-			goto leave;
-		}
+	/* physical address can already be present if imported dma-buf is ours */
+	while(*link != NULL){
+		parent = *link;
+		walk = rb_entry(parent, struct cma_entry, phy_node);
 
-		/* Prepare next walk */
-		walk_prev = walk_curr;
-		walk_curr = walk_curr->next;
+		if( entry->phy_addr < walk->phy_addr ){
+			link = &parent->rb_left;
+		}
+		else if( entry->phy_addr > walk->phy_addr ){
+			link = &parent->rb_right;
+		}
+		else{
+			mutex_unlock(&data->lock);
+			return -EEXIST;
+		}
 	}
 
-	err = -1;
+	rb_link_node(&entry->phy_node, parent, link);
+	rb_insert_color(&entry->phy_node, &data->phy_root);
 
-leave:
-	mutex_unlock(&mutex_cma_list_modify);
-	return err;
+	mutex_unlock(&data->lock);
+
+	return 0;
 }
 
 
-/* inline function for readability */
-inline int check_entry_accordance(struct cma_entry *entry, struct vm_area_struct *vma)
+static int cma_entry_release(struct cma_file_data *data, unsigned long v_usr_addr)
 {
-	if( entry == NULL )
-		return -EFAULT;
+	struct cma_entry *entry;
 
-	if( entry->phy_addr != vma->vm_pgoff << PAGE_SHIFT )
-		return -EFAULT;
+	__DEBUG("cma_entry_release() - v_usr_addr 0x%lx\n", v_usr_addr);
 
-	if( entry->size != vma->vm_end-vma->vm_start )
-		return -EFAULT;
+	if(mutex_lock_interruptible(&data->lock))
+		return -EAGAIN;
+
+	entry = cma_entry_get_by_v_usr_addr(data, v_usr_addr);
+
+	/* Check if exists and is not mapped */
+	if( entry == NULL || (entry->flags & CMA_ENTRY_MAPPED) ){
+		mutex_unlock(&data->lock);
+		return -1;
+	}
+
+	cma_entry_remove(data, entry);
+
+	mutex_unlock(&data->lock);
 
-	if( entry->pid != current->pid )
-		return -EACCES;
+	cma_entry_put(entry);
 
 	return 0;
 }
 
-static int cma_mmap(struct file *filp, struct vm_area_struct *vma)
+
+/* unlinks entry from the registry, lock must be held and reference dropped
+ * by the caller afterwards */
+static void cma_entry_remove(struct cma_file_data *data, struct cma_entry *entry)
 {
-	int err;
-	struct cma_entry *entry;
+	rb_erase(&entry->phy_node, &data->phy_root);
 
-	__DEBUG("cma_mmap() - phy_addr 0x%lx, v_user_addr 0x%lx\n", vma->vm_pgoff << PAGE_SHIFT, vma->vm_start);
+	if( !RB_EMPTY_NODE(&entry->va_node) )
+		rb_erase(&entry->va_node, &data->va_root);
+}
 
-	entry = cma_entry_get_by_phy_addr( vma->vm_pgoff << PAGE_SHIFT );
-	
-	/* check if mmap is alligned with according entry */
-	err = check_entry_accordance(entry, vma);
-	if(err) return err;
 
-	/* set user address for later reference (used when freeing the memory ) */
-	entry->v_usr_addr = vma->vm_start;
+/* releases entry which was registered but never mapped, e.g. when returning
+ * it to the user space failed */
+static void cma_entry_discard(struct cma_file_data *data, dma_addr_t phy_addr)
+{
+	struct cma_entry *entry;
 
-	/* should memory be uncached? */
-	if( entry->flags & CMA_ENTRY_NONCACHED )
-		vma->vm_page_prot = pgprot_noncached(vma->vm_page_prot);
+	mutex_lock(&data->lock);
+	entry = cma_entry_get_by_phy_addr(data, phy_addr);
+	cma_entry_remove(data, entry);
+	mutex_unlock(&data->lock);
+
+	cma_entry_put(entry);
+}
 
-	/* map memory to user space */
-	if (remap_pfn_range(vma, vma->vm_start, vma->vm_pgoff, vma->vm_end-vma->vm_start, vma->vm_page_prot)){
-		up_write(&current->mm->mmap_sem);
-	    return -EAGAIN;
+
+/* genalloc algorithm placing allocation at physically aligned address which
+ * does not cross boundary, within the window */
+static unsigned long cma_genpool_constrained_fit(unsigned long *map, unsigned long size,
+		unsigned long start, unsigned int nr, void *data, struct gen_pool *pool)
+{
+	const struct cma_genpool_fit *fit = data;
+	int order 					= pool->min_alloc_order;
+	unsigned long base 			= fit->phy_base >> order;
+	unsigned long align_mask 	= (unsigned long)(fit->c.align >> order) - 1;
+	unsigned long boundary 		= fit->c.boundary >> order;
+	unsigned long limit 		= size;
+	unsigned long index;
+
+	/* window in bits of the map */
+	if( fit->c.end ){
+		if( fit->c.end <= fit->phy_base || fit->c.start >= fit->phy_base + ((u64)size << order) )
+			return size;
+		if( fit->c.start > fit->phy_base )
+			start = max_t(unsigned long, start, (fit->c.start - fit->phy_base) >> order);
+		limit = min_t(u64, size, (fit->c.end - fit->phy_base) >> order);
 	}
 
-	/* save mmap ops and set entry mapped flag */
-	vma->vm_ops = &cma_ops;
-	entry->flags = (entry->flags & (~CMA_ENTRY_MAPPED)) | CMA_ENTRY_MAPPED;
+	for(;;){
+		index = bitmap_find_next_zero_area_off(map, limit, start, nr, align_mask, base & align_mask);
+		if( index + nr > limit )
+			return size;
+		if( boundary == 0 ||
+			((index + base) & ~(boundary-1)) == ((index + base + nr - 1) & ~(boundary-1)) )
+			return index;
 
-	return 0;
+		/* crosses the boundary, continue search from it */
+		start = round_up(index + base, boundary) - base;
+	}
 }
 
 
-void cma_mmap_close(struct vm_area_struct *vma)
+static bool cma_constraint_met(const struct cma_constraint *c, dma_addr_t phy_addr, size_t size)
 {
-	struct cma_entry *entry;
-	
-	__DEBUG("cma_mmap_close()\n");
+	u64 first = phy_addr;
+	u64 last  = first + size - 1;
 
-	/* remove custom mapped flag */
-	entry = cma_entry_get_by_phy_addr( vma->vm_pgoff << PAGE_SHIFT );
-	if( entry != NULL )
-		entry->flags &= (~CMA_ENTRY_MAPPED);
+	if( first & (c->align - 1) )
+		return false;
+	if( c->end && (first < c->start || last >= c->end) )
+		return false;
+
+	return c->boundary == 0 || (first & ~(c->boundary-1)) == (last & ~(c->boundary-1));
 }
 
 
-static long cma_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+/* CMA area pages at alignment above the order of size, mapped for the kernel
+ * with the attributes of the user mapping */
+static void *cma_contig_alloc(struct device *dev, size_t size, u64 align, int flags, dma_addr_t *phy_addr)
 {
-	/* routine check */
-	__DEBUG("IOCTL command issued\n");
+	struct page *page, **pages;
+	unsigned long i, count = PFN_UP(size);
+	pgprot_t prot = PAGE_KERNEL;
+	void *v_ptr;
 
-	/* check validity of the cmd */
-	if(_IOC_TYPE(cmd) != CMA_IOCTL_MAGIC){
-		__ERROR("IOCTL Incorrect magic number\n");
-		return -ENOTTY;
-	}
-	if(_IOC_NR(cmd) > CMA_IOCTL_MAXNR){
-		__ERROR("IOCTL Command is not valid\n");
-		return -ENOTTY;
-	}
+	page = dma_alloc_from_contiguous(dev, count, get_order(align), GFP_KERNEL);
+	if( page == NULL )
+		return NULL;
 
-	/* get size from userspace */
-	switch(cmd){
-		case CMA_ALLOC_CACHED:
-			return cma_ioctl_alloc(filp, cmd, arg, CMA_ENTRY_CACHED);
-		case CMA_ALLOC_NONCACHED:
-			return cma_ioctl_alloc(filp, cmd, arg, CMA_ENTRY_NONCACHED);
-		case CMA_FREE:
-			return cma_ioctl_free(filp, cmd, arg);
-		case CMA_GET_PHY_ADDR:
-			return cma_ioctl_get_phy_addr(filp, cmd, arg);
-		case CMA_GET_SIZE:
-			return cma_ioctl_get_size(filp, cmd, arg);
-		default:
-			__DEBUG("This should never happen!\n");
-	}
+	pages = kvmalloc_array(count, sizeof(struct page*), GFP_KERNEL);
+	if( pages == NULL )
+		goto error_pages;
+	for(i=0; i<count; i++)
+		pages[i] = page + i;
 
-	return 0;
+	if( flags & CMA_ENTRY_NONCACHED )
+		prot = pgprot_noncached(prot);
+	else if( flags & CMA_ENTRY_WRITECOMBINE )
+		prot = pgprot_writecombine(prot);
+
+	v_ptr = vmap(pages, count, VM_MAP, prot);
+	kvfree(pages);
+	if( v_ptr == NULL )
+		goto error_pages;
+
+	*phy_addr = page_to_phys(page);
+
+	/* dirty lines left by the previous user of the pages must not be evicted
+	 * over the zeroes, which have to reach the memory themselves */
+	dma_sync_single_for_device(dev, phys_to_dma(dev, *phy_addr), size, DMA_TO_DEVICE);
+	memset(v_ptr, 0, size);
+	if( !(flags & CMA_ENTRY_UNCACHED) )
+		dma_sync_single_for_device(dev, phys_to_dma(dev, *phy_addr), size, DMA_TO_DEVICE);
+
+	return v_ptr;
+
+
+error_pages:
+	dma_release_from_contiguous(dev, page, count);
+
+	return NULL;
 }
 
 
-static long cma_ioctl_alloc(struct file *filp, unsigned int cmd, unsigned long arg, int cached_flag)
+static void cma_contig_free(struct device *dev, void *v_ptr, dma_addr_t phy_addr, size_t size)
+{
+	vunmap(v_ptr);
+	dma_release_from_contiguous(dev, pfn_to_page(PHYS_PFN(phy_addr)), PFN_UP(size));
+}
+
+
+static struct cma_entry *cma_entry_create(struct cma_region *region, size_t size, int flags,
+										  const struct cma_constraint *c)
 {
-	int err;
 	struct cma_entry *entry;
-	__DEBUG("cma_ioctl_alloc_cached() called!\n");
+	struct cma_genpool_fit fit = { .c = { .align = PAGE_SIZE } };
+	dma_addr_t dma_handle;
 
-	if( !access_ok(VERIFY_READ, (void __user*) arg, _IOC_SIZE(cmd)) )
-		return -EFAULT;
-	if( !access_ok(VERIFY_WRITE, (void __user*) arg, _IOC_SIZE(cmd)) )
-		return -EFAULT;
+	__DEBUG("cma_entry_create() - size 0x%zx, region %s\n", size, region->name);
 
-	/* create new cma entry  */
-	entry = kmalloc(sizeof(struct cma_entry) ,GFP_KERNEL);
-	
-	/* set entry params */
-	__get_user(entry->size, (typeof(&entry->size))arg );
-	entry->pid 		= current->pid;
-	entry->flags 	= cached_flag;
+	entry = kmalloc(sizeof(struct cma_entry), GFP_KERNEL);
+	if( entry == NULL )
+		return NULL;
 
-	/* allocate contigous memory */
-	entry->v_ptr = dma_alloc_coherent(NULL, entry->size, &entry->phy_addr, GFP_KERNEL);
-	if( entry->v_ptr == NULL ){
-		err = -ENOMEM;
-		goto error_dma_alloc_coherent;
+	if( c != NULL )
+		fit.c = *c;
+
+	entry->flags 	= flags;
+	entry->region 	= region;
+
+	/* allocate from carveout, time does not depend on the rest of the system */
+	if( region->pool != NULL ){
+		if( (flags & CMA_ENTRY_HUGEPAGE) && size >= PMD_SIZE )
+			fit.c.align = max_t(u64, fit.c.align, PMD_SIZE);
+
+		fit.phy_base = region->phy_base;
+		if( fit.c.align > PAGE_SIZE || fit.c.boundary || fit.c.end )
+			entry->v_ptr = (void*)gen_pool_alloc_algo(region->pool, size, cma_genpool_constrained_fit, &fit);
+		else
+			entry->v_ptr = (void*)gen_pool_alloc(region->pool, size);
+
+		if( entry->v_ptr == NULL ){
+			kfree(entry);
+			return NULL;
+		}
+
+		entry->size 	= size;
+		entry->phy_addr = gen_pool_virt_to_phys(region->pool, (unsigned long)entry->v_ptr);
+
+		/* region is mapped cached for the kernel, zeroes have to reach the memory */
+		memset(entry->v_ptr, 0, size);
+		dma_sync_single_for_device(region->dev, phys_to_dma(region->dev, entry->phy_addr), size, DMA_TO_DEVICE);
+
+		return entry;
 	}
 
-	/* add entry */
-	err = cma_entry_add(entry);
-	if(err)	goto error_cma_entry_add;
+	entry->size = size;
 
-	/* put physical address to user space */
-	__put_user(entry->phy_addr, (typeof(&entry->phy_addr))arg);
+	/* CMA allocations are aligned to their order, larger alignment is asked
+	 * from the CMA area itself */
+	if( fit.c.align > ((u64)PAGE_SIZE << get_order(size)) ){
+		if( region->no_map ){
+			kfree(entry);
+			return NULL;
+		}
 
-	return entry->phy_addr;
+		entry->v_ptr = cma_contig_alloc(region->dev, size, fit.c.align, flags, &entry->phy_addr);
+		if( entry->v_ptr == NULL && cma_cache_shrink(ULONG_MAX) )
+			entry->v_ptr = cma_contig_alloc(region->dev, size, fit.c.align, flags, &entry->phy_addr);
 
+		if( entry->v_ptr == NULL ){
+			kfree(entry);
+			return NULL;
+		}
 
-error_cma_entry_add:
-	dma_free_coherent(NULL, entry->size, entry->v_ptr, entry->phy_addr);
+		entry->flags |= CMA_ENTRY_CONTIG;
+	}
+	else{
+		/* allocate contigous memory, memory held by the cache is the first thing
+		 * to give up, but not for the pool which is kept in the cache */
+		entry->v_ptr = dma_alloc_coherent(region->dev, size, &dma_handle, GFP_KERNEL);
+		if( entry->v_ptr == NULL && !(flags & CMA_ENTRY_SCRUBBED) && cma_cache_shrink(ULONG_MAX) )
+			entry->v_ptr = dma_alloc_coherent(region->dev, size, &dma_handle, GFP_KERNEL);
+
+		if( entry->v_ptr == NULL ){
+			kfree(entry);
+			return NULL;
+		}
+
+		/* handle is device address, it differs from physical one behind dma-ranges */
+		entry->phy_addr = dma_to_phys(region->dev, dma_handle);
+	}
+
+	/* order alignment is not guaranteed above CONFIG_CMA_ALIGNMENT or outside CMA area */
+	if( c != NULL && !cma_constraint_met(c, entry->phy_addr, size) ){
+		__DEBUG("cma_entry_create() - %pad does not meet constraints\n", &entry->phy_addr);
+		cma_entry_destroy(entry);
+		return NULL;
+	}
+
+	return entry;
+}
+
+
+static void cma_entry_destroy(struct cma_entry *entry)
+{
+	struct cma_region *region = entry->region;
+
+	__DEBUG("cma_entry_destroy() - phy_addr %pad\n", &entry->phy_addr);
+
+	if( region->pool != NULL )
+		gen_pool_free(region->pool, (unsigned long)entry->v_ptr, entry->size);
+	else if( entry->flags & CMA_ENTRY_CONTIG )
+		cma_contig_free(region->dev, entry->v_ptr, entry->phy_addr, entry->size);
+	else
+		dma_free_coherent(region->dev, entry->size, entry->v_ptr, phys_to_dma(region->dev, entry->phy_addr));
 
-error_dma_alloc_coherent:
 	kfree(entry);
-	
-	return err;
 }
 
 
-static long cma_ioctl_free(struct file *filp, unsigned int cmd, unsigned long arg)
+/* hugepage flag is kept only if the entry can be mapped with PMD entries */
+static void cma_entry_check_hugepage(struct cma_entry *entry)
 {
-	dma_addr_t v_usr_addr;
-	__DEBUG("cma_ioctl_free() called!\n");
+	if( !IS_ENABLED(CONFIG_TRANSPARENT_HUGEPAGE) || (entry->flags & CMA_ENTRY_PAGES) ||
+		entry->size < PMD_SIZE || !IS_ALIGNED(entry->phy_addr, PMD_SIZE) )
+		entry->flags &= ~CMA_ENTRY_HUGEPAGE;
+}
 
-	if( !access_ok(VERIFY_READ, (void __user*) arg, _IOC_SIZE(cmd)) )
-		return -EFAULT;
 
-	__get_user(v_usr_addr, (typeof(&v_usr_addr))arg );
+/* allocator holds the only reference of every page which is not pinned */
+static bool cma_entry_pages_pinned(struct cma_entry *entry)
+{
+	unsigned long pfn = PHYS_PFN(entry->phy_addr);
+	unsigned long end = pfn + PFN_UP(entry->size);
+
+	for(; pfn<end; pfn++){
+		if( page_count(pfn_to_page(pfn)) != 1 )
+			return true;
+	}
 
-	return cma_entry_release(v_usr_addr);
+	return false;
 }
 
 
-static struct cma_entry *cma_ioctl_get_entry_from_v_usr_addr(unsigned int cmd, unsigned long arg)
+/* released entries are kept for reuse if there is space in the cache */
+static void cma_entry_free(struct cma_entry *entry)
 {
-	unsigned v_usr_addr;
+	__DEBUG("cma_entry_free() - phy_addr %pad\n", &entry->phy_addr);
+
+	/* pages pinned by I/O can be written to, CMA area can not isolate them, so
+	 * they are never handed out again */
+	if( (entry->flags & CMA_ENTRY_PAGES) && cma_entry_pages_pinned(entry) ){
+		__ERROR("Releasing memory with pinned pages, phy_addr %pad\n", &entry->phy_addr);
+		cma_entry_destroy(entry);
+		return;
+	}
 
-	__DEBUG("cma_ioctl_get_entry_from_v_usr_addr() called!\n");
+	if( cma_cache_put(entry) )
+		cma_entry_destroy(entry);
+}
 
-	/* routine check */
-	if( !access_ok(VERIFY_READ, (void __user*) arg, _IOC_SIZE(cmd)) )
-		return NULL;
-	if( !access_ok(VERIFY_WRITE, (void __user*) arg, _IOC_SIZE(cmd)) )
-		return NULL;
 
-	/* get process user address */
-	__get_user(v_usr_addr, (typeof(&v_usr_addr))arg );
+static void cma_entry_kref_release(struct kref *ref)
+{
+	struct cma_entry *entry = container_of(ref, struct cma_entry, ref);
+	unsigned i;
+
+	/* imported entry only borrows the memory */
+	if( entry->dmabuf != NULL ){
+		dma_buf_put(entry->dmabuf);
+		kfree(entry);
+		return;
+	}
+
+	/* parts are entries on their own */
+	if( entry->parts != NULL ){
+		for(i=0; i<entry->nparts; i++)
+			cma_entry_put(entry->parts[i]);
+
+		kfree(entry->parts);
+		kfree(entry);
+		return;
+	}
 
-	/* search for appropriate entry */
-	return cma_entry_get_by_v_usr_addr(v_usr_addr);
+	cma_stats_account(entry, -1);
+	cma_entry_free(entry);
 }
 
 
-static long cma_ioctl_get_phy_addr(struct file *filp, unsigned int cmd, unsigned long arg)
+/* drop a reference, memory is released with the last one */
+static void cma_entry_put(struct cma_entry *entry)
 {
-	
-	struct cma_entry *entry;
+	kref_put(&entry->ref, cma_entry_kref_release);
+}
 
-	__DEBUG("cma_ioctl_get_phy_addr() called!\n");
 
-	/* get entry */
-	entry = cma_ioctl_get_entry_from_v_usr_addr(cmd, arg);
-	if(entry == NULL)
-		return -EFAULT;
+/* inline function for readability */
+static void cma_entry_set_pgprot(struct cma_entry *entry, struct vm_area_struct *vma)
+{
+	/* should memory be uncached or write-combined? */
+	if( entry->flags & CMA_ENTRY_NONCACHED )
+		vma->vm_page_prot = pgprot_noncached(vma->vm_page_prot);
+	else if( entry->flags & CMA_ENTRY_WRITECOMBINE )
+		vma->vm_page_prot = pgprot_writecombine(vma->vm_page_prot);
+}
 
-	/* put physical address into user space */
-	__put_user(entry->phy_addr, (typeof(&entry->phy_addr))arg);
 
-	return 0;
+/* inline function for readability */
+static inline struct cma_entry *cma_entry_part(struct cma_entry *entry, unsigned i)
+{
+	return entry->parts != NULL ? entry->parts[i] : entry;
 }
 
 
-static long cma_ioctl_get_size(struct file *filp, unsigned int cmd, unsigned long arg)
+/* finds part containing offset of the entry, offset is made relative to the
+ * part, returns NULL if offset is out of the entry */
+static struct cma_entry *cma_entry_part_at(struct cma_entry *entry, unsigned long *offset)
 {
-	struct cma_entry *entry;
+	struct cma_entry *part;
+	unsigned i;
 
-	__DEBUG("cma_ioctl_get_size() called!\n");
+	for(i=0; i<entry->nparts; i++){
+		part = cma_entry_part(entry, i);
 
-	/* get entry */
-	entry = cma_ioctl_get_entry_from_v_usr_addr(cmd, arg);
-	if(entry == NULL)
-		return -EFAULT;
+		if( *offset < part->size )
+			return part;
 
-	/* put size into user space */
-	__put_user(entry->size, (typeof(&entry->size))arg);
+		*offset -= part->size;
+	}
 
-	return 0;
+	return NULL;
 }
 
 
-static int cma_init(void)
+/* maps struct pages, so that the mapping can be pinned by get_user_pages() */
+static int cma_insert_pages(struct vm_area_struct *vma, unsigned long addr, phys_addr_t phy_addr, unsigned long len)
 {
+	unsigned long pfn = PHYS_PFN(phy_addr);
 	int err;
+
+	for(; len>0; len-=PAGE_SIZE, addr+=PAGE_SIZE, pfn++){
+		err = vm_insert_page(vma, addr, pfn_to_page(pfn));
+		if(err) return err;
+	}
+
+	return 0;
+}
+
+
+/* maps entry to the whole vma, starting from offset within the entry */
+static int cma_entry_remap(struct cma_entry *entry, struct vm_area_struct *vma, unsigned long offset)
+{
+	struct cma_entry *part;
+	unsigned long addr = vma->vm_start, part_offset, len;
+
+	while( addr < vma->vm_end ){
+		/* mirrored mapping wraps around */
+		if( offset >= entry->size )
+			offset -= entry->size;
+
+		part_offset = offset;
+		part = cma_entry_part_at(entry, &part_offset);
+		if( part == NULL )
+			return -EINVAL;
+
+		len = min(part->size - part_offset, vma->vm_end - addr);
+
+		if( entry->flags & CMA_ENTRY_PAGES ){
+			if( cma_insert_pages(vma, addr, part->phy_addr + part_offset, len) )
+				return -EAGAIN;
+		}
+		else if( remap_pfn_range(vma, addr, PHYS_PFN(part->phy_addr + part_offset), len, vma->vm_page_prot) )
+			return -EAGAIN;
+
+		addr 	+= len;
+		offset 	+= len;
+	}
+
+	return 0;
+}
+
+
+/* cache maintenance of a range of the entry, part by part */
+static void cma_entry_sync(struct cma_entry *entry, unsigned long offset, unsigned long len,
+						   int for_device, enum dma_data_direction dir)
+{
+	struct cma_entry *part;
+	struct device *dev;
+	unsigned long part_offset, part_len;
+
+	while( len > 0 ){
+		/* range seen through mirrored mapping wraps around */
+		if( offset >= entry->size )
+			offset -= entry->size;
+
+		part_offset = offset;
+		part = cma_entry_part_at(entry, &part_offset);
+		if( part == NULL )
+			return;
+
+		part_len = min(part->size - part_offset, len);
+		dev 	 = part->region->dev;
+
+		if( for_device )
+			dma_sync_single_for_device(dev, phys_to_dma(dev, part->phy_addr + part_offset), part_len, dir);
+		else
+			dma_sync_single_for_cpu(dev, phys_to_dma(dev, part->phy_addr + part_offset), part_len, dir);
+
+		offset 	+= part_len;
+		len 	-= part_len;
+	}
+}
+
+
+/* inline function for readability */
+static inline struct list_head *cma_cache_list(size_t size, int flags)
+{
+	int order = min(get_order(size), CMA_CACHE_CLASSES-1);
+
+	return &cma_cache[order][(flags & CMA_ENTRY_UNCACHED) ? 1 : 0];
+}
+
+
+static struct cma_entry *cma_cache_get(size_t size, int flags, u64 owner)
+{
+	struct cma_entry *entry, *found = NULL;
+
+	/* carveout allocations are fast enough, only the default area is cached */
+	if( flags & (CMA_ENTRY_CARVEOUT | CMA_ENTRY_REGION_MASK) )
+		return NULL;
+
+	mutex_lock(&mutex_cma_cache);
+
+	/* zeroed memory is clean and serves any type */
+	list_for_each_entry(entry, cma_cache_list(size, CMA_ENTRY_CACHED), cache_node){
+		if( entry->size == size && (entry->flags & CMA_ENTRY_SCRUBBED) )
+			goto hit;
+	}
+	list_for_each_entry(entry, cma_cache_list(size, CMA_ENTRY_UNCACHED), cache_node){
+		if( entry->size == size && (entry->flags & CMA_ENTRY_SCRUBBED) )
+			goto hit;
+	}
+
+	/* memory of the same file does not need zeroing if it is not wanted */
+	list_for_each_entry(entry, cma_cache_list(size, flags), cache_node){
+		if( entry->size != size )
+			continue;
+		if( !(flags & CMA_ENTRY_NOZERO) || entry->owner == owner )
+			goto hit;
+		if( found == NULL )
+			found = entry;
+	}
+
+	if( found != NULL ){
+		entry = found;
+		goto hit;
+	}
+
+	mutex_unlock(&mutex_cma_cache);
+	atomic_long_inc(&cma_cache_misses);
+
+	return NULL;
+
+hit:
+	list_del(&entry->cache_node);
+	list_del(&entry->lru_node);
+	cma_cache_bytes -= entry->size;
+
+	mutex_unlock(&mutex_cma_cache);
+	atomic_long_inc(&cma_cache_hits);
+
+	__DEBUG("cma_cache_get() - hit phy_addr %pad\n", &entry->phy_addr);
+
+	/* never pass data to the next owner */
+	if( !(entry->flags & CMA_ENTRY_SCRUBBED) && !((flags & CMA_ENTRY_NOZERO) && entry->owner == owner) )
+		cma_entry_scrub(entry);
+
+	/* noncached and write-combined entries share the list */
+	entry->flags = flags;
+
+	return entry;
+}
+
+
+static int cma_cache_put(struct cma_entry *entry)
+{
+	unsigned long max_bytes = READ_ONCE(cache_max_bytes);
+	unsigned long excess = 0;
+
+	/* entry flags of a reused entry are replaced, placed pages would be
+	 * freed as if they came from dma_alloc_coherent() */
+	if( entry->region->index >= 0 || (entry->flags & CMA_ENTRY_CONTIG) )
+		return -EINVAL;
+
+	if( entry->size > max_bytes )
+		return -ENOSPC;
+
+	mutex_lock(&mutex_cma_cache);
+
+	list_add(&entry->cache_node, cma_cache_list(entry->size, entry->flags));
+	list_add(&entry->lru_node, &cma_cache_lru);
+	cma_cache_bytes += entry->size;
+
+	if( cma_cache_bytes > max_bytes )
+		excess = cma_cache_bytes - max_bytes;
+
+	mutex_unlock(&mutex_cma_cache);
+
+	if( !(entry->flags & CMA_ENTRY_SCRUBBED) )
+		cma_scrub_kick();
+
+	/* make space by dropping least recently released entries */
+	if( excess )
+		cma_cache_shrink(excess);
+
+	return 0;
+}
+
+
+/* returns number of bytes given back */
+static unsigned long cma_cache_shrink(unsigned long nr_bytes)
+{
+	LIST_HEAD(evicted);
+	struct cma_entry *entry, *next;
+	unsigned long freed = 0;
+
+	mutex_lock(&mutex_cma_cache);
+
+	while( freed < nr_bytes && !list_empty(&cma_cache_lru) ){
+		entry = list_last_entry(&cma_cache_lru, struct cma_entry, lru_node);
+
+		list_del(&entry->cache_node);
+		list_move(&entry->lru_node, &evicted);
+		cma_cache_bytes -= entry->size;
+		freed += entry->size;
+	}
+
+	mutex_unlock(&mutex_cma_cache);
+
+	list_for_each_entry_safe(entry, next, &evicted, lru_node)
+		cma_entry_destroy(entry);
+
+	return freed;
+}
+
+
+static unsigned long cma_cache_shrinker_count(struct shrinker *shrinker, struct shrink_control *sc)
+{
+	return READ_ONCE(cma_cache_bytes) >> PAGE_SHIFT;
+}
+
+
+static unsigned long cma_cache_shrinker_scan(struct shrinker *shrinker, struct shrink_control *sc)
+{
+	return cma_cache_shrink(sc->nr_to_scan << PAGE_SHIFT) >> PAGE_SHIFT;
+}
+
+
+static void cma_entry_scrub(struct cma_entry *entry)
+{
+	/* Previous owner could leave dirty lines through its cached mapping, they
+	 * have to be dropped before clearing or they would overwrite the zeroes */
+	if( !(entry->flags & CMA_ENTRY_UNCACHED) )
+		dma_sync_single_for_cpu(entry->region->dev, phys_to_dma(entry->region->dev, entry->phy_addr),
+								entry->size, DMA_FROM_DEVICE);
+
+	memset(entry->v_ptr, 0, entry->size);
+}
+
+
+static void cma_scrub_kick(void)
+{
+	if( cma_scrub_task == NULL )
+		return;
+
+	atomic_set(&cma_scrub_pending, 1);
+	wake_up(&cma_scrub_wait);
+}
+
+
+/* takes released memory which still holds data out of the cache */
+static struct cma_entry *cma_cache_take_dirty(void)
+{
+	struct cma_entry *entry;
+
+	mutex_lock(&mutex_cma_cache);
+
+	list_for_each_entry(entry, &cma_cache_lru, lru_node){
+		if( entry->flags & CMA_ENTRY_SCRUBBED )
+			continue;
+
+		list_del(&entry->cache_node);
+		list_del(&entry->lru_node);
+		cma_cache_bytes -= entry->size;
+
+		mutex_unlock(&mutex_cma_cache);
+		return entry;
+	}
+
+	mutex_unlock(&mutex_cma_cache);
+
+	return NULL;
+}
+
+
+static unsigned int cma_cache_count_scrubbed(size_t size)
+{
+	struct cma_entry *entry;
+	unsigned int count = 0;
+
+	mutex_lock(&mutex_cma_cache);
+
+	list_for_each_entry(entry, cma_cache_list(size, CMA_ENTRY_CACHED), cache_node)
+		count += entry->size == size && (entry->flags & CMA_ENTRY_SCRUBBED);
+	list_for_each_entry(entry, cma_cache_list(size, CMA_ENTRY_UNCACHED), cache_node)
+		count += entry->size == size && (entry->flags & CMA_ENTRY_SCRUBBED);
+
+	mutex_unlock(&mutex_cma_cache);
+
+	return count;
+}
+
+
+/* allocates zeroed buffers until the pool is full or the cache has no space */
+static void cma_pool_refill(void)
+{
+	struct cma_entry *entry;
+	size_t size = PAGE_ALIGN(READ_ONCE(pool_buffer_size));
+	unsigned int count = READ_ONCE(pool_buffer_count);
+
+	if( size == 0 )
+		return;
+
+	while( !kthread_should_stop() && cma_cache_count_scrubbed(size) < count ){
+		if( READ_ONCE(cma_cache_bytes) + size > READ_ONCE(cache_max_bytes) )
+			return;
+
+		/* newly allocated memory is zeroed by the allocator */
+		entry = cma_entry_create(cma_region_default, size, CMA_ENTRY_CACHED | CMA_ENTRY_SCRUBBED, NULL);
+		if( entry == NULL )
+			return;
+
+		if( cma_cache_put(entry) ){
+			cma_entry_destroy(entry);
+			return;
+		}
+	}
+}
+
+
+static int cma_scrub_thread(void *unused)
+{
+	struct cma_entry *entry;
+
+	set_user_nice(current, MAX_NICE);
+
+	while( !kthread_should_stop() ){
+		wait_event_interruptible(cma_scrub_wait,
+			atomic_xchg(&cma_scrub_pending, 0) || kthread_should_stop());
+
+		/* released memory is reused first, zero it before growing the pool */
+		while( !kthread_should_stop() && (entry = cma_cache_take_dirty()) != NULL ){
+			cma_entry_scrub(entry);
+
+			entry->flags |= CMA_ENTRY_SCRUBBED;
+			if( cma_cache_put(entry) )
+				cma_entry_destroy(entry);
+
+			cond_resched();
+		}
+
+		cma_pool_refill();
+	}
+
+	return 0;
+}
+
+
+/* sysfs attributes */
+static ssize_t cache_hits_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%lu\n", atomic_long_read(&cma_cache_hits));
+}
+
+static ssize_t cache_misses_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%lu\n", atomic_long_read(&cma_cache_misses));
+}
+
+static ssize_t cache_bytes_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%lu\n", READ_ONCE(cma_cache_bytes));
+}
+
+static DEVICE_ATTR_RO(cache_hits);
+static DEVICE_ATTR_RO(cache_misses);
+static DEVICE_ATTR_RO(cache_bytes);
+
+static struct attribute *cma_attrs[] = {
+	&dev_attr_cache_hits.attr,
+	&dev_attr_cache_misses.attr,
+	&dev_attr_cache_bytes.attr,
+	NULL
+};
+ATTRIBUTE_GROUPS(cma);
+
+
+/* inline function for readability */
+static inline int cma_stat_type(int flags)
+{
+	if( flags & CMA_ENTRY_NONCACHED )
+		return 1;
+	if( flags & CMA_ENTRY_WRITECOMBINE )
+		return 2;
+
+	return 0;
+}
+
+
+/* accounts memory handed out to (sign 1) or taken back from (sign -1) users */
+static void cma_stats_account(struct cma_entry *entry, int sign)
+{
+	int i, type = cma_stat_type(entry->flags);
+	unsigned long total = 0;
+
+	spin_lock(&cma_stats_lock);
+
+	cma_stats_bytes[type] += sign * (long)entry->size;
+	cma_stats_count[type] += sign;
+
+	cma_stats_bytes_hwm[type] = max(cma_stats_bytes_hwm[type], cma_stats_bytes[type]);
+	cma_stats_count_hwm[type] = max(cma_stats_count_hwm[type], cma_stats_count[type]);
+
+	for(i=0; i<CMA_STAT_TYPES; i++)
+		total += cma_stats_bytes[i];
+	cma_stats_total_hwm = max(cma_stats_total_hwm, total);
+
+	spin_unlock(&cma_stats_lock);
+}
+
+
+/* inline function for readability */
+static inline void cma_stats_hist_add(atomic_long_t *hist, ktime_t delta)
+{
+	u64 ns = ktime_to_ns(delta);
+	int bucket = ns > 1 ? min(ilog2(ns), CMA_STAT_HIST_BUCKETS-1) : 0;
+
+	atomic_long_inc(&hist[bucket]);
+}
+
+
+/* gen_pool_for_each_chunk() callback, longest run of free bits */
+static void cma_carveout_largest_free(struct gen_pool *pool, struct gen_pool_chunk *chunk, void *data)
+{
+	unsigned long *largest = data;
+	int order = pool->min_alloc_order;
+	unsigned long nbits = (chunk->end_addr - chunk->start_addr + 1) >> order;
+	unsigned long start, end;
+
+	start = find_next_zero_bit(chunk->bits, nbits, 0);
+	while( start < nbits ){
+		end = find_next_bit(chunk->bits, nbits, start);
+		*largest = max(*largest, (end - start) << order);
+
+		start = find_next_zero_bit(chunk->bits, nbits, end);
+	}
+}
+
+
+static int cma_debugfs_stats_show(struct seq_file *s, void *unused)
+{
+	unsigned long bytes[CMA_STAT_TYPES], count[CMA_STAT_TYPES];
+	unsigned long bytes_hwm[CMA_STAT_TYPES], count_hwm[CMA_STAT_TYPES];
+	unsigned long total_hwm, largest = 0;
+	struct cma_region *region;
+	int i;
+
+	/* consistent snapshot */
+	spin_lock(&cma_stats_lock);
+	memcpy(bytes, cma_stats_bytes, sizeof(bytes));
+	memcpy(count, cma_stats_count, sizeof(count));
+	memcpy(bytes_hwm, cma_stats_bytes_hwm, sizeof(bytes_hwm));
+	memcpy(count_hwm, cma_stats_count_hwm, sizeof(count_hwm));
+	total_hwm = cma_stats_total_hwm;
+	spin_unlock(&cma_stats_lock);
+
+	seq_printf(s, "%-16s %14s %10s %14s %10s\n", "type", "bytes", "buffers", "bytes_hwm", "buffers_hwm");
+	for(i=0; i<CMA_STAT_TYPES; i++)
+		seq_printf(s, "%-16s %14lu %10lu %14lu %10lu\n", cma_stat_names[i],
+				   bytes[i], count[i], bytes_hwm[i], count_hwm[i]);
+
+	seq_printf(s, "total_bytes_hwm: %lu\n", total_hwm);
+	seq_printf(s, "cache_bytes: %lu\n", READ_ONCE(cma_cache_bytes));
+	seq_printf(s, "cma_free_bytes: %lu\n", global_zone_page_state(NR_FREE_CMA_PAGES) << PAGE_SHIFT);
+
+	/* bitmap is read without synchronization, result is approximate */
+	if( carveout != NULL ){
+		gen_pool_for_each_chunk(carveout->pool, cma_carveout_largest_free, &largest);
+
+		seq_printf(s, "carveout_size: %zu\n", gen_pool_size(carveout->pool));
+		seq_printf(s, "carveout_free_bytes: %zu\n", gen_pool_avail(carveout->pool));
+		seq_printf(s, "carveout_largest_free: %lu\n", largest);
+	}
+
+	/* free space of device regions is known only to their allocator */
+	for(i=0; i<cma_region_count; i++){
+		region = cma_regions[i];
+		seq_printf(s, "region%d: %s %s base 0x%llx size %zu", i, region->name,
+				   region->pool != NULL ? "carveout" : "device", (unsigned long long)region->phy_base, region->size);
+		if( region->pool != NULL )
+			seq_printf(s, " free %zu", gen_pool_avail(region->pool));
+		seq_printf(s, "\n");
+	}
+
+	return 0;
+}
+
+
+static int cma_debugfs_processes_show(struct seq_file *s, void *unused)
+{
+	struct cma_file_data *data;
+	struct cma_entry *entry;
+	struct rb_node *node;
+	unsigned long bytes, count;
+
+	seq_printf(s, "%-8s %-16s %14s %10s\n", "pid", "comm", "bytes", "buffers");
+
+	mutex_lock(&mutex_cma_files);
+	list_for_each_entry(data, &cma_files, list){
+		bytes = count = 0;
+
+		mutex_lock(&data->lock);
+		for(node = rb_first(&data->phy_root); node != NULL; node = rb_next(node)){
+			entry = rb_entry(node, struct cma_entry, phy_node);
+			bytes += entry->size;
+			count++;
+		}
+		mutex_unlock(&data->lock);
+
+		seq_printf(s, "%-8d %-16s %14lu %10lu\n", data->pid, data->comm, bytes, count);
+	}
+	mutex_unlock(&mutex_cma_files);
+
+	return 0;
+}
+
+
+/* inline function for readability */
+static void cma_debugfs_hist_show(struct seq_file *s, atomic_long_t *hist)
+{
+	int i;
+
+	seq_printf(s, "%-12s %12s\n", "ns_from", "count");
+	for(i=0; i<CMA_STAT_HIST_BUCKETS; i++)
+		seq_printf(s, "%-12llu %12lu\n", i ? 1ULL << i : 0, atomic_long_read(&hist[i]));
+}
+
+static int cma_debugfs_alloc_latency_show(struct seq_file *s, void *unused)
+{
+	cma_debugfs_hist_show(s, cma_stats_alloc_hist);
+	return 0;
+}
+
+static int cma_debugfs_ioctl_latency_show(struct seq_file *s, void *unused)
+{
+	cma_debugfs_hist_show(s, cma_stats_ioctl_hist);
+	return 0;
+}
+
+
+/* show function is passed as inode private data */
+static int cma_debugfs_open(struct inode *inode, struct file *filp)
+{
+	return single_open(filp, inode->i_private, NULL);
+}
+
+static const struct file_operations cma_debugfs_fops = {
+	.owner 		= THIS_MODULE,
+	.open 		= cma_debugfs_open,
+	.read 		= seq_read,
+	.llseek 	= seq_lseek,
+	.release 	= single_release
+};
+
+
+/* statistics are optional, errors are ignored */
+static void cma_debugfs_init(void)
+{
+	cma_debugfs = debugfs_create_dir(DRIVER_NODE_NAME, NULL);
+	if( IS_ERR_OR_NULL(cma_debugfs) )
+		return;
+
+	debugfs_create_file("stats", S_IRUGO, cma_debugfs, cma_debugfs_stats_show, &cma_debugfs_fops);
+	debugfs_create_file("processes", S_IRUGO, cma_debugfs, cma_debugfs_processes_show, &cma_debugfs_fops);
+	debugfs_create_file("alloc_latency", S_IRUGO, cma_debugfs, cma_debugfs_alloc_latency_show, &cma_debugfs_fops);
+	debugfs_create_file("ioctl_latency", S_IRUGO, cma_debugfs, cma_debugfs_ioctl_latency_show, &cma_debugfs_fops);
+}
+
+
+/* releases all entries of the registry and the registry itself, there can
+ * not be any mappings left as every vma holds a reference to the file */
+static void cma_file_data_free(struct cma_file_data *data)
+{
+	struct cma_entry *entry, *next;
+
+	rbtree_postorder_for_each_entry_safe(entry, next, &data->phy_root, phy_node)
+		cma_entry_put(entry);
+
+	kfree(data);
+}
+
+
+static int cma_open(struct inode *inode, struct file *filp)
+{
+	struct cma_file_data *data;
+
+	__DEBUG("cma_open() called!\n");
+
+	data = kmalloc(sizeof(struct cma_file_data), GFP_KERNEL);
+	if( data == NULL )
+		return -ENOMEM;
+
+	mutex_init(&data->lock);
+	data->phy_root = RB_ROOT;
+	data->va_root  = RB_ROOT;
+	data->id 	   = atomic64_inc_return(&cma_file_ids);
+	data->pid 	   = task_tgid_nr(current);
+	get_task_comm(data->comm, current->group_leader);
+
+	mutex_lock(&mutex_cma_files);
+	list_add(&data->list, &cma_files);
+	mutex_unlock(&mutex_cma_files);
+
+	filp->private_data = data;
+
+	return 0;
+}
+
+
+/* called when the last reference to the file is dropped, either by close()
+ * or by the exit of the owning process */
+static int cma_file_release(struct inode *inode, struct file *filp)
+{
+	struct cma_file_data *data = filp->private_data;
+
+	__DEBUG("cma_file_release() called!\n");
+
+	mutex_lock(&mutex_cma_files);
+	list_del(&data->list);
+	mutex_unlock(&mutex_cma_files);
+
+	cma_file_data_free(data);
+
+	return 0;
+}
+
+
+/* inline function for readability */
+inline int check_entry_accordance(struct cma_entry *entry, struct vm_area_struct *vma)
+{
+	if( entry == NULL )
+		return -EFAULT;
+
+	if( entry->phy_addr != PFN_PHYS(vma->vm_pgoff) )
+		return -EFAULT;
+
+	/* mirrored mapping maps the entry twice, back-to-back */
+	if( entry->size != vma->vm_end-vma->vm_start &&
+		(!PAGE_ALIGNED(entry->size) || 2 * entry->size != vma->vm_end-vma->vm_start) )
+		return -EFAULT;
+
+	return 0;
+}
+
+/* allocates memory for the mapping, vma offset is replaced with its physical
+ * address */
+static int cma_mmap_alloc(struct file *filp, struct vm_area_struct *vma)
+{
+	int err, flags;
+	unsigned long size = vma->vm_end - vma->vm_start;
+	unsigned long pgoff = vma->vm_pgoff & ~(CMA_MMAP_ALLOC_OFFSET >> PAGE_SHIFT);
+	dma_addr_t phy_addr;
+
+	__DEBUG("cma_mmap_alloc() - size 0x%lx\n", size);
+
+	/* nothing but flags can be encoded in the offset */
+	if( pgoff & ((1UL << (CMA_MMAP_FLAGS_SHIFT - PAGE_SHIFT)) - 1) )
+		return -EINVAL;
+	err = cma_alloc_flags_to_entry(pgoff >> (CMA_MMAP_FLAGS_SHIFT - PAGE_SHIFT), &flags);
+	if(err) return err;
+
+	err = cma_alloc_entry(filp, size, flags | CMA_ENTRY_AUTOFREE, &phy_addr);
+	if(err) return err;
+
+	vma->vm_pgoff = PHYS_PFN(phy_addr);
+
+	return 0;
+}
+
+
+static int cma_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	int err, allocated = 0;
+	struct cma_file_data *data = filp->private_data;
+	struct cma_entry *entry;
+
+	__DEBUG("cma_mmap() - pgoff 0x%lx, v_user_addr 0x%lx\n", vma->vm_pgoff, vma->vm_start);
+
+	/* private mapping would be copy-on-write, which pfn mappings filled on
+	 * fault can not be */
+	if( !(vma->vm_flags & VM_SHARED) )
+		return -EINVAL;
+
+	/* allocate and map in one call */
+	if( vma->vm_pgoff & (CMA_MMAP_ALLOC_OFFSET >> PAGE_SHIFT) ){
+		err = cma_mmap_alloc(filp, vma);
+		if(err) return err;
+		allocated = 1;
+	}
+
+	if(mutex_lock_interruptible(&data->lock)){
+		err = -EAGAIN;
+		goto leave_unlocked;
+	}
+
+	entry = cma_entry_get_by_phy_addr(data, PFN_PHYS(vma->vm_pgoff));
+	
+	/* check if mmap is alligned with according entry */
+	err = check_entry_accordance(entry, vma);
+	if(err) goto leave;
+
+	cma_entry_set_pgprot(entry, vma);
+
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+	/* hugepage entries are mapped on fault, PMD at a time when possible */
+	if( entry->flags & CMA_ENTRY_HUGEPAGE ){
+		vma->vm_flags |= VM_PFNMAP | VM_IO | VM_DONTEXPAND | VM_DONTDUMP | VM_HUGEPAGE;
+		vma->vm_ops = &cma_huge_ops;
+	}
+	else
+#endif
+	{
+		/* map memory to user space */
+		err = cma_entry_remap(entry, vma, 0);
+		if(err) goto leave;
+
+		vma->vm_ops = &cma_ops;
+	}
+
+	/* set user address for later reference (used when freeing the memory ) */
+	cma_entry_set_v_usr_addr(data, entry, vma->vm_start);
+
+	/* save entry and set entry mapped flag */
+	vma->vm_private_data = entry;
+	entry->flags |= CMA_ENTRY_MAPPED;
+	entry->map_count++;
+
+leave:
+	mutex_unlock(&data->lock);
+
+leave_unlocked:
+	/* memory allocated for this mapping is not needed anymore */
+	if( err && allocated )
+		cma_entry_discard(data, PFN_PHYS(vma->vm_pgoff));
+
+	return err;
+}
+
+
+/* vma was split or copied on fork */
+void cma_mmap_open(struct vm_area_struct *vma)
+{
+	struct cma_file_data *data = vma->vm_file->private_data;
+	struct cma_entry *entry = vma->vm_private_data;
+
+	__DEBUG("cma_mmap_open()\n");
+
+	mutex_lock(&data->lock);
+	entry->map_count++;
+	mutex_unlock(&data->lock);
+}
+
+
+void cma_mmap_close(struct vm_area_struct *vma)
+{
+	struct cma_file_data *data = vma->vm_file->private_data;
+	struct cma_entry *entry = vma->vm_private_data;
+	
+	__DEBUG("cma_mmap_close()\n");
+
+	mutex_lock(&data->lock);
+
+	if( --entry->map_count > 0 ){
+		mutex_unlock(&data->lock);
+		return;
+	}
+
+	/* remove custom mapped flag, entry can not be released while it is set */
+	entry->flags &= (~CMA_ENTRY_MAPPED);
+
+	/* memory allocated by mmap() lives as long as its mappings */
+	if( entry->flags & CMA_ENTRY_AUTOFREE ){
+		cma_entry_remove(data, entry);
+		mutex_unlock(&data->lock);
+
+		cma_entry_put(entry);
+		return;
+	}
+
+	mutex_unlock(&data->lock);
+}
+
+
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+/* inline function for readability */
+static inline int cma_vm_fault_result(int err)
+{
+	if( err == -ENOMEM )
+		return VM_FAULT_OOM;
+	if( err < 0 && err != -EBUSY )
+		return VM_FAULT_SIGBUS;
+
+	return VM_FAULT_NOPAGE;
+}
+
+
+/* offset of user address within the entry, vma could be split and mirrored
+ * mapping wraps around */
+static inline unsigned long cma_vma_offset(struct vm_area_struct *vma, struct cma_entry *entry, unsigned long addr)
+{
+	unsigned long offset = addr - vma->vm_start + (unsigned long)(PFN_PHYS(vma->vm_pgoff) - entry->phy_addr);
+
+	return offset < entry->size ? offset : offset - entry->size;
+}
+
+
+/* used for parts of hugepage entries which can not be mapped with PMD */
+static int cma_mmap_fault(struct vm_fault *vmf)
+{
+	struct vm_area_struct *vma = vmf->vma;
+	struct cma_entry *part = vma->vm_private_data;
+	unsigned long offset = cma_vma_offset(vma, part, vmf->address & PAGE_MASK);
+
+	part = cma_entry_part_at(part, &offset);
+	if( part == NULL )
+		return VM_FAULT_SIGBUS;
+
+	return cma_vm_fault_result(vm_insert_pfn(vma, vmf->address & PAGE_MASK,
+							   PHYS_PFN(part->phy_addr + offset)));
+}
+
+
+static int cma_mmap_huge_fault(struct vm_fault *vmf, enum page_entry_size pe_size)
+{
+	struct vm_area_struct *vma = vmf->vma;
+	struct cma_entry *part = vma->vm_private_data;
+	unsigned long addr = vmf->address & PMD_MASK;
+	unsigned long offset;
+
+	if( pe_size != PE_SIZE_PMD )
+		return VM_FAULT_FALLBACK;
+
+	/* whole PMD has to be covered by the mapping and a single part */
+	if( addr < vma->vm_start || addr + PMD_SIZE > vma->vm_end )
+		return VM_FAULT_FALLBACK;
+
+	offset = cma_vma_offset(vma, part, addr);
+
+	part = cma_entry_part_at(part, &offset);
+	if( part == NULL || offset + PMD_SIZE > part->size )
+		return VM_FAULT_FALLBACK;
+
+	if( !IS_ALIGNED(part->phy_addr + offset, PMD_SIZE) )
+		return VM_FAULT_FALLBACK;
+
+	return vm_insert_pfn_pmd(vma, addr, vmf->pmd, phys_to_pfn_t(part->phy_addr + offset, PFN_DEV),
+							 vmf->flags & FAULT_FLAG_WRITE);
+}
+
+
+/* user address has to have the same offset within PMD as the physical one,
+ * otherwise PMD sized mappings are not possible */
+static unsigned long cma_get_unmapped_area(struct file *filp, unsigned long addr, unsigned long len,
+										   unsigned long pgoff, unsigned long flags)
+{
+	unsigned long area, phy_offset;
+
+	if( len < PMD_SIZE || (flags & MAP_FIXED) )
+		return current->mm->get_unmapped_area(filp, addr, len, pgoff, flags);
+
+	area = current->mm->get_unmapped_area(filp, 0, len + PMD_SIZE, pgoff, flags);
+	if( IS_ERR_VALUE(area) )
+		return current->mm->get_unmapped_area(filp, addr, len, pgoff, flags);
+
+	phy_offset = (pgoff << PAGE_SHIFT) & (PMD_SIZE - 1);
+
+	return area + ((phy_offset - area) & (PMD_SIZE - 1));
+}
+#endif
+
+
+/* measures service time of every ioctl */
+static long cma_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	ktime_t start = ktime_get();
+	long ret;
+
+	ret = cma_ioctl_dispatch(filp, cmd, arg);
+
+	cma_stats_hist_add(cma_stats_ioctl_hist, ktime_sub(ktime_get(), start));
+
+	return ret;
+}
+
+
+static long cma_ioctl_dispatch(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	/* routine check */
+	__DEBUG("IOCTL command issued\n");
+
+	/* check validity of the cmd */
+	if(_IOC_TYPE(cmd) != CMA_IOCTL_MAGIC){
+		__ERROR("IOCTL Incorrect magic number\n");
+		return -ENOTTY;
+	}
+	if(_IOC_NR(cmd) > CMA_IOCTL_MAXNR){
+		__ERROR("IOCTL Command is not valid\n");
+		return -ENOTTY;
+	}
+
+	/* get size from userspace */
+	switch(cmd){
+		case CMA_ALLOC_CACHED:
+			return cma_ioctl_alloc(filp, cmd, arg, CMA_ENTRY_CACHED);
+		case CMA_ALLOC_NONCACHED:
+			return cma_ioctl_alloc(filp, cmd, arg, CMA_ENTRY_NONCACHED);
+		case CMA_ALLOC_WRITECOMBINE:
+			return cma_ioctl_alloc(filp, cmd, arg, CMA_ENTRY_WRITECOMBINE);
+		case CMA_ALLOC_EXT:
+			return cma_ioctl_alloc_ext(filp, cmd, arg);
+		case CMA_ALLOC_RING:
+			return cma_ioctl_alloc_ring(filp, cmd, arg);
+		case CMA_ALLOC_ALIGNED:
+			return cma_ioctl_alloc_aligned(filp, cmd, arg);
+		case CMA_ALLOC_CHUNKED:
+			return cma_ioctl_alloc_chunked(filp, cmd, arg);
+		case CMA_GET_CHUNKS:
+			return cma_ioctl_get_chunks(filp, cmd, arg);
+		case CMA_FREE:
+		case CMA_FREE64:
+			return cma_ioctl_free(filp, cmd, arg);
+		case CMA_GET_PHY_ADDR:
+		case CMA_GET_PHY_ADDR64:
+		case CMA_GET_DMA_ADDR:
+			return cma_ioctl_get_phy_addr(filp, cmd, arg);
+		case CMA_GET_SIZE:
+		case CMA_GET_SIZE64:
+			return cma_ioctl_get_size(filp, cmd, arg);
+		case CMA_GET_VERSION:
+			return CMA_IOCTL_VERSION;
+		case CMA_SYNC_FOR_DEVICE:
+		case CMA_SYNC_FOR_CPU:
+			return cma_ioctl_sync(filp, cmd, arg);
+		case CMA_GET_FLAGS:
+			return cma_ioctl_get_flags(filp, cmd, arg);
+		case CMA_EXPORT_DMABUF:
+			return cma_ioctl_export_dmabuf(filp, cmd, arg);
+		case CMA_IMPORT_DMABUF:
+			return cma_ioctl_import_dmabuf(filp, cmd, arg);
+		case CMA_GET_REGION:
+			return cma_ioctl_get_region(filp, cmd, arg);
+		default:
+			__DEBUG("This should never happen!\n");
+	}
+
+	return 0;
+}
+
+
+/* address the device uses to access the entry */
+static dma_addr_t cma_entry_dma_addr(struct cma_entry *entry)
+{
+	struct cma_entry *first = entry->parts != NULL ? entry->parts[0] : entry;
+
+	if( entry->flags & CMA_ENTRY_ACP )
+		return entry->phy_addr - acp_phys_base + acp_bus_base;
+
+	return phys_to_dma(first->region->dev, entry->phy_addr);
+}
+
+
+/* region selected by the flags, the default area if there is none, flags are
+ * completed with the region and carveout flag of it */
+static struct cma_region *cma_region_select(int *flags)
+{
+	struct cma_region *region;
+	unsigned index = (*flags & CMA_ENTRY_REGION_MASK) >> CMA_ENTRY_REGION_SHIFT;
+
+	if( index == 0 && !(*flags & CMA_ENTRY_CARVEOUT) )
+		return cma_region_default;
+
+	if( index == 0 )
+		region = carveout;
+	else
+		region = index <= cma_region_count ? cma_regions[index-1] : NULL;
+
+	if( region == NULL )
+		return ERR_PTR(-ENODEV);
+
+	/* carveout flag asks for the deterministic allocator */
+	if( (*flags & CMA_ENTRY_CARVEOUT) && region->pool == NULL )
+		return ERR_PTR(-EINVAL);
+
+	*flags &= ~CMA_ENTRY_REGION_MASK;
+	*flags |= (region->index + 1) << CMA_ENTRY_REGION_SHIFT;
+	if( region->pool != NULL )
+		*flags |= CMA_ENTRY_CARVEOUT;
+
+	return region;
+}
+
+
+/* allocated entry is not registered yet, caller holds the only reference */
+static struct cma_entry *cma_entry_obtain(size_t size, int flags, const struct cma_constraint *c, u64 owner)
+{
+	struct cma_entry *entry;
+	struct cma_region *region;
+	struct cma_constraint acp;
+	ktime_t start;
+
+	region = cma_region_select(&flags);
+	if( IS_ERR(region) )
+		return ERR_CAST(region);
+	if( (flags & CMA_ENTRY_ACP) && acp_size == 0 )
+		return ERR_PTR(-ENODEV);
+
+	/* pages of memory outside of linear mapping can not be referenced, carveout
+	 * would reuse memory which is still pinned when it is released */
+	if( (flags & CMA_ENTRY_PAGES) && (region->no_map || region->pool != NULL) )
+		return ERR_PTR(-EINVAL);
+
+	/* kernel maps carveout cached, user mapping must not differ from it */
+	if( (flags & CMA_ENTRY_UNCACHED) && region->pool != NULL )
+		return ERR_PTR(-EINVAL);
+
+	/* memory is placed in the ACP window as with any other constraint */
+	if( flags & CMA_ENTRY_ACP ){
+		acp 		= c != NULL ? *c : (struct cma_constraint){ .align = PAGE_SIZE };
+		acp.start 	= acp_phys_base;
+		acp.end 	= (u64)acp_phys_base + acp_size;
+		c = &acp;
+	}
+
+	/* reuse released memory of the same size or allocate new contigous memory,
+	 * cached memory is not placed to meet constraints */
+	entry = c == NULL ? cma_cache_get(size, flags, owner) : NULL;
+	if( entry == NULL ){
+		start = ktime_get();
+		entry = cma_entry_create(region, size, flags, c);
+		cma_stats_hist_add(cma_stats_alloc_hist, ktime_sub(ktime_get(), start));
+	}
+	if( entry == NULL )
+		return ERR_PTR(-ENOMEM);
+
+	cma_stats_account(entry, 1);
+
+	cma_entry_check_hugepage(entry);
+
+	/* set entry params */
+	entry->mm 			= NULL;
+	entry->v_usr_addr 	= 0;
+	entry->map_count 	= 0;
+	entry->owner 		= owner;
+	entry->dmabuf 		= NULL;
+	entry->parts 		= NULL;
+	entry->nparts 		= 1;
+	kref_init(&entry->ref);
+
+	/* pool buffer could be taken, let it be replaced */
+	if( size == PAGE_ALIGN(READ_ONCE(pool_buffer_size)) )
+		cma_scrub_kick();
+
+	return entry;
+}
+
+
+/* entry made of separately allocated parts which are added by the caller,
+ * parts are released together with the entry, even if it is incomplete */
+static struct cma_entry *cma_entry_compose(size_t size, int flags, unsigned max_parts)
+{
+	struct cma_entry *entry;
+
+	entry = kmalloc(sizeof(struct cma_entry), GFP_KERNEL);
+	if( entry == NULL )
+		return NULL;
+
+	entry->parts = kmalloc_array(max_parts, sizeof(struct cma_entry*), GFP_KERNEL);
+	if( entry->parts == NULL ){
+		kfree(entry);
+		return NULL;
+	}
+
+	entry->nparts 		= 0;
+	entry->size 		= size;
+	entry->phy_addr 	= 0;
+	entry->v_ptr 		= NULL;
+	entry->region 		= NULL;
+	entry->flags 		= flags;
+	entry->mm 			= NULL;
+	entry->v_usr_addr 	= 0;
+	entry->map_count 	= 0;
+	entry->owner 		= 0;	/* never recycled */
+	entry->dmabuf 		= NULL;
+	kref_init(&entry->ref);
+
+	return entry;
+}
+
+
+static long cma_alloc_entry(struct file *filp, size_t size, int flags, dma_addr_t *phy_addr)
+{
+	struct cma_file_data *data = filp->private_data;
+	int err;
+	struct cma_entry *entry;
+
+	__DEBUG("cma_alloc_entry() - size 0x%zx, flags 0x%x\n", size, flags);
+
+	entry = cma_entry_obtain(size, flags, NULL, data->id);
+	if( IS_ERR(entry) )
+		return PTR_ERR(entry);
+
+	/* add entry */
+	err = cma_entry_add(data, entry);
+	if(err)	goto error_cma_entry_add;
+
+	*phy_addr = entry->phy_addr;
+
+	return 0;
+
+
+error_cma_entry_add:
+	cma_entry_put(entry);
+	
+	return err;
+}
+
+
+/* legacy ABI, 32-bit size and physical address */
+static long cma_ioctl_alloc(struct file *filp, unsigned int cmd, unsigned long arg, int cached_flag)
+{
+	long err;
+	__u32 size;
+	dma_addr_t phy_addr;
+	__DEBUG("cma_ioctl_alloc_cached() called!\n");
+
+	if( !access_ok(VERIFY_READ, (void __user*) arg, _IOC_SIZE(cmd)) )
+		return -EFAULT;
+	if( !access_ok(VERIFY_WRITE, (void __user*) arg, _IOC_SIZE(cmd)) )
+		return -EFAULT;
+
+	__get_user(size, (typeof(&size))arg );
+
+	err = cma_alloc_entry(filp, size, cached_flag, &phy_addr);
+	if(err) return err;
+
+	/* memory is out of reach of the caller */
+	if( phy_addr > U32_MAX ){
+		cma_entry_discard(filp->private_data, phy_addr);
+		return -EOVERFLOW;
+	}
+
+	/* put physical address to user space */
+	__put_user((__u32)phy_addr, (__u32 __user*)arg);
+
+	return phy_addr;
+}
+
+
+/* CMA_ALLOC_FLAG_* to entry flags */
+static int cma_alloc_flags_to_entry(__u32 alloc_flags, int *flags)
+{
+	if( alloc_flags & ~CMA_ALLOC_FLAG_MASK )
+		return -EINVAL;
+
+	/* only one mapping type can be selected, ACP memory is cached */
+	if( (alloc_flags & CMA_ALLOC_FLAG_NONCACHED) && (alloc_flags & CMA_ALLOC_FLAG_WRITECOMBINE) )
+		return -EINVAL;
+	if( (alloc_flags & CMA_ALLOC_FLAG_ACP) &&
+		(alloc_flags & (CMA_ALLOC_FLAG_NONCACHED | CMA_ALLOC_FLAG_WRITECOMBINE)) )
+		return -EINVAL;
+
+	*flags = CMA_ENTRY_CACHED;
+	if( alloc_flags & CMA_ALLOC_FLAG_NONCACHED )
+		*flags |= CMA_ENTRY_NONCACHED;
+	if( alloc_flags & CMA_ALLOC_FLAG_WRITECOMBINE )
+		*flags |= CMA_ENTRY_WRITECOMBINE;
+	if( alloc_flags & CMA_ALLOC_FLAG_CARVEOUT )
+		*flags |= CMA_ENTRY_CARVEOUT;
+	if( alloc_flags & CMA_ALLOC_FLAG_HUGEPAGE )
+		*flags |= CMA_ENTRY_HUGEPAGE;
+	if( alloc_flags & CMA_ALLOC_FLAG_NOZERO )
+		*flags |= CMA_ENTRY_NOZERO;
+	if( alloc_flags & CMA_ALLOC_FLAG_PAGES )
+		*flags |= CMA_ENTRY_PAGES;
+	if( alloc_flags & CMA_ALLOC_FLAG_ACP )
+		*flags |= CMA_ENTRY_ACP;
+
+	*flags |= ((alloc_flags & CMA_ALLOC_FLAG_REGION_MASK) >> CMA_ALLOC_FLAG_REGION_SHIFT) << CMA_ENTRY_REGION_SHIFT;
+
+	return 0;
+}
+
+
+static long cma_ioctl_alloc_ext(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	long err;
+	int flags;
+	dma_addr_t phy_addr;
+	struct cma_alloc_ext req;
+
+	__DEBUG("cma_ioctl_alloc_ext() called!\n");
+
+	if( copy_from_user(&req, (void __user*)arg, sizeof(req)) )
+		return -EFAULT;
+
+	if( req.size == 0 || req.size > SIZE_MAX )
+		return -EINVAL;
+
+	err = cma_alloc_flags_to_entry(req.flags, &flags);
+	if(err) return err;
+
+	err = cma_alloc_entry(filp, req.size, flags, &phy_addr);
+	if(err) return err;
+
+	/* put physical address to user space */
+	req.phy_addr = phy_addr;
+	if( copy_to_user((void __user*)arg, &req, sizeof(req)) )
+		return -EFAULT;
+
+	return 0;
+}
+
+
+static long cma_ioctl_alloc_aligned(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	struct cma_file_data *data = filp->private_data;
+	long err;
+	int flags;
+	struct cma_entry *entry;
+	struct cma_region *region;
+	struct cma_constraint c = { 0 };
+	struct cma_alloc_aligned req;
+
+	__DEBUG("cma_ioctl_alloc_aligned() called!\n");
+
+	if( copy_from_user(&req, (void __user*)arg, sizeof(req)) )
+		return -EFAULT;
+
+	if( req.size == 0 || req.size > SIZE_MAX )
+		return -EINVAL;
+
+	/* both are powers of two, buffer has to fit between boundaries */
+	c.align 	= max_t(u64, req.align, PAGE_SIZE);
+	c.boundary 	= req.boundary;
+	if( c.align & (c.align - 1) )
+		return -EINVAL;
+	if( c.boundary && ((c.boundary & (c.boundary - 1)) || c.boundary < req.size || c.boundary < c.align) )
+		return -EINVAL;
+	if( (c.align >> PAGE_SHIFT) > LONG_MAX || (c.boundary >> PAGE_SHIFT) > LONG_MAX )
+		return -EINVAL;
+
+	err = cma_alloc_flags_to_entry(req.flags, &flags);
+	if(err) return err;
+
+	region = cma_region_select(&flags);
+	if( IS_ERR(region) )
+		return PTR_ERR(region);
+	if( region->pool == NULL && c.align > CMA_ALIGN_MAX )
+		return -EINVAL;
+	if( region->pool == NULL && region->no_map && c.align > ((u64)PAGE_SIZE << get_order(req.size)) )
+		return -EINVAL;
+
+	entry = cma_entry_obtain(req.size, flags, &c, data->id);
+	if( IS_ERR(entry) )
+		return PTR_ERR(entry);
+
+	req.size 	 = entry->size;
+	req.phy_addr = entry->phy_addr;
+
+	err = cma_entry_add(data, entry);
+	if(err) goto error_cma_entry_add;
+
+	if( copy_to_user((void __user*)arg, &req, sizeof(req)) ){
+		cma_entry_discard(data, req.phy_addr);
+		return -EFAULT;
+	}
+
+	return 0;
+
+
+error_cma_entry_add:
+	cma_entry_put(entry);
+
+	return err;
+}
+
+
+static long cma_ioctl_sync(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	struct cma_file_data *data = filp->private_data;
+	struct cma_entry *entry;
+	struct cma_sync req;
+
+	__DEBUG("cma_ioctl_sync() called!\n");
+
+	if( copy_from_user(&req, (void __user*)arg, sizeof(req)) )
+		return -EFAULT;
+
+	if(mutex_lock_interruptible(&data->lock))
+		return -EAGAIN;
+
+	entry = cma_entry_get_by_v_usr_addr(data, req.v_usr_addr);
+	if(entry == NULL){
+		mutex_unlock(&data->lock);
+		return -EFAULT;
+	}
+
+	/* range can wrap past the end, as seen through mirrored mapping */
+	if( req.offset > entry->size || req.len > entry->size ){
+		mutex_unlock(&data->lock);
+		return -EINVAL;
+	}
+
+	/* noncached, write-combined and ACP memory is always coherent */
+	if( entry->flags & CMA_ENTRY_COHERENT || req.len == 0 ){
+		mutex_unlock(&data->lock);
+		return 0;
+	}
+
+	/* For device: write back CPU writes and drop the lines, so that they can
+	 * not be evicted over data written by the device.
+	 * For CPU: drop lines which could have been fetched during the transfer. */
+	if( cmd == CMA_SYNC_FOR_DEVICE )
+		cma_entry_sync(entry, req.offset, req.len, 1, DMA_BIDIRECTIONAL);
+	else
+		cma_entry_sync(entry, req.offset, req.len, 0, DMA_FROM_DEVICE);
+
+	mutex_unlock(&data->lock);
+
+	return 0;
+}
+
+
+/* inline function for readability, entry flags to CMA_ALLOC_FLAG_* */
+static inline __u32 cma_entry_alloc_flags(struct cma_entry *entry)
+{
+	__u32 flags = 0;
+
+	if( entry->flags & CMA_ENTRY_NONCACHED )
+		flags |= CMA_ALLOC_FLAG_NONCACHED;
+	if( entry->flags & CMA_ENTRY_CARVEOUT )
+		flags |= CMA_ALLOC_FLAG_CARVEOUT;
+	if( entry->flags & CMA_ENTRY_WRITECOMBINE )
+		flags |= CMA_ALLOC_FLAG_WRITECOMBINE;
+	if( entry->flags & CMA_ENTRY_HUGEPAGE )
+		flags |= CMA_ALLOC_FLAG_HUGEPAGE;
+	if( entry->flags & CMA_ENTRY_PAGES )
+		flags |= CMA_ALLOC_FLAG_PAGES;
+	if( entry->flags & CMA_ENTRY_ACP )
+		flags |= CMA_ALLOC_FLAG_ACP;
+
+	flags |= ((entry->flags & CMA_ENTRY_REGION_MASK) >> CMA_ENTRY_REGION_SHIFT) << CMA_ALLOC_FLAG_REGION_SHIFT;
+
+	return flags;
+}
+
+
+static long cma_ioctl_get_flags(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	struct cma_file_data *data = filp->private_data;
+	struct cma_entry *entry;
+	struct cma_get_flags req;
+
+	__DEBUG("cma_ioctl_get_flags() called!\n");
+
+	if( copy_from_user(&req, (void __user*)arg, sizeof(req)) )
+		return -EFAULT;
+
+	if(mutex_lock_interruptible(&data->lock))
+		return -EAGAIN;
+
+	entry = cma_entry_get_by_v_usr_addr(data, req.v_usr_addr);
+	if(entry == NULL){
+		mutex_unlock(&data->lock);
+		return -EFAULT;
+	}
+
+	/* report flags which are in effect */
+	req.flags = cma_entry_alloc_flags(entry);
+
+	mutex_unlock(&data->lock);
+
+	if( copy_to_user((void __user*)arg, &req, sizeof(req)) )
+		return -EFAULT;
+
+	return 0;
+}
+
+
+static long cma_ioctl_alloc_ring(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	struct cma_file_data *data = filp->private_data;
+	long err;
+	int flags;
+	unsigned i;
+	struct cma_entry *entry, *part;
+	struct cma_alloc_ring req;
+	__u64 *phy_table;
+
+	__DEBUG("cma_ioctl_alloc_ring() called!\n");
+
+	if( copy_from_user(&req, (void __user*)arg, sizeof(req)) )
+		return -EFAULT;
+
+	/* buffers are mapped back-to-back, so they have to be page sized */
+	if( req.count == 0 || req.count > CMA_RING_MAX_COUNT )
+		return -EINVAL;
+	if( req.size == 0 || !PAGE_ALIGNED(req.size) || req.size > SIZE_MAX / req.count )
+		return -EINVAL;
+
+	err = cma_alloc_flags_to_entry(req.flags, &flags);
+	if(err) return err;
+
+	phy_table = kmalloc_array(req.count, sizeof(__u64), GFP_KERNEL);
+	if( phy_table == NULL )
+		return -ENOMEM;
+
+	entry = cma_entry_compose(req.size * req.count, flags, req.count);
+	if( entry == NULL ){
+		err = -ENOMEM;
+		goto error_entry;
+	}
+
+	for(i=0; i<req.count; i++){
+		part = cma_entry_obtain(req.size, flags, NULL, data->id);
+		if( IS_ERR(part) ){
+			err = PTR_ERR(part);
+			goto error_parts;
+		}
+
+		entry->parts[entry->nparts++] = part;
+		phy_table[i] = part->phy_addr;
+
+		/* large pages are used only if every part allows it */
+		if( !(part->flags & CMA_ENTRY_HUGEPAGE) )
+			entry->flags &= ~CMA_ENTRY_HUGEPAGE;
+	}
+
+	entry->phy_addr = entry->parts[0]->phy_addr;
+
+	/* entry is not visible yet, so it is just dropped on failure */
+	if( copy_to_user(u64_to_user_ptr(req.phy_table), phy_table, req.count * sizeof(__u64)) ){
+		err = -EFAULT;
+		goto error_parts;
+	}
+
+	req.phy_addr = entry->phy_addr;
+	if( copy_to_user((void __user*)arg, &req, sizeof(req)) ){
+		err = -EFAULT;
+		goto error_parts;
+	}
+
+	err = cma_entry_add(data, entry);
+	if(err) goto error_parts;
+
+	kfree(phy_table);
+
+	return 0;
+
+
+error_parts:
+	cma_entry_put(entry);
+
+error_entry:
+	kfree(phy_table);
+
+	return err;
+}
+
+
+/* fills table with physical address and size of every part */
+static void cma_entry_chunks(struct cma_entry *entry, struct cma_chunk_entry *table, unsigned count)
+{
+	struct cma_entry *part;
+	unsigned i;
+
+	for(i=0; i<count; i++){
+		part = cma_entry_part(entry, i);
+
+		table[i].phy_addr 	= part->phy_addr;
+		table[i].size 		= part->size;
+	}
+}
+
+
+static long cma_ioctl_alloc_chunked(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	struct cma_file_data *data = filp->private_data;
+	long err;
+	int flags;
+	unsigned max_chunks;
+	size_t remaining, chunk, min_chunk;
+	struct cma_entry *entry, *part;
+	struct cma_alloc_chunked req;
+	struct cma_chunk_entry *table;
+
+	__DEBUG("cma_ioctl_alloc_chunked() called!\n");
+
+	if( copy_from_user(&req, (void __user*)arg, sizeof(req)) )
+		return -EFAULT;
+
+	/* chunks are mapped back-to-back, so they have to be page sized */
+	if( req.size == 0 || !PAGE_ALIGNED(req.size) || req.size > SIZE_MAX )
+		return -EINVAL;
+	if( req.max_chunks == 0 || req.max_chunks > CMA_CHUNK_MAX_COUNT )
+		return -EINVAL;
+	if( (req.min_chunk & (req.min_chunk - 1)) || req.min_chunk > req.size )
+		return -EINVAL;
+
+	err = cma_alloc_flags_to_entry(req.flags, &flags);
+	if(err) return err;
+
+	max_chunks 	= req.max_chunks;
+	min_chunk 	= max_t(size_t, req.min_chunk, PAGE_SIZE);
+
+	entry = cma_entry_compose(req.size, flags & ~CMA_ENTRY_HUGEPAGE, max_chunks);
+	if( entry == NULL )
+		return -ENOMEM;
+
+	/* Chunk which failed is not tried again, the following ones are at most
+	 * of the size which succeeded last */
+	remaining 	= req.size;
+	chunk 		= req.size;
+	while( remaining > 0 ){
+		if( entry->nparts == max_chunks ){
+			err = -ENOSPC;
+			goto error_parts;
+		}
+
+		chunk = min(chunk, remaining);
+
+		part = cma_entry_obtain(chunk, flags, NULL, data->id);
+		if( IS_ERR(part) ){
+			err = PTR_ERR(part);
+			if( err != -ENOMEM || chunk <= min_chunk )
+				goto error_parts;
+
+			chunk = max_t(size_t, rounddown_pow_of_two(chunk - 1), min_chunk);
+			continue;
+		}
+
+		entry->parts[entry->nparts++] = part;
+		remaining -= chunk;
+
+		/* large pages are mapped where a part allows it */
+		if( part->flags & CMA_ENTRY_HUGEPAGE )
+			entry->flags |= CMA_ENTRY_HUGEPAGE;
+	}
+
+	entry->phy_addr = entry->parts[0]->phy_addr;
+
+	table = kmalloc_array(entry->nparts, sizeof(*table), GFP_KERNEL);
+	if( table == NULL ){
+		err = -ENOMEM;
+		goto error_parts;
+	}
+	cma_entry_chunks(entry, table, entry->nparts);
+
+	/* entry is not visible yet, so it is just dropped on failure */
+	err = copy_to_user(u64_to_user_ptr(req.chunk_table), table, entry->nparts * sizeof(*table)) ? -EFAULT : 0;
+	kfree(table);
+	if(err) goto error_parts;
+
+	req.phy_addr 	= entry->phy_addr;
+	req.count 		= entry->nparts;
+	if( copy_to_user((void __user*)arg, &req, sizeof(req)) ){
+		err = -EFAULT;
+		goto error_parts;
+	}
+
+	err = cma_entry_add(data, entry);
+	if(err) goto error_parts;
+
+	return 0;
+
+
+error_parts:
+	cma_entry_put(entry);
+
+	return err;
+}
+
+
+static long cma_ioctl_get_chunks(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	struct cma_file_data *data = filp->private_data;
+	struct cma_entry *entry;
+	struct cma_get_chunks req;
+	struct cma_chunk_entry *table;
+	unsigned count;
+
+	__DEBUG("cma_ioctl_get_chunks() called!\n");
+
+	if( copy_from_user(&req, (void __user*)arg, sizeof(req)) )
+		return -EFAULT;
+
+	if( req.max_chunks > CMA_CHUNK_MAX_COUNT )
+		req.max_chunks = CMA_CHUNK_MAX_COUNT;
+
+	table = kmalloc_array(max(req.max_chunks, 1U), sizeof(*table), GFP_KERNEL);
+	if( table == NULL )
+		return -ENOMEM;
+
+	if(mutex_lock_interruptible(&data->lock)){
+		kfree(table);
+		return -EAGAIN;
+	}
+
+	entry = cma_entry_get_by_v_usr_addr(data, req.v_usr_addr);
+	if(entry == NULL){
+		mutex_unlock(&data->lock);
+		kfree(table);
+		return -EFAULT;
+	}
+
+	/* table may be smaller, the number of chunks is reported anyway */
+	req.count = entry->nparts;
+	count = min(req.count, req.max_chunks);
+	cma_entry_chunks(entry, table, count);
+
+	mutex_unlock(&data->lock);
+
+	if( copy_to_user(u64_to_user_ptr(req.chunk_table), table, count * sizeof(*table)) ||
+		copy_to_user((void __user*)arg, &req, sizeof(req)) ){
+		kfree(table);
+		return -EFAULT;
+	}
+
+	kfree(table);
+
+	return 0;
+}
+
+
+static long cma_ioctl_export_dmabuf(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	struct cma_file_data *data = filp->private_data;
+	struct cma_entry *entry;
+	struct cma_export_dmabuf req;
+	struct dma_buf *dmabuf;
+	int fd;
+	DEFINE_DMA_BUF_EXPORT_INFO(exp_info);
+
+	__DEBUG("cma_ioctl_export_dmabuf() called!\n");
+
+	if( copy_from_user(&req, (void __user*)arg, sizeof(req)) )
+		return -EFAULT;
+
+	if( req.flags & ~O_CLOEXEC )
+		return -EINVAL;
+
+	if(mutex_lock_interruptible(&data->lock))
+		return -EAGAIN;
+
+	entry = cma_entry_get_by_v_usr_addr(data, req.v_usr_addr);
+	if(entry == NULL){
+		mutex_unlock(&data->lock);
+		return -EFAULT;
+	}
+
+	/* imported memory is shared further through its original dma-buf */
+	if( entry->dmabuf != NULL ){
+		dmabuf = entry->dmabuf;
+		get_dma_buf(dmabuf);
+		mutex_unlock(&data->lock);
+		goto install_fd;
+	}
+
+	/* dma-buf keeps the entry alive after it is released from registry */
+	kref_get(&entry->ref);
+	mutex_unlock(&data->lock);
+
+	exp_info.owner 	= THIS_MODULE;
+	exp_info.ops 	= &cma_dmabuf_ops;
+	exp_info.size 	= entry->size;
+	exp_info.flags 	= O_RDWR;
+	exp_info.priv 	= entry;
+
+	dmabuf = dma_buf_export(&exp_info);
+	if( IS_ERR(dmabuf) ){
+		cma_entry_put(entry);
+		return PTR_ERR(dmabuf);
+	}
+
+install_fd:
+	fd = dma_buf_fd(dmabuf, req.flags);
+	if( fd < 0 )
+		dma_buf_put(dmabuf);
+
+	return fd;
+}
+
+
+static long cma_ioctl_import_dmabuf(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	struct cma_file_data *data = filp->private_data;
+	struct cma_entry *entry, *owner;
+	struct cma_import_dmabuf req;
+	struct dma_buf *dmabuf;
+	int err;
+
+	__DEBUG("cma_ioctl_import_dmabuf() called!\n");
+
+	if( copy_from_user(&req, (void __user*)arg, sizeof(req)) )
+		return -EFAULT;
+
+	dmabuf = dma_buf_get(req.fd);
+	if( IS_ERR(dmabuf) )
+		return PTR_ERR(dmabuf);
+
+	/* foreign buffers are not necessarily contigous */
+	if( dmabuf->ops != &cma_dmabuf_ops ){
+		err = -EINVAL;
+		goto error_foreign;
+	}
+	owner = dmabuf->priv;
+
+	entry = kmalloc(sizeof(struct cma_entry), GFP_KERNEL);
+	if( entry == NULL ){
+		err = -ENOMEM;
+		goto error_foreign;
+	}
+
+	/* entry describes the same memory, reference to dma-buf is handed over */
+	entry->size 		= owner->size;
+	entry->phy_addr 	= owner->phy_addr;
+	entry->v_ptr 		= owner->v_ptr;
+	entry->region 		= owner->region;
+	entry->parts 		= owner->parts;
+	entry->nparts 		= owner->nparts;
+	entry->flags 		= owner->flags & ~(CMA_ENTRY_MAPPED | CMA_ENTRY_AUTOFREE);
+	entry->mm 			= NULL;
+	entry->v_usr_addr 	= 0;
+	entry->map_count 	= 0;
+	entry->owner 		= data->id;
+	entry->dmabuf 		= dmabuf;
+	kref_init(&entry->ref);
+
+	err = cma_entry_add(data, entry);
+	if(err){
+		kfree(entry);
+		goto error_foreign;
+	}
+
+	req.phy_addr 	= entry->phy_addr;
+	req.size 		= entry->size;
+	req.flags 		= cma_entry_alloc_flags(entry);
+
+	if( copy_to_user((void __user*)arg, &req, sizeof(req)) ){
+		/* entry is not mapped yet, nobody else could have used it */
+		cma_entry_discard(data, req.phy_addr);
+		return -EFAULT;
+	}
+
+	return 0;
+
+
+error_foreign:
+	dma_buf_put(dmabuf);
+
+	return err;
+}
+
+
+static struct sg_table *cma_dmabuf_map(struct dma_buf_attachment *attach, enum dma_data_direction dir)
+{
+	struct cma_entry *entry = attach->dmabuf->priv, *part;
+	struct sg_table *sgt;
+	struct scatterlist *sg;
+	unsigned i;
+
+	__DEBUG("cma_dmabuf_map() - phy_addr %pad\n", &entry->phy_addr);
+
+	sgt = kmalloc(sizeof(struct sg_table), GFP_KERNEL);
+	if( sgt == NULL )
+		return ERR_PTR(-ENOMEM);
+
+	if( sg_alloc_table(sgt, entry->nparts, GFP_KERNEL) ){
+		kfree(sgt);
+		return ERR_PTR(-ENOMEM);
+	}
+
+	/* every part is a single segment */
+	for_each_sg(sgt->sgl, sg, entry->nparts, i){
+		part = cma_entry_part(entry, i);
+		sg_set_page(sg, pfn_to_page(PHYS_PFN(part->phy_addr)), part->size, 0);
+	}
+
+	if( dma_map_sg(attach->dev, sgt->sgl, sgt->orig_nents, dir) == 0 ){
+		sg_free_table(sgt);
+		kfree(sgt);
+		return ERR_PTR(-ENOMEM);
+	}
+
+	return sgt;
+}
+
+
+static void cma_dmabuf_unmap(struct dma_buf_attachment *attach, struct sg_table *sgt, enum dma_data_direction dir)
+{
+	__DEBUG("cma_dmabuf_unmap()\n");
+
+	dma_unmap_sg(attach->dev, sgt->sgl, sgt->orig_nents, dir);
+	sg_free_table(sgt);
+	kfree(sgt);
+}
+
+
+/* last dma-buf reference is gone, drop the one it held on the entry */
+static void cma_dmabuf_release(struct dma_buf *dmabuf)
+{
+	__DEBUG("cma_dmabuf_release()\n");
+
+	cma_entry_put(dmabuf->priv);
+}
+
+
+static int cma_dmabuf_begin_cpu_access(struct dma_buf *dmabuf, enum dma_data_direction dir)
+{
+	struct cma_entry *entry = dmabuf->priv;
+
+	if( !(entry->flags & CMA_ENTRY_COHERENT) )
+		cma_entry_sync(entry, 0, entry->size, 0, dir);
+
+	return 0;
+}
+
+
+static int cma_dmabuf_end_cpu_access(struct dma_buf *dmabuf, enum dma_data_direction dir)
+{
+	struct cma_entry *entry = dmabuf->priv;
+
+	if( !(entry->flags & CMA_ENTRY_COHERENT) )
+		cma_entry_sync(entry, 0, entry->size, 1, dir);
+
+	return 0;
+}
+
+
+static void *cma_dmabuf_kmap(struct dma_buf *dmabuf, unsigned long page_num)
+{
+	struct cma_entry *part = dmabuf->priv;
+	unsigned long offset = page_num * PAGE_SIZE;
+
+	part = cma_entry_part_at(part, &offset);
+	if( part == NULL )
+		return NULL;
+
+	return part->v_ptr + offset;
+}
+
+
+/* parts are not contigous in kernel address space */
+static void *cma_dmabuf_vmap(struct dma_buf *dmabuf)
+{
+	struct cma_entry *entry = dmabuf->priv;
+
+	return entry->parts == NULL ? entry->v_ptr : NULL;
+}
+
+
+/* mapping of dma-buf file itself, e.g. by process which did not import it */
+static int cma_dmabuf_mmap(struct dma_buf *dmabuf, struct vm_area_struct *vma)
+{
+	struct cma_entry *entry = dmabuf->priv;
+	unsigned long len = vma->vm_end - vma->vm_start;
+
+	__DEBUG("cma_dmabuf_mmap() - phy_addr %pad\n", &entry->phy_addr);
+
+	/* same as for cma_mmap() */
+	if( !(vma->vm_flags & VM_SHARED) )
+		return -EINVAL;
+
+	if( vma->vm_pgoff >= PFN_UP(entry->size) || len > entry->size - (vma->vm_pgoff << PAGE_SHIFT) )
+		return -EINVAL;
+
+	cma_entry_set_pgprot(entry, vma);
+
+	return cma_entry_remap(entry, vma, vma->vm_pgoff << PAGE_SHIFT);
+}
+
+
+/* per-region device goes away with the last reference */
+static void cma_region_dev_release(struct device *dev)
+{
+	kfree(container_of(dev, struct cma_region, region_dev));
+}
+
+
+/* "shared-dma-pool" region gets own device, its memory is allocated by DMA API
+ * as for any other device using the region */
+static int cma_region_init_device(struct platform_device *pdev, struct cma_region *region)
+{
+	int err;
+	struct device *dev = &region->region_dev;
+
+	device_initialize(dev);
+	dev->parent 	= &pdev->dev;
+	dev->release 	= cma_region_dev_release;
+	dev_set_name(dev, "%s:%s", dev_name(&pdev->dev), region->name);
+
+	/* mask and dma-ranges offset of the bus the node sits on */
+	err = of_dma_configure(dev, pdev->dev.of_node);
+	if( err ){
+		__ERROR("Failed to configure DMA of region %s\n", region->name);
+		return err;
+	}
+
+	err = of_reserved_mem_device_init_by_idx(dev, pdev->dev.of_node, region->index);
+	if( err ){
+		__ERROR("Failed to assign region %s to device\n", region->name);
+		return err;
+	}
+
+	region->dev = dev;
+
+	return 0;
+}
+
+
+/* plain reserved region is managed by the driver itself */
+static int cma_region_init_carveout(struct platform_device *pdev, struct cma_region *region)
+{
+	int err;
+
+	if( region->no_map || !pfn_valid(PHYS_PFN(region->phy_base)) ){
+		__ERROR("Carveout region %s must not be \"no-map\"\n", region->name);
+		return -EINVAL;
+	}
+
+	/* region is a part of linear mapping */
+	region->v_base = memremap(region->phy_base, region->size, MEMREMAP_WB);
+	if( region->v_base == NULL ){
+		__ERROR("Failed to map reserved memory region %s\n", region->name);
+		return -ENOMEM;
+	}
+
+	/* page granular allocator over the region */
+	region->pool = gen_pool_create(PAGE_SHIFT, -1);
+	if( region->pool == NULL ){
+		err = -ENOMEM;
+		goto error_gen_pool_create;
+	}
+
+	err = gen_pool_add_virt(region->pool, (unsigned long)region->v_base, region->phy_base, region->size, -1);
+	if( err ){
+		__ERROR("Failed to add reserved memory region %s to pool\n", region->name);
+		goto error_gen_pool_add_virt;
+	}
+
+	region->dev = &pdev->dev;
+
+	return 0;
+
+
+error_gen_pool_add_virt:
+	gen_pool_destroy(region->pool);
+	region->pool = NULL;
+
+error_gen_pool_create:
+	memunmap(region->v_base);
+
+	return err;
+}
+
+
+static void cma_region_destroy(struct cma_region *region)
+{
+	if( region->pool != NULL ){
+		gen_pool_destroy(region->pool);
+		memunmap(region->v_base);
+		kfree(region);
+		return;
+	}
+
+	/* region is freed by the release of its device */
+	of_reserved_mem_device_release(&region->region_dev);
+	put_device(&region->region_dev);
+}
+
+
+static struct cma_region *cma_region_create(struct platform_device *pdev, int index)
+{
+	int err;
+	struct device_node *np;
+	struct reserved_mem *rmem;
+	struct cma_region *region;
+	const char *name;
+
+	np = of_parse_phandle(pdev->dev.of_node, "memory-region", index);
+	if( np == NULL )
+		return ERR_PTR(-ENODEV);
+
+	rmem = of_reserved_mem_lookup(np);
+	if( rmem == NULL ){
+		__ERROR("Failed to find reserved memory region %d\n", index);
+		err = -ENODEV;
+		goto error_node;
+	}
+
+	region = kzalloc(sizeof(struct cma_region), GFP_KERNEL);
+	if( region == NULL ){
+		err = -ENOMEM;
+		goto error_node;
+	}
+
+	/* region is looked up by name from the user space */
+	if( of_property_read_string_index(pdev->dev.of_node, "memory-region-names", index, &name) )
+		name = np->name;
+	strlcpy(region->name, name, sizeof(region->name));
+
+	region->index 		= index;
+	region->phy_base 	= rmem->base;
+	region->size 		= rmem->size;
+	region->no_map 		= of_property_read_bool(np, "no-map");
+
+	if( of_device_is_compatible(np, "shared-dma-pool") ){
+		err = cma_region_init_device(pdev, region);
+		if( err ){
+			/* initialized device owns the region */
+			put_device(&region->region_dev);
+			goto error_node;
+		}
+	}
+	else{
+		err = cma_region_init_carveout(pdev, region);
+		if( err ){
+			kfree(region);
+			goto error_node;
+		}
+	}
+
+	of_node_put(np);
+
+	__INFO("Region %d \"%s\" at 0x%llx, size 0x%zx, %s\n", index, region->name,
+		   (unsigned long long)region->phy_base, region->size, region->pool != NULL ? "carveout" : "device");
+
+	return region;
+
+
+error_node:
+	of_node_put(np);
+
+	return ERR_PTR(err);
+}
+
+
+static int cma_probe(struct platform_device *pdev)
+{
+	int err, i, count;
+	struct cma_region *region, *bound;
+
+	__DEBUG("cma_probe() called!\n");
+
+	/* only one device tree node is supported */
+	if( cma_region_default != &cma_region_unbound )
+		return -EBUSY;
+
+	/* regions are optional, bound device alone serves the default area */
+	count = of_count_phandle_with_args(pdev->dev.of_node, "memory-region", NULL);
+	if( count < 0 )
+		count = 0;
+	if( count > CMA_REGION_MAX_COUNT ){
+		__ERROR("At most %d memory regions are supported\n", CMA_REGION_MAX_COUNT);
+		return -EINVAL;
+	}
+
+	/* default area is allocated for the bound device with its DMA mask */
+	bound = kzalloc(sizeof(struct cma_region), GFP_KERNEL);
+	if( bound == NULL )
+		return -ENOMEM;
+
+	bound->index 	= -1;
+	bound->dev 		= &pdev->dev;
+	strlcpy(bound->name, cma_region_unbound.name, sizeof(bound->name));
+
+	for(i=0; i<count; i++){
+		region = cma_region_create(pdev, i);
+		if( IS_ERR(region) ){
+			err = PTR_ERR(region);
+			goto error_region_create;
+		}
+
+		cma_regions[i] = region;
+		if( carveout == NULL && region->pool != NULL )
+			carveout = region;
+	}
+
+	platform_set_drvdata(pdev, bound);
+	cma_region_count 	= count;
+	cma_region_default 	= bound;
+
+	return 0;
+
+
+error_region_create:
+	carveout = NULL;
+	while( i-- > 0 ){
+		cma_region_destroy(cma_regions[i]);
+		cma_regions[i] = NULL;
+	}
+	kfree(bound);
+
+	return err;
+}
+
+
+/* called on module exit only, after all allocations are released */
+static int cma_remove(struct platform_device *pdev)
+{
+	unsigned i;
+
+	__DEBUG("cma_remove() called!\n");
+
+	cma_region_default = &cma_region_unbound;
+	kfree(platform_get_drvdata(pdev));
+
+	carveout = NULL;
+	for(i=0; i<cma_region_count; i++){
+		cma_region_destroy(cma_regions[i]);
+		cma_regions[i] = NULL;
+	}
+	cma_region_count = 0;
+
+	return 0;
+}
+
+
+static long cma_ioctl_get_region(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	struct cma_get_region req;
+	struct cma_region *region;
+	unsigned i;
+
+	__DEBUG("cma_ioctl_get_region() called!\n");
+
+	if( copy_from_user(&req, (void __user*)arg, sizeof(req)) )
+		return -EFAULT;
+	req.name[CMA_REGION_NAME_LEN-1] = '\0';
+
+	for(i=0; i<cma_region_count; i++){
+		region = cma_regions[i];
+		if( strcmp(region->name, req.name) )
+			continue;
+
+		req.index 		= region->index;
+		req.phy_base 	= region->phy_base;
+		req.size 		= region->size;
+
+		if( copy_to_user((void __user*)arg, &req, sizeof(req)) )
+			return -EFAULT;
+
+		return 0;
+	}
+
+	return -ENOENT;
+}
+
+
+static long cma_ioctl_free(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	unsigned long v_usr_addr;
+	__DEBUG("cma_ioctl_free() called!\n");
+
+	if( cma_ioctl_get_v_usr_addr(cmd, arg, &v_usr_addr) )
+		return -EFAULT;
+
+	return cma_entry_release(filp->private_data, v_usr_addr);
+}
+
+
+/* reads user-space address from legacy 32-bit or struct cma_query64 argument */
+static int cma_ioctl_get_v_usr_addr(unsigned int cmd, unsigned long arg, unsigned long *v_usr_addr)
+{
+	struct cma_query64 req;
+	__u32 v_usr_addr32;
+
+	__DEBUG("cma_ioctl_get_v_usr_addr() called!\n");
+
+	if( _IOC_SIZE(cmd) == sizeof(req) ){
+		if( copy_from_user(&req, (void __user*)arg, sizeof(req)) )
+			return -EFAULT;
+
+		*v_usr_addr = req.v_usr_addr;
+		return 0;
+	}
+
+	/* get process user address */
+	if( get_user(v_usr_addr32, (__u32 __user*)arg) )
+		return -EFAULT;
+
+	*v_usr_addr = v_usr_addr32;
+
+	return 0;
+}
+
+
+/* writes result to legacy 32-bit or struct cma_query64 argument */
+static int cma_ioctl_put_value(unsigned int cmd, unsigned long arg, __u64 value)
+{
+	if( _IOC_SIZE(cmd) == sizeof(struct cma_query64) )
+		return put_user(value, &((struct cma_query64 __user*)arg)->value) ? -EFAULT : 0;
+
+	/* legacy ABI can not describe it */
+	if( value > U32_MAX )
+		return -EOVERFLOW;
+
+	return put_user((__u32)value, (__u32 __user*)arg) ? -EFAULT : 0;
+}
+
+
+static long cma_ioctl_get_phy_addr(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	struct cma_file_data *data = filp->private_data;
+	struct cma_entry *entry;
+	unsigned long v_usr_addr;
+	dma_addr_t phy_addr;
+
+	__DEBUG("cma_ioctl_get_phy_addr() called!\n");
+
+	if( cma_ioctl_get_v_usr_addr(cmd, arg, &v_usr_addr) )
+		return -EFAULT;
+
+	/* get entry */
+	if(mutex_lock_interruptible(&data->lock))
+		return -EAGAIN;
+
+	entry = cma_entry_get_by_v_usr_addr(data, v_usr_addr);
+	if(entry == NULL){
+		mutex_unlock(&data->lock);
+		return -EFAULT;
+	}
+
+	phy_addr = cmd == CMA_GET_DMA_ADDR ? cma_entry_dma_addr(entry) : entry->phy_addr;
+	mutex_unlock(&data->lock);
+
+	/* put physical or device address into user space */
+	return cma_ioctl_put_value(cmd, arg, phy_addr);
+}
+
+
+static long cma_ioctl_get_size(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	struct cma_file_data *data = filp->private_data;
+	struct cma_entry *entry;
+	unsigned long v_usr_addr;
+	size_t size;
+
+	__DEBUG("cma_ioctl_get_size() called!\n");
+
+	if( cma_ioctl_get_v_usr_addr(cmd, arg, &v_usr_addr) )
+		return -EFAULT;
+
+	/* get entry */
+	if(mutex_lock_interruptible(&data->lock))
+		return -EAGAIN;
+
+	entry = cma_entry_get_by_v_usr_addr(data, v_usr_addr);
+	if(entry == NULL){
+		mutex_unlock(&data->lock);
+		return -EFAULT;
+	}
+
+	size = entry->size;
+	mutex_unlock(&data->lock);
+
+	/* put size into user space */
+	return cma_ioctl_put_value(cmd, arg, size);
+}
+
+
+static int cma_init(void)
+{
+	int err, i;
 	__INFO("Initializeing Contigous Memory Allocator module\n");
 
+	for(i=0; i<CMA_CACHE_CLASSES; i++){
+		INIT_LIST_HEAD(&cma_cache[i][0]);
+		INIT_LIST_HEAD(&cma_cache[i][1]);
+	}
+
 	/* obtain major number */
 	major = register_chrdev(0, DRIVER_NODE_NAME, &fops);
 	if( major < 0 ){
@@ -481,18 +3368,45 @@ static int cma_init(void)
 	}
 
 	/* create device node */
-	device = device_create(class, NULL, MKDEV(major, 0), NULL, DRIVER_NODE_NAME);
+	device = device_create_with_groups(class, NULL, MKDEV(major, 0), NULL, cma_groups, DRIVER_NODE_NAME);
 	if( IS_ERR(device) ){
 		__ERROR("Failed to create device\n");
 		err = PTR_ERR(device);
 		goto error_device_create;
 	}
 
-	mutex_init(&mutex_cma_list_modify);
-	
+	err = register_shrinker(&cma_cache_shrinker);
+	if( err ){
+		__ERROR("Failed to register shrinker\n");
+		goto error_register_shrinker;
+	}
+
+	/* register platform device, binding is optional */
+	err = platform_driver_register(&cma_driver);
+	if( err ){
+		__ERROR("Failed to register platform driver\n");
+		goto error_platform_driver_register;
+	}
+
+	/* zeroing in the background is optional, memory is zeroed on reuse anyway */
+	cma_scrub_task = kthread_run(cma_scrub_thread, NULL, "cma_scrub");
+	if( IS_ERR(cma_scrub_task) ){
+		__ERROR("Failed to start background zeroing thread\n");
+		cma_scrub_task = NULL;
+	}
+	cma_scrub_kick();
+
+	cma_debugfs_init();
+
 	return 0;
 
 
+error_platform_driver_register:
+	unregister_shrinker(&cma_cache_shrinker);
+
+error_register_shrinker:
+	device_destroy(class, MKDEV(major, 0));
+
 error_device_create:
 	class_destroy(class);
 
@@ -505,9 +3419,29 @@ error_class_create:
 
 static void cma_exit(void)
 {
+	struct cma_file_data *data, *next;
+
 	__INFO("Releasing Contigous Memory Allocator module\n");
 
-	/* TODO: walk_list_remove_pid */
+	debugfs_remove_recursive(cma_debugfs);
+
+	/* sweep registries which were not released, files hold module reference
+	 * so normally there are none */
+	mutex_lock(&mutex_cma_files);
+	list_for_each_entry_safe(data, next, &cma_files, list){
+		__ERROR("Releasing leftover allocations\n");
+		list_del(&data->list);
+		cma_file_data_free(data);
+	}
+	mutex_unlock(&mutex_cma_files);
+
+	if( cma_scrub_task != NULL )
+		kthread_stop(cma_scrub_task);
+
+	unregister_shrinker(&cma_cache_shrinker);
+	cma_cache_shrink(ULONG_MAX);
+
+	platform_driver_unregister(&cma_driver);
 
 	device_destroy(class, MKDEV(major, 0));
 
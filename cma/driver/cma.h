@@ -28,20 +28,179 @@
 #ifndef CMA_H_
 #define CMA_H_
 
+#include <linux/types.h>
+
 
 /* Should be defined in Settings.mak file */
 #ifndef CMA_IOCTL_MAGIC
 #define CMA_IOCTL_MAGIC	0xf2
 #endif
 
+/* Returned by CMA_GET_VERSION, incremented on ABI additions */
+#define CMA_IOCTL_VERSION	9
+
 
+/* Legacy ioctls 1-5 and 9 carry 32-bit sizes, addresses and physical
+ * addresses, their 64-bit counterparts should be used instead */
 #define CMA_ALLOC_CACHED 					_IOC(_IOC_WRITE|_IOC_READ,	CMA_IOCTL_MAGIC,1,  4)
 #define CMA_ALLOC_NONCACHED 				_IOC(_IOC_WRITE|_IOC_READ,	CMA_IOCTL_MAGIC,2,  4)
 #define CMA_FREE							_IOC(_IOC_WRITE,			CMA_IOCTL_MAGIC,3,  4)
 #define CMA_GET_PHY_ADDR	 				_IOC(_IOC_WRITE|_IOC_READ,	CMA_IOCTL_MAGIC,4,  4)
 #define CMA_GET_SIZE		 				_IOC(_IOC_WRITE|_IOC_READ,	CMA_IOCTL_MAGIC,5,  4)
+#define CMA_ALLOC_EXT		 				_IOC(_IOC_WRITE|_IOC_READ,	CMA_IOCTL_MAGIC,6,  sizeof(struct cma_alloc_ext))
+#define CMA_SYNC_FOR_DEVICE					_IOC(_IOC_WRITE,			CMA_IOCTL_MAGIC,7,  sizeof(struct cma_sync))
+#define CMA_SYNC_FOR_CPU					_IOC(_IOC_WRITE,			CMA_IOCTL_MAGIC,8,  sizeof(struct cma_sync))
+#define CMA_ALLOC_WRITECOMBINE 				_IOC(_IOC_WRITE|_IOC_READ,	CMA_IOCTL_MAGIC,9,  4)
+#define CMA_GET_FLAGS		 				_IOC(_IOC_WRITE|_IOC_READ,	CMA_IOCTL_MAGIC,10, sizeof(struct cma_get_flags))
+#define CMA_EXPORT_DMABUF	 				_IOC(_IOC_WRITE,			CMA_IOCTL_MAGIC,11, sizeof(struct cma_export_dmabuf))
+#define CMA_IMPORT_DMABUF	 				_IOC(_IOC_WRITE|_IOC_READ,	CMA_IOCTL_MAGIC,12, sizeof(struct cma_import_dmabuf))
+#define CMA_ALLOC_RING		 				_IOC(_IOC_WRITE|_IOC_READ,	CMA_IOCTL_MAGIC,13, sizeof(struct cma_alloc_ring))
+#define CMA_FREE64							_IOC(_IOC_WRITE,			CMA_IOCTL_MAGIC,14, sizeof(struct cma_query64))
+#define CMA_GET_PHY_ADDR64	 				_IOC(_IOC_WRITE|_IOC_READ,	CMA_IOCTL_MAGIC,15, sizeof(struct cma_query64))
+#define CMA_GET_SIZE64		 				_IOC(_IOC_WRITE|_IOC_READ,	CMA_IOCTL_MAGIC,16, sizeof(struct cma_query64))
+#define CMA_GET_VERSION		 				_IOC(_IOC_NONE,				CMA_IOCTL_MAGIC,17, 0)
+#define CMA_ALLOC_ALIGNED	 				_IOC(_IOC_WRITE|_IOC_READ,	CMA_IOCTL_MAGIC,18, sizeof(struct cma_alloc_aligned))
+#define CMA_ALLOC_CHUNKED	 				_IOC(_IOC_WRITE|_IOC_READ,	CMA_IOCTL_MAGIC,19, sizeof(struct cma_alloc_chunked))
+#define CMA_GET_CHUNKS		 				_IOC(_IOC_WRITE|_IOC_READ,	CMA_IOCTL_MAGIC,20, sizeof(struct cma_get_chunks))
+#define CMA_GET_DMA_ADDR	 				_IOC(_IOC_WRITE|_IOC_READ,	CMA_IOCTL_MAGIC,21, sizeof(struct cma_query64))
+#define CMA_GET_REGION		 				_IOC(_IOC_WRITE|_IOC_READ,	CMA_IOCTL_MAGIC,22, sizeof(struct cma_get_region))
+
+#define CMA_IOCTL_MAXNR						22
+
+
+/* CMA_ALLOC_EXT flags, same values are used by cma_api.h CMA_FLAG_* */
+#define CMA_ALLOC_FLAG_NONCACHED			(1<<0)
+#define CMA_ALLOC_FLAG_CARVEOUT				(1<<1)
+#define CMA_ALLOC_FLAG_WRITECOMBINE			(1<<2)
+#define CMA_ALLOC_FLAG_HUGEPAGE				(1<<3)
+#define CMA_ALLOC_FLAG_NOZERO				(1<<4)
+#define CMA_ALLOC_FLAG_PAGES				(1<<5)
+#define CMA_ALLOC_FLAG_ACP					(1<<6)
+/* memory-region of the device tree node by index, empty field - default area */
+#define CMA_ALLOC_FLAG_REGION_SHIFT			8
+#define CMA_ALLOC_FLAG_REGION_MASK			(0xf<<CMA_ALLOC_FLAG_REGION_SHIFT)
+#define CMA_ALLOC_FLAG_REGION(index)		((((index)+1)<<CMA_ALLOC_FLAG_REGION_SHIFT) & CMA_ALLOC_FLAG_REGION_MASK)
+#define CMA_ALLOC_FLAG_MASK					(CMA_ALLOC_FLAG_NONCACHED | CMA_ALLOC_FLAG_CARVEOUT | \
+											 CMA_ALLOC_FLAG_WRITECOMBINE | CMA_ALLOC_FLAG_HUGEPAGE | \
+											 CMA_ALLOC_FLAG_NOZERO | CMA_ALLOC_FLAG_PAGES | \
+											 CMA_ALLOC_FLAG_ACP | CMA_ALLOC_FLAG_REGION_MASK)
+
+/* Number of memory-regions which can be selected */
+#define CMA_REGION_MAX_COUNT				15
+#define CMA_REGION_NAME_LEN					32
+
+
+/* mmap() offset which allocates memory of the mapping size and maps it. Memory
+ * is released when it is unmapped. CMA_ALLOC_FLAG_* are passed shifted by
+ * CMA_MMAP_FLAGS_SHIFT, e.g.:
+ * 	CMA_MMAP_ALLOC_OFFSET | ((__u64)CMA_ALLOC_FLAG_NONCACHED << CMA_MMAP_FLAGS_SHIFT)
+ * 64-bit off_t is needed in the user space (_FILE_OFFSET_BITS=64). Region
+ * field does not fit into page offset of 32-bit kernel. */
+#define CMA_MMAP_ALLOC_OFFSET				(1ULL<<43)
+#define CMA_MMAP_FLAGS_SHIFT				36
+
+
+/* CMA_ALLOC_EXT argument */
+struct cma_alloc_ext{
+	__u64 	size;		/* in: size of allocation */
+	__u64 	phy_addr;	/* out: physical address */
+	__u32 	flags;		/* in: CMA_ALLOC_FLAG_* */
+	__u32 	reserved;
+};
+
+/* CMA_ALLOC_ALIGNED argument. Allocation starts at physical address which is
+ * multiple of align and does not cross multiple of boundary. */
+struct cma_alloc_aligned{
+	__u64 	size;		/* in: size of allocation, out: size of allocation made */
+	__u64 	align;		/* in: power of two, 0 or less than page size - page size */
+	__u64 	boundary;	/* in: power of two not less than size and align, 0 - none */
+	__u64 	phy_addr;	/* out: physical address */
+	__u32 	flags;		/* in: CMA_ALLOC_FLAG_* */
+	__u32 	reserved;
+};
+
+/* CMA_FREE64, CMA_GET_PHY_ADDR64, CMA_GET_SIZE64 and CMA_GET_DMA_ADDR argument */
+struct cma_query64{
+	__u64 	v_usr_addr;	/* in: user-space address of allocation */
+	__u64 	value;		/* out: physical address, size or device address */
+};
+
+/* CMA_ALLOC_RING argument. Buffers are mapped back-to-back by a single mmap()
+ * of count * size bytes at phy_addr offset and released together. */
+#define CMA_RING_MAX_COUNT					4096
+struct cma_alloc_ring{
+	__u64 	size;		/* in: size of each buffer, multiple of page size */
+	__u64 	phy_table;	/* in: pointer to __u64[count], filled with physical addresses */
+	__u64 	phy_addr;	/* out: physical address of the first buffer */
+	__u32 	count;		/* in: number of buffers */
+	__u32 	flags;		/* in: CMA_ALLOC_FLAG_* */
+};
+
+/* Physically contigous piece of allocation, in mapping order */
+struct cma_chunk_entry{
+	__u64 	phy_addr;	/* physical address */
+	__u64 	size;		/* size, multiple of page size */
+};
+
+/* CMA_ALLOC_CHUNKED argument. Chunks are mapped back-to-back by a single mmap()
+ * of size bytes at phy_addr offset and released together. */
+#define CMA_CHUNK_MAX_COUNT					4096
+struct cma_alloc_chunked{
+	__u64 	size;		/* in: size of allocation, multiple of page size */
+	__u64 	min_chunk;	/* in: smallest chunk, power of two, 0 - page size */
+	__u64 	chunk_table;/* in: pointer to struct cma_chunk_entry[max_chunks], filled */
+	__u64 	phy_addr;	/* out: physical address of the first chunk */
+	__u32 	max_chunks;	/* in: size of chunk_table */
+	__u32 	count;		/* out: number of chunks */
+	__u32 	flags;		/* in: CMA_ALLOC_FLAG_* */
+	__u32 	reserved;
+};
+
+/* CMA_GET_CHUNKS argument */
+struct cma_get_chunks{
+	__u64 	v_usr_addr;	/* in: user-space address of allocation */
+	__u64 	chunk_table;/* in: pointer to struct cma_chunk_entry[max_chunks], filled */
+	__u32 	max_chunks;	/* in: size of chunk_table */
+	__u32 	count;		/* out: number of chunks, can exceed max_chunks */
+};
+
+/* CMA_GET_FLAGS argument */
+struct cma_get_flags{
+	__u64 	v_usr_addr;	/* in: user-space address of allocation */
+	__u32 	flags;		/* out: CMA_ALLOC_FLAG_* in effect */
+	__u32 	reserved;
+};
+
+/* CMA_EXPORT_DMABUF argument, dma-buf file descriptor is the return value */
+struct cma_export_dmabuf{
+	__u64 	v_usr_addr;	/* in: user-space address of allocation */
+	__u32 	flags;		/* in: 0 or O_CLOEXEC */
+	__u32 	reserved;
+};
+
+/* CMA_IMPORT_DMABUF argument, returned phy_addr is used as mmap() offset */
+struct cma_import_dmabuf{
+	__s32 	fd;			/* in: dma-buf file descriptor */
+	__u32 	flags;		/* out: CMA_ALLOC_FLAG_* of the allocation */
+	__u64 	size;		/* out: size of allocation */
+	__u64 	phy_addr;	/* out: physical address */
+};
+
+/* CMA_SYNC_FOR_DEVICE and CMA_SYNC_FOR_CPU argument */
+struct cma_sync{
+	__u64 	v_usr_addr;	/* in: user-space address of allocation */
+	__u64 	offset;		/* in: start of the range from v_usr_addr */
+	__u64 	len;		/* in: length of the range */
+};
 
-#define CMA_IOCTL_MAXNR						5
+/* CMA_GET_REGION argument, looks memory-region up by memory-region-names entry */
+struct cma_get_region{
+	char 	name[CMA_REGION_NAME_LEN];	/* in: nul terminated name */
+	__u32 	index;		/* out: index for CMA_ALLOC_FLAG_REGION() */
+	__u32 	reserved;
+	__u64 	phy_base;	/* out: physical address of the region */
+	__u64 	size;		/* out: size of the region */
+};
 
 
 #endif
\ No newline at end of file
@@ -32,9 +32,48 @@
 #ifndef CMA_API_H_
 #define CMA_API_H_
 
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+/* cma_alloc_ext() flags */
+#define CMA_FLAG_CACHED 		0		/* default, cached memory */
+#define CMA_FLAG_NONCACHED 		(1<<0)	/* noncached memory */
+#define CMA_FLAG_CARVEOUT 		(1<<1)	/* allocate from reserved memory region,
+										 * allocation time is bounded, memory
+										 * is cached only */
+#define CMA_FLAG_WRITECOMBINE 	(1<<2)	/* write-combined memory, exclusive with
+										 * CMA_FLAG_NONCACHED */
+#define CMA_FLAG_HUGEPAGE 		(1<<3)	/* map with large pages when possible,
+										 * see cma_get_flags() */
+#define CMA_FLAG_NOZERO 		(1<<4)	/* memory will be overwritten, skip zeroing
+										 * of memory released since the same
+										 * cma_init() */
+#define CMA_FLAG_PAGES 			(1<<5)	/* map with struct pages, memory can be used
+										 * for O_DIRECT, vmsplice and io_uring,
+										 * CMA_FLAG_HUGEPAGE is ignored with it,
+										 * not available for carveout */
+#define CMA_FLAG_ACP 			(1<<6)	/* cached memory accessed coherently by the
+										 * device through ACP, see cma_get_dma_addr() */
+#define CMA_FLAG_REGION(index) 	((((index)+1)&0xf)<<8)	/* allocate from memory region,
+										 * see cma_get_region() */
+
+
+/* Physically contigous piece of allocation, see cma_alloc_chunked() */
+struct cma_chunk{
+	uint64_t 	phy_addr;	/* physical address */
+	uint64_t 	size;		/* size in bytes */
+};
+
 
 /**
- * @brief Initialize CMA api (basically perform open() syscall).
+ * @brief Initialize CMA api (basically perform open() syscall). Library built
+ * with CMA_BACKEND=emu needs no driver, it serves the same interface from
+ * simulated memory with fake physical addresses (see api/src/cma_emu.c).
  * 
  * @return Returns 0 on SUCCESS. On FAILURE returns -1 and errno is set
  * accordingly.
@@ -43,7 +82,18 @@ int cma_init(void);
 
 
 /**
- * @brief Release CMA api (basically perform close() syscall).
+ * @brief Get ioctl interface version of the driver, e.g. to tag benchmark
+ * results. Api requires at least the version it was built with.
+ *
+ * @return Returns version on SUCCESS, -1 on FAILURE.
+ */
+int cma_get_version(void);
+
+
+/**
+ * @brief Release CMA api (basically perform close() syscall). Memory which was
+ * not freed with cma_free() is released by the driver, the same happens if
+ * process exits without calling this function.
  * 
  * @return Returns 0 on SUCCESS. On FAILURE returns -1 and errno is set 
  * accordingly.
@@ -73,6 +123,192 @@ void *cma_alloc_cached(size_t size);
 void *cma_alloc_noncached(size_t size);
 
 
+/**
+ * @brief Allocate write-combined, physically contigous memory. CPU writes are
+ * buffered and merged into bursts, reads are uncached. Well suited for memory
+ * which CPU fills and device reads.
+ *
+ * @param size Size in bytes.
+ *
+ * @return Returns NULL on FAILURE. Otherwise pointer to valid userspace
+ * memory.
+ */
+void *cma_alloc_writecombine(size_t size);
+
+
+/**
+ * @brief Allocate physically contigous memory with additional options.
+ *
+ * @param size Size in bytes.
+ * @param flags Bitwise OR of CMA_FLAG_* values. CMA_FLAG_CARVEOUT and
+ * CMA_FLAG_REGION() require driver to be bound to device tree node with
+ * "memory-region", otherwise allocation fails. Carveout memory can not be
+ * noncached or write-combined.
+ *
+ * @return Returns NULL on FAILURE. Otherwise pointer to valid userspace
+ * memory.
+ */
+void *cma_alloc_ext(size_t size, unsigned flags);
+
+
+/**
+ * @brief Allocate physically contigous memory at physical address which is
+ * aligned and does not cross given boundary, e.g. for devices with 4 GB
+ * addressing windows or burst boundaries. Only size is reserved, whatever
+ * the alignment. Unless CMA_FLAG_CARVEOUT is used, alignment is limited by
+ * kernel CONFIG_CMA_ALIGNMENT.
+ *
+ * @param size Size in bytes.
+ * @param align Physical alignment, power of two. Values below page size mean
+ * page size.
+ * @param boundary Physical boundary which is not crossed, power of two not
+ * less than size and align, 0 for none.
+ * @param flags Bitwise OR of CMA_FLAG_* values, as for cma_alloc_ext().
+ *
+ * @return Returns NULL on FAILURE. Otherwise pointer to valid userspace
+ * memory, release it with cma_free().
+ */
+void *cma_alloc_aligned(size_t size, size_t align, uint64_t boundary, unsigned flags);
+
+
+/**
+ * @brief Allocate a ring of equally sized, physically contigous buffers with a
+ * single system call. Buffers are mapped back-to-back into one virtual range,
+ * so buffer i starts at returned pointer + i * (size rounded up to page size).
+ * Whole ring is released with a single cma_free() of the returned pointer.
+ *
+ * @param count Number of buffers, at most 4096.
+ * @param size Size of each buffer in bytes, rounded up to page size.
+ * @param flags Bitwise OR of CMA_FLAG_* values, as for cma_alloc_ext().
+ * @param out_ptrs Array of count pointers which is filled with the buffer
+ * addresses, can be NULL.
+ * @param out_phys Array of count physical addresses which is filled with
+ * the buffer physical addresses, can be NULL.
+ *
+ * @return Returns NULL on FAILURE. Otherwise pointer to the first buffer.
+ */
+void *cma_alloc_ring(unsigned count, size_t size, unsigned flags, void **out_ptrs, uint64_t *out_phys);
+
+
+/**
+ * @brief Allocate physically contigous memory and map it twice into adjacent
+ * virtual ranges, so mem[i] and mem[i + size] are the same byte. Records of
+ * a ring buffer which wrap past its end are accessed without copying. Memory
+ * is released with cma_free_mirrored() and not cma_free().
+ *
+ * @param size Size in bytes, rounded up to page size.
+ * @param flags Bitwise OR of CMA_FLAG_* values, as for cma_alloc_ext().
+ *
+ * @return Returns NULL on FAILURE. Otherwise pointer to 2 * size bytes of
+ * valid userspace memory.
+ */
+void *cma_alloc_mirrored(size_t size, unsigned flags);
+
+
+/**
+ * @brief Release memory allocated with cma_alloc_mirrored().
+ *
+ * @param mem Pointer to memory returned by cma_alloc_mirrored().
+ *
+ * @return Returns 0 on SUCCESS, -1 on FAILURE.
+ */
+int cma_free_mirrored(void *mem);
+
+
+/**
+ * @brief Allocate memory made of as few physically contigous chunks as the
+ * fragmentation of contigous memory allows. Chunks are mapped back-to-back
+ * into one virtual range, so CPU sees a flat buffer, while a device is
+ * programmed with a scatter-gather list built from the chunk table. Memory
+ * is released with cma_free().
+ *
+ * @param size Size in bytes, rounded up to page size.
+ * @param min_chunk Smallest acceptable chunk, power of two. Values below page
+ * size mean page size.
+ * @param flags Bitwise OR of CMA_FLAG_* values, as for cma_alloc_ext().
+ * @param chunks Array of max_chunks entries which is filled with the chunks in
+ * mapping order.
+ * @param max_chunks Size of chunks array, at most 4096.
+ * @param count Is set to the number of chunks used, can be NULL.
+ *
+ * @return Returns NULL on FAILURE. Otherwise pointer to valid userspace
+ * memory.
+ */
+void *cma_alloc_chunked(size_t size, size_t min_chunk, unsigned flags,
+						struct cma_chunk *chunks, unsigned max_chunks, unsigned *count);
+
+
+/**
+ * @brief Get physically contigous chunks of any allocation, a single one
+ * unless it was allocated with cma_alloc_ring() or cma_alloc_chunked().
+ *
+ * @param mem Pointer to previously allocated contiguous memory.
+ * @param chunks Array of max_chunks entries which is filled with the chunks in
+ * mapping order.
+ * @param max_chunks Size of chunks array.
+ *
+ * @return Returns number of chunks on SUCCESS, which may exceed max_chunks
+ * when the array is too small, -1 on FAILURE.
+ */
+int cma_get_chunks(void *mem, struct cma_chunk *chunks, unsigned max_chunks);
+
+
+/**
+ * @brief Allocate and map physically contigous memory with a single system
+ * call. Memory is released when it is unmapped, use cma_free_mmap() and not
+ * cma_free() for it.
+ *
+ * @param size Size in bytes.
+ * @param flags Bitwise OR of CMA_FLAG_* values, as for cma_alloc_ext().
+ * CMA_FLAG_REGION() needs 64-bit kernel.
+ *
+ * @return Returns NULL on FAILURE. Otherwise pointer to valid userspace
+ * memory.
+ */
+void *cma_alloc_mmap(size_t size, unsigned flags);
+
+
+/**
+ * @brief Release memory allocated with cma_alloc_mmap(), basically perform
+ * munmap() syscall.
+ *
+ * @param mem Pointer to memory returned by cma_alloc_mmap().
+ * @param size Size in bytes, as passed to cma_alloc_mmap().
+ *
+ * @return Returns 0 on SUCCESS, -1 on FAILURE.
+ */
+int cma_free_mmap(void *mem, size_t size);
+
+
+/**
+ * @brief Export allocation as dma-buf file descriptor. Descriptor can be passed
+ * to other process (e.g. over unix socket), imported there with
+ * cma_import_fd(), or handed to other driver supporting dma-buf import. Memory
+ * stays valid until it is freed with cma_free() and all dma-buf descriptors and
+ * imports are released. Descriptor has close-on-exec flag set.
+ *
+ * @param mem Pointer to previously allocated contiguous memory.
+ *
+ * @return Returns file descriptor on SUCCESS. On FAILURE returns -1 and errno
+ * is set accordingly.
+ */
+int cma_export_fd(void *mem);
+
+
+/**
+ * @brief Import and map dma-buf exported with cma_export_fd(). Memory has the
+ * same caching type as the exported one and is released with cma_free(). File
+ * descriptor can be closed right after the import.
+ *
+ * @param fd dma-buf file descriptor.
+ * @param size Location where size of the memory is stored, can be NULL.
+ *
+ * @return Returns NULL on FAILURE. Otherwise pointer to valid userspace
+ * memory.
+ */
+void *cma_import_fd(int fd, size_t *size);
+
+
 /**
  * @brief Release physically contigous memory.
  *
@@ -83,14 +319,224 @@ void *cma_alloc_noncached(size_t size);
 int cma_free(void *mem);
 
 
+/**
+ * @brief Make CPU writes to a range of cached memory visible to the device.
+ * Should be called before starting DMA which accesses the range. For noncached
+ * memory it does nothing.
+ *
+ * @param mem Pointer to previously allocated contiguous memory.
+ * @param offset Start of the range, in bytes from mem.
+ * @param len Length of the range in bytes, at most the buffer size. Range may
+ * wrap past the end of the buffer, as seen through cma_alloc_mirrored() memory.
+ *
+ * @return Returns 0 on SUCCESS, -1 on FAILURE.
+ */
+int cma_sync_for_device(void *mem, size_t offset, size_t len);
+
+
+/**
+ * @brief Make device writes to a range of cached memory visible to the CPU.
+ * Should be called after DMA which wrote the range has completed. For
+ * noncached memory it does nothing.
+ *
+ * @param mem Pointer to previously allocated contiguous memory.
+ * @param offset Start of the range, in bytes from mem.
+ * @param len Length of the range in bytes, at most the buffer size. Range may
+ * wrap past the end of the buffer, as seen through cma_alloc_mirrored() memory.
+ *
+ * @return Returns 0 on SUCCESS, -1 on FAILURE.
+ */
+int cma_sync_for_cpu(void *mem, size_t offset, size_t len);
+
+
+/**
+ * @brief Get flags which are in effect for the allocation. CMA_FLAG_HUGEPAGE
+ * is dropped by the driver when buffer is smaller than large page, is not
+ * physically aligned to it or kernel lacks transparent hugepage support.
+ *
+ * @param mem Pointer to previously allocated contiguous memory.
+ *
+ * @return Returns bitwise OR of CMA_FLAG_* values on SUCCESS, -1 on FAILURE.
+ */
+int cma_get_flags(void *mem);
+
+
 /**
  * @brief Get physical memory of cma memory block (should be used for DMA).
  *
  * @param mem Pointer to previously allocated contiguous memory.
  *
- * @return Returns address on SUCCESS, 0 on FAILURE.
+ * @return Returns address on SUCCESS, 0 on FAILURE or if the address does not
+ * fit 32 bits (use cma_get_phy_addr64() then).
  */
 unsigned cma_get_phy_addr(void *mem);
 
 
+/**
+ * @brief Get 64-bit physical memory of cma memory block (should be used for
+ * DMA). Memory mapped by this api is translated with cma_virt_to_phys(), the
+ * driver is asked only for other mappings.
+ *
+ * @param mem Pointer to previously allocated contiguous memory.
+ *
+ * @return Returns address on SUCCESS, 0 on FAILURE.
+ */
+uint64_t cma_get_phy_addr64(void *mem);
+
+
+/**
+ * @brief Translate any address inside memory mapped by this api, including
+ * pointers into the middle of an allocation, to the physical address without
+ * a system call. Parts of ring and chunked allocations and both halves of
+ * mirrored mappings are translated to the memory behind them. Lookup takes no
+ * lock and may be called from any thread. Memory of cma_alloc_mmap() is
+ * translated by the driver once, on the first lookup inside it.
+ *
+ * @param ptr Address inside contiguous memory.
+ *
+ * @return Returns address on SUCCESS, 0 if ptr is not inside memory mapped
+ * by this api.
+ */
+uint64_t cma_virt_to_phys(const void *ptr);
+
+
+/**
+ * @brief Translate an array of addresses with cma_virt_to_phys() at once,
+ * e.g. to fill a descriptor table.
+ *
+ * @param ptrs Addresses to translate.
+ * @param phy_addrs Receives physical address of every pointer, 0 for those
+ * which are not inside memory mapped by this api.
+ * @param count Number of pointers.
+ *
+ * @return Returns number of translated pointers.
+ */
+unsigned cma_virt_to_phys_bulk(void *const *ptrs, uint64_t *phy_addrs, unsigned count);
+
+
+/**
+ * @brief Get address the device uses to access cma memory block. It differs
+ * from the physical address for CMA_FLAG_ACP memory, which is accessed through
+ * the ACP window. The difference is the same for every part of a ring or
+ * chunked allocation.
+ *
+ * @param mem Pointer to previously allocated contiguous memory.
+ *
+ * @return Returns address on SUCCESS, 0 on FAILURE.
+ */
+uint64_t cma_get_dma_addr(void *mem);
+
+
+/**
+ * @brief Look up reserved memory region of the driver device tree node by its
+ * "memory-region-names" entry. Memory is allocated from the region when
+ * CMA_FLAG_REGION() of the returned index is passed to any allocation
+ * function taking flags. Region which is a "shared-dma-pool" is allocated
+ * from by its own device, other region is a carveout of cached memory.
+ *
+ * @param name Name of the region.
+ *
+ * @return Returns index of the region on SUCCESS, -1 on FAILURE (errno is
+ * ENOENT if there is no such region).
+ */
+int cma_get_region(const char *name);
+
+
+/**
+ * @brief Allocate small block of physically contigous memory without a
+ * system call. Blocks are cut from large arenas, are aligned to their power
+ * of two size class and never share a cache line. Each thread caches free
+ * blocks, so the call is served from the cache most of the time. Blocks
+ * larger than 32 KiB are allocated with cma_alloc_ext(). Block content is not
+ * cleared.
+ *
+ * @param size Size in bytes.
+ * @param flags CMA_FLAG_CACHED, CMA_FLAG_NONCACHED or CMA_FLAG_WRITECOMBINE.
+ *
+ * @return Returns NULL on FAILURE. Otherwise pointer to valid userspace
+ * memory.
+ */
+void *cma_slab_alloc(size_t size, unsigned flags);
+
+
+/**
+ * @brief Release block allocated with cma_slab_alloc(). Any thread can release
+ * it. Arena memory is given back to the driver only by cma_release().
+ *
+ * @param mem Pointer returned by cma_slab_alloc().
+ *
+ * @return Returns 0 on SUCCESS, -1 on FAILURE.
+ */
+int cma_slab_free(void *mem);
+
+
+/**
+ * @brief Get physical address of block allocated with cma_slab_alloc().
+ *
+ * @param mem Pointer returned by cma_slab_alloc().
+ *
+ * @return Returns address on SUCCESS, 0 on FAILURE.
+ */
+uint64_t cma_slab_get_phy_addr(void *mem);
+
+
+/**
+ * @brief Cache maintenance of cached block allocated with cma_slab_alloc(),
+ * as cma_sync_for_device() and cma_sync_for_cpu() do for allocations.
+ *
+ * @param mem Pointer returned by cma_slab_alloc().
+ * @param len Length of the range from mem.
+ *
+ * @return Returns 0 on SUCCESS, -1 on FAILURE.
+ */
+int cma_slab_sync_for_device(void *mem, size_t len);
+int cma_slab_sync_for_cpu(void *mem, size_t len);
+
+
+/**
+ * @brief Copy to contiguous memory, as memcpy(). Noncached and write-combined
+ * destination is written with aligned accesses of the widest vector unit the
+ * CPU has (NEON, SSE2 or AVX), bypassing the cache on x86. memcpy() is used
+ * for cached memory and memory not allocated by this api.
+ *
+ * @param dst Destination, anywhere inside contiguous memory.
+ * @param src Source in ordinary memory.
+ * @param n Number of bytes.
+ *
+ * @return Returns dst.
+ */
+void *cma_memcpy_to_dma(void *dst, const void *src, size_t n);
+
+
+/**
+ * @brief Copy from contiguous memory, as memcpy(). Noncached and
+ * write-combined source is read with aligned vector loads, streaming loads
+ * on x86 (SSE4.1 or AVX2).
+ *
+ * @param dst Destination in ordinary memory.
+ * @param src Source, anywhere inside contiguous memory.
+ * @param n Number of bytes.
+ *
+ * @return Returns dst.
+ */
+void *cma_memcpy_from_dma(void *dst, const void *src, size_t n);
+
+
+/**
+ * @brief Fill contiguous memory, as memset(), written the same way as by
+ * cma_memcpy_to_dma().
+ *
+ * @param dst Destination, anywhere inside contiguous memory.
+ * @param c Byte value.
+ * @param n Number of bytes.
+ *
+ * @return Returns dst.
+ */
+void *cma_memset(void *dst, int c, size_t n);
+
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif
\ No newline at end of file
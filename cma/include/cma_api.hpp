@@ -0,0 +1,282 @@
+/* cma_api.hpp - C++ interface of the api library.
+ *
+ *
+ * The MIT License (MIT)
+ *
+ * COPYRIGHT (C) 2017 Institute of Electronics and Computer Science (EDI), Latvia.
+ * AUTHOR: Rihards Novickis (rihards.novickis@edi.lv)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ *
+ * DESCRIPTION:
+ * Owning buffer type and std::pmr memory resource layered over "cma_api.h",
+ * refer to it for the behaviour of the underlying calls. Failures are reported
+ * with std::system_error carrying errno of the failed call, or std::bad_alloc
+ * where the standard interface requires it.
+ */
+
+#ifndef CMA_API_HPP_
+#define CMA_API_HPP_
+
+#include <cstddef>
+#include <cstdint>
+#include <cerrno>
+#include <new>
+#include <utility>
+#include <system_error>
+#if __cplusplus >= 201703L
+	#include <memory_resource>
+#endif
+
+#include "cma_api.h"
+
+
+namespace cma {
+
+
+/**
+ * @brief Physical address of any address inside memory allocated by the api,
+ * see cma_virt_to_phys().
+ */
+inline uint64_t phy_addr(const void *ptr) noexcept
+{
+	return cma_virt_to_phys(ptr);
+}
+
+
+/**
+ * @brief Move-only owner of a cma_alloc_ext() allocation, released with
+ * cma_free() when the owner is destroyed. Physical address is queried once at
+ * allocation.
+ */
+class buffer{
+public:
+	buffer() noexcept = default;
+
+	/**
+	 * @brief Allocate memory with cma_alloc_ext().
+	 *
+	 * @param size Size in bytes.
+	 * @param flags Bitwise OR of CMA_FLAG_* values.
+	 *
+	 * Throws std::system_error on FAILURE.
+	 */
+	explicit buffer(size_t size, unsigned flags = CMA_FLAG_CACHED)
+		: mem_(cma_alloc_ext(size, flags)), size_(size), flags_(flags)
+	{
+		if( mem_ == nullptr )
+			throw std::system_error(errno, std::generic_category(), "cma_alloc_ext");
+
+		phy_addr_ = cma_get_phy_addr64(mem_);
+	}
+
+	/**
+	 * @brief Take ownership of memory allocated with cma_alloc_ext(),
+	 * cma_alloc_aligned() or any other call released with cma_free().
+	 */
+	buffer(void *mem, size_t size) noexcept
+		: mem_(mem), size_(size), phy_addr_(mem != nullptr ? cma_get_phy_addr64(mem) : 0)
+	{
+		int flags = mem != nullptr ? cma_get_flags(mem) : -1;
+
+		flags_ = flags != -1 ? flags : CMA_FLAG_CACHED;
+	}
+
+	buffer(buffer &&other) noexcept
+		: mem_(other.mem_), size_(other.size_), phy_addr_(other.phy_addr_), flags_(other.flags_)
+	{
+		other.mem_ = nullptr;
+		other.size_ = 0;
+		other.phy_addr_ = 0;
+	}
+
+	buffer &operator=(buffer &&other) noexcept
+	{
+		if( this != &other ){
+			reset();
+			std::swap(mem_, other.mem_);
+			std::swap(size_, other.size_);
+			std::swap(phy_addr_, other.phy_addr_);
+			std::swap(flags_, other.flags_);
+		}
+
+		return *this;
+	}
+
+	buffer(const buffer&) = delete;
+	buffer &operator=(const buffer&) = delete;
+
+	~buffer()
+	{
+		reset();
+	}
+
+	void *data() const noexcept { return mem_; }
+	size_t size() const noexcept { return size_; }
+	unsigned flags() const noexcept { return flags_; }
+	uint64_t phy_addr() const noexcept { return phy_addr_; }
+	explicit operator bool() const noexcept { return mem_ != nullptr; }
+
+	template<class T>
+	T *as() const noexcept { return static_cast<T*>(mem_); }
+
+	/**
+	 * @brief Device address of the memory, see cma_get_dma_addr().
+	 */
+	uint64_t dma_addr() const noexcept
+	{
+		return mem_ != nullptr ? cma_get_dma_addr(mem_) : 0;
+	}
+
+	/**
+	 * @brief Cache maintenance of a range, see cma_sync_for_device() and
+	 * cma_sync_for_cpu(). Throws std::system_error on FAILURE.
+	 */
+	void sync_for_device(size_t offset = 0, size_t len = SIZE_MAX) const
+	{
+		if( cma_sync_for_device(mem_, offset, range(offset, len)) == -1 )
+			throw std::system_error(errno, std::generic_category(), "cma_sync_for_device");
+	}
+
+	void sync_for_cpu(size_t offset = 0, size_t len = SIZE_MAX) const
+	{
+		if( cma_sync_for_cpu(mem_, offset, range(offset, len)) == -1 )
+			throw std::system_error(errno, std::generic_category(), "cma_sync_for_cpu");
+	}
+
+	/**
+	 * @brief Export the memory as dma-buf, see cma_export_fd(). Throws
+	 * std::system_error on FAILURE.
+	 */
+	int export_fd() const
+	{
+		int fd = cma_export_fd(mem_);
+
+		if( fd == -1 )
+			throw std::system_error(errno, std::generic_category(), "cma_export_fd");
+
+		return fd;
+	}
+
+	/**
+	 * @brief Give up ownership, caller releases the memory with cma_free().
+	 */
+	void *release() noexcept
+	{
+		void *mem = mem_;
+
+		mem_ = nullptr;
+		size_ = 0;
+		phy_addr_ = 0;
+
+		return mem;
+	}
+
+	void reset() noexcept
+	{
+		if( mem_ != nullptr )
+			cma_free(release());
+	}
+
+private:
+	/* length up to the end of the buffer by default */
+	size_t range(size_t offset, size_t len) const noexcept
+	{
+		return len == SIZE_MAX && offset <= size_ ? size_ - offset : len;
+	}
+
+	void 		*mem_ = nullptr;
+	size_t 		size_ = 0;
+	uint64_t 	phy_addr_ = 0;
+	unsigned 	flags_ = CMA_FLAG_CACHED;
+};
+
+
+#if __cplusplus >= 201703L
+/**
+ * @brief Memory resource allocating from arenas of cma_slab_alloc(), so that
+ * std::pmr containers keep their elements in physically contigous memory:
+ *
+ * 	cma::memory_resource resource(CMA_FLAG_WRITECOMBINE);
+ * 	std::pmr::vector<uint32_t> v(&resource);
+ *
+ * Memory block of a container is physically contigous, its address is given by
+ * cma::phy_addr(v.data()). Blocks up to 32 KiB come from shared arenas, larger
+ * ones are allocations of their own. Alignment up to the page size is
+ * supported. Noncached memory is not accepted, on ARMv7 it is strongly-ordered
+ * and faults on unaligned and exclusive (ldrex/strex) accesses, which element
+ * types and the C++ library are free to make. Resources with the same flags are equal, as memory allocated by
+ * one can be deallocated by the other. Arenas stay allocated until
+ * cma_release().
+ */
+class memory_resource : public std::pmr::memory_resource{
+public:
+	/**
+	 * @param flags CMA_FLAG_CACHED or CMA_FLAG_WRITECOMBINE.
+	 *
+	 * Throws std::system_error with EINVAL for any other flags.
+	 */
+	explicit memory_resource(unsigned flags = CMA_FLAG_CACHED)
+		: flags_(flags)
+	{
+		if( flags != CMA_FLAG_CACHED && flags != CMA_FLAG_WRITECOMBINE )
+			throw std::system_error(EINVAL, std::generic_category(), "cma::memory_resource");
+	}
+
+	unsigned flags() const noexcept { return flags_; }
+
+private:
+	/* blocks are aligned to their size class and the page */
+	static constexpr size_t page_align = 4096;
+
+	void *do_allocate(size_t bytes, size_t alignment) override
+	{
+		void *mem;
+
+		if( alignment > page_align )
+			throw std::bad_alloc();
+
+		mem = cma_slab_alloc(bytes > alignment ? bytes : alignment, flags_);
+		if( mem == nullptr )
+			throw std::bad_alloc();
+
+		return mem;
+	}
+
+	void do_deallocate(void *mem, size_t, size_t) override
+	{
+		cma_slab_free(mem);
+	}
+
+	bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override
+	{
+		const memory_resource *resource = dynamic_cast<const memory_resource*>(&other);
+
+		return resource != nullptr && resource->flags_ == flags_;
+	}
+
+	unsigned 	flags_;
+};
+#endif
+
+
+} /* namespace cma */
+
+#endif
@@ -0,0 +1,108 @@
+/* acp_bench.c - CPU side cost of sharing buffers with a device.
+ *
+ * Measures write and read throughput of every memory type including what
+ * makes the data visible to the other side, which is cache maintenance for
+ * cached memory and nothing for noncached, write-combined and ACP memory.
+ * ACP test is skipped unless the driver is loaded with the ACP window.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "cma_api.h"
+
+#include "timer/timer.h"
+#include "bench_util/bench_util.h"
+
+#define BENCH_SIZE 			(4*1024*1024)
+#define BENCH_REPEAT 		16
+
+
+static int bench_write(volatile unsigned *mem, int needs_sync, struct custom_timer *t)
+{
+	unsigned i, r;
+
+	timer_start(t);
+	for(r=0; r<BENCH_REPEAT; r++){
+		for(i=0; i<BENCH_SIZE/sizeof(unsigned); i++)
+			mem[i] = i + r;
+
+		/* hand the buffer over to the device */
+		if( needs_sync && cma_sync_for_device((void*)mem, 0, BENCH_SIZE) == -1 )
+			return -1;
+	}
+	timer_end(t);
+
+	return 0;
+}
+
+
+static int bench_read(volatile unsigned *mem, int needs_sync, struct custom_timer *t, unsigned *sum)
+{
+	unsigned i, r;
+
+	timer_start(t);
+	for(r=0; r<BENCH_REPEAT; r++){
+		/* take the buffer over from the device */
+		if( needs_sync && cma_sync_for_cpu((void*)mem, 0, BENCH_SIZE) == -1 )
+			return -1;
+
+		for(i=0; i<BENCH_SIZE/sizeof(unsigned); i++)
+			*sum += mem[i];
+	}
+	timer_end(t);
+
+	return 0;
+}
+
+
+static int bench_type(int test_num, const struct bench_type *type)
+{
+	unsigned *mem, sum = 0;
+	int needs_sync = !(type->flags & (CMA_FLAG_NONCACHED | CMA_FLAG_WRITECOMBINE | CMA_FLAG_ACP));
+	struct custom_timer t_write = {"Write"};
+	struct custom_timer t_read = {"Read"};
+
+	mem = cma_alloc_ext(BENCH_SIZE, type->flags);
+	if(mem == NULL){
+		tap_skip(test_num, type->name, "allocation failed");
+		return 0;
+	}
+
+	if( bench_write(mem, needs_sync, &t_write) == -1 ||
+		bench_read(mem, needs_sync, &t_read, &sum) == -1 ){
+		tap_not_ok(test_num, type->name, "sync failed");
+		cma_free(mem);
+		return -1;
+	}
+
+	printf("# %-12s: phys 0x%llx, dma 0x%llx\n", type->name,
+		(unsigned long long)cma_get_phy_addr64(mem), (unsigned long long)cma_get_dma_addr(mem));
+	printf("# %-12s: %.1f MiB/s write to device, %.1f MiB/s read from device (%x)\n", type->name,
+		(double)BENCH_SIZE * BENCH_REPEAT / timer_get_value(&t_write) / (1024*1024),
+		(double)BENCH_SIZE * BENCH_REPEAT / timer_get_value(&t_read) / (1024*1024), sum);
+	tap_ok(test_num, type->name);
+
+	cma_free(mem);
+	return 0;
+}
+
+
+int main(void)
+{
+	int i, err = 0;
+
+	tap_plan(bench_type_count);
+
+	if( cma_init() == -1 )
+		return tap_bail_out("cma_init failed");
+
+	for(i=0; i<bench_type_count; i++)
+		if(bench_type(i+1, &bench_types[i]))
+			err = 1;
+
+	cma_release();
+
+	return err;
+}
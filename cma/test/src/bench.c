@@ -0,0 +1,435 @@
+/* bench.c - benchmark suite of the CMA api with CSV or JSON output.
+ *
+ * Measures, for cached, noncached, write-combined and ACP memory:
+ * - allocation and release latency percentiles for sizes from 4 KiB up to
+ *   256 MiB (sizes which can not be allocated are reported on stderr)
+ * - read, write and copy bandwidth, copies made with cma_memcpy_to_dma() and
+ *   cma_memcpy_from_dma() from and to ordinary memory
+ * - time of sequential and random word reads
+ * - throughput of cma_alloc_ext() and cma_slab_alloc() called by concurrent
+ *   threads, with latency percentiles of the former
+ *
+ * Every result is a record of test, memory type, size, thread count, metric,
+ * value and unit. Records are printed as CSV (default) or JSON together with
+ * driver interface version and the system, so that runs with different driver
+ * versions can be compared.
+ *
+ * Usage: cma_bench.elf [-f csv|json] [-s max size in MiB] [-t max threads]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/utsname.h>
+
+#include "cma_api.h"
+
+#include "timer/timer.h"
+#include "bench_util/bench_util.h"
+
+#define BENCH_MIN_SIZE 			(4*1024)
+#define BENCH_MAX_SIZE 			(256*1024*1024)
+#define BENCH_BW_SIZE 			(4*1024*1024)
+#define BENCH_BW_TOTAL 			(32*1024*1024)	/* bytes moved per bandwidth metric */
+#define BENCH_ACCESS_SIZE 		(16*1024*1024)
+#define BENCH_ACCESSES 			(1024*1024)
+#define BENCH_THREAD_ALLOCS 	1000			/* cma_alloc_ext() calls per thread */
+#define BENCH_THREAD_SLABS 		100000			/* cma_slab_alloc() calls per thread */
+#define BENCH_THREAD_SIZE 		(4*1024)
+#define BENCH_SLAB_SIZE 		256
+
+
+/* arguments and results of a contention thread */
+struct bench_thread{
+	pthread_t 	thread;
+	pthread_barrier_t *barrier;
+	unsigned 	flags;
+	int 		slab;
+	unsigned 	iterations;
+	double 		*latency;	/* seconds per allocation and release, cma_alloc_ext() only */
+	struct custom_timer span;
+	int 		failed;
+};
+
+
+static int bench_json;
+static int bench_records;
+
+
+
+static void bench_header(void)
+{
+	struct utsname uts;
+
+	if( uname(&uts) == -1 )
+		memset(&uts, 0, sizeof(uts));
+
+	if( bench_json ){
+		printf("{\n");
+		printf("  \"driver_version\": %d,\n", cma_get_version());
+		printf("  \"kernel\": \"%s\",\n", uts.release);
+		printf("  \"machine\": \"%s\",\n", uts.machine);
+		printf("  \"results\": [");
+	}
+	else{
+		printf("# driver_version=%d kernel=%s machine=%s\n", cma_get_version(), uts.release, uts.machine);
+		printf("test,type,size,threads,metric,value,unit\n");
+	}
+}
+
+
+static void bench_footer(void)
+{
+	if( bench_json )
+		printf("\n  ]\n}\n");
+}
+
+
+static void bench_record(const char *test, const char *type, size_t size, unsigned threads,
+						 const char *metric, double value, const char *unit)
+{
+	if( bench_json )
+		printf("%s\n    {\"test\": \"%s\", \"type\": \"%s\", \"size\": %zu, \"threads\": %u, "
+			   "\"metric\": \"%s\", \"value\": %.3f, \"unit\": \"%s\"}",
+			   bench_records ? "," : "", test, type, size, threads, metric, value, unit);
+	else
+		printf("%s,%s,%zu,%u,%s,%.3f,%s\n", test, type, size, threads, metric, value, unit);
+
+	bench_records++;
+	fflush(stdout);
+}
+
+
+static int bench_compare(const void *a, const void *b)
+{
+	double x = *(const double*)a, y = *(const double*)b;
+
+	return (x > y) - (x < y);
+}
+
+
+/* nearest rank percentiles of latencies in seconds, reported in microseconds */
+static void bench_percentiles(const char *test, const char *type, size_t size, unsigned threads,
+							  const char *op, double *latency, unsigned count)
+{
+	const struct{ const char *name; double rank; } ranks[] = {
+		{"p50", 0.50}, {"p90", 0.90}, {"p99", 0.99}, {"max", 1.00}
+	};
+	char metric[32];
+	unsigned i;
+
+	qsort(latency, count, sizeof(double), bench_compare);
+
+	for(i=0; i<sizeof(ranks)/sizeof(ranks[0]); i++){
+		snprintf(metric, sizeof(metric), "%s_%s", op, ranks[i].name);
+		bench_record(test, type, size, threads, metric, latency[(unsigned)(ranks[i].rank * (count - 1))] * 1e6, "us");
+	}
+}
+
+
+static void bench_latency(const struct bench_type *type, size_t size)
+{
+	struct custom_timer t = {"Latency"};
+	unsigned i, count = 0, iterations = size <= 1024*1024 ? 100 : size <= 16*1024*1024 ? 20 : 5;
+	double *t_alloc, *t_free;
+	void *mem;
+
+	t_alloc = malloc(iterations * sizeof(double));
+	t_free 	= malloc(iterations * sizeof(double));
+	if(t_alloc == NULL || t_free == NULL)
+		goto leave;
+
+	for(i=0; i<iterations; i++){
+		timer_start(&t);
+		mem = cma_alloc_ext(size, type->flags);
+		timer_end(&t);
+		if(mem == NULL)
+			break;
+		t_alloc[i] = timer_get_value(&t);
+
+		timer_start(&t);
+		cma_free(mem);
+		timer_end(&t);
+		t_free[i] = timer_get_value(&t);
+
+		count++;
+	}
+
+	if(count == 0){
+		fprintf(stderr, "# latency %s %zu: allocation failed\n", type->name, size);
+		goto leave;
+	}
+
+	bench_percentiles("latency", type->name, size, 1, "alloc", t_alloc, count);
+	bench_percentiles("latency", type->name, size, 1, "free", t_free, count);
+
+leave:
+	free(t_alloc);
+	free(t_free);
+}
+
+
+static void bench_bandwidth(const struct bench_type *type, size_t size, char *buf)
+{
+	struct custom_timer t = {"Bandwidth"};
+	unsigned r, repeat = BENCH_BW_TOTAL / size;
+	volatile unsigned long *words;
+	unsigned long sum = 0;
+	size_t i;
+
+	words = cma_alloc_ext(size, type->flags);
+	if(words == NULL){
+		fprintf(stderr, "# bandwidth %s %zu: allocation failed\n", type->name, size);
+		return;
+	}
+
+	timer_start(&t);
+	for(r=0; r<repeat; r++)
+		for(i=0; i<size/sizeof(long); i++)
+			words[i] = i + r;
+	timer_end(&t);
+	bench_record("bandwidth", type->name, size, 1, "write", (double)size * repeat / timer_get_value(&t) / (1024*1024), "MiB/s");
+
+	timer_start(&t);
+	for(r=0; r<repeat; r++)
+		for(i=0; i<size/sizeof(long); i++)
+			sum += words[i];
+	timer_end(&t);
+	bench_record("bandwidth", type->name, size, 1, "read", (double)size * repeat / timer_get_value(&t) / (1024*1024), "MiB/s");
+
+	timer_start(&t);
+	for(r=0; r<repeat; r++)
+		cma_memcpy_to_dma((void*)words, buf, size);
+	timer_end(&t);
+	bench_record("bandwidth", type->name, size, 1, "copy_to", (double)size * repeat / timer_get_value(&t) / (1024*1024), "MiB/s");
+
+	timer_start(&t);
+	for(r=0; r<repeat; r++)
+		cma_memcpy_from_dma(buf, (void*)words, size);
+	timer_end(&t);
+	bench_record("bandwidth", type->name, size, 1, "copy_from", (double)size * repeat / timer_get_value(&t) / (1024*1024), "MiB/s");
+
+	/* keeps the reads */
+	if(sum == 1)
+		fprintf(stderr, "#\n");
+
+	cma_free((void*)words);
+}
+
+
+static void bench_access(const struct bench_type *type, size_t size, const unsigned *seq, const unsigned *rnd)
+{
+	struct custom_timer t = {"Access"};
+	volatile unsigned *mem;
+	unsigned i, sum = 0;
+
+	mem = cma_alloc_ext(size, type->flags);
+	if(mem == NULL){
+		fprintf(stderr, "# access %s %zu: allocation failed\n", type->name, size);
+		return;
+	}
+
+	timer_start(&t);
+	for(i=0; i<BENCH_ACCESSES; i++)
+		sum += mem[seq[i]];
+	timer_end(&t);
+	bench_record("access", type->name, size, 1, "sequential", timer_get_value(&t) * 1e9 / BENCH_ACCESSES, "ns");
+
+	timer_start(&t);
+	for(i=0; i<BENCH_ACCESSES; i++)
+		sum += mem[rnd[i]];
+	timer_end(&t);
+	bench_record("access", type->name, size, 1, "random", timer_get_value(&t) * 1e9 / BENCH_ACCESSES, "ns");
+
+	if(sum == 1)
+		fprintf(stderr, "#\n");
+
+	cma_free((void*)mem);
+}
+
+
+static void *bench_thread(void *arg)
+{
+	struct bench_thread *bt = arg;
+	struct custom_timer t = {"Thread"};
+	unsigned i;
+	void *mem;
+
+	pthread_barrier_wait(bt->barrier);
+
+	timer_start(&bt->span);
+	for(i=0; i<bt->iterations && !bt->failed; i++){
+		if( bt->slab ){
+			mem = cma_slab_alloc(BENCH_SLAB_SIZE, bt->flags);
+			if(mem == NULL || cma_slab_free(mem) == -1)
+				bt->failed = 1;
+			continue;
+		}
+
+		timer_start(&t);
+		mem = cma_alloc_ext(BENCH_THREAD_SIZE, bt->flags);
+		if(mem == NULL || cma_free(mem) == -1)
+			bt->failed = 1;
+		timer_end(&t);
+		bt->latency[i] = timer_get_value(&t);
+	}
+	timer_end(&bt->span);
+
+	return NULL;
+}
+
+
+static int bench_before(const struct timespec *a, const struct timespec *b)
+{
+	return a->tv_sec < b->tv_sec || (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+
+/* all threads start at once, throughput is measured from the first start
+ * until the last end, as seen by the threads themselves */
+static void bench_contention(const struct bench_type *type, unsigned threads, int slab)
+{
+	struct custom_timer t = {"Contention"};
+	struct bench_thread *bt;
+	pthread_barrier_t barrier;
+	unsigned i, created, iterations = slab ? BENCH_THREAD_SLABS : BENCH_THREAD_ALLOCS;
+	const char *test = slab ? "contention_slab" : "contention";
+	size_t size = slab ? BENCH_SLAB_SIZE : BENCH_THREAD_SIZE;
+	double *latency;
+	int failed = 0;
+
+	bt 		= calloc(threads, sizeof(struct bench_thread));
+	latency = slab ? NULL : malloc((size_t)threads * iterations * sizeof(double));
+	if(bt == NULL || (!slab && latency == NULL) || pthread_barrier_init(&barrier, NULL, threads + 1)){
+		fprintf(stderr, "# %s %s %u: out of memory\n", test, type->name, threads);
+		free(bt);
+		free(latency);
+		return;
+	}
+
+	for(created=0; created<threads; created++){
+		bt[created].barrier 	= &barrier;
+		bt[created].flags 		= type->flags;
+		bt[created].slab 		= slab;
+		bt[created].iterations 	= iterations;
+		bt[created].latency 	= slab ? NULL : latency + (size_t)created * iterations;
+		if( pthread_create(&bt[created].thread, NULL, bench_thread, &bt[created]) )
+			break;
+	}
+
+	/* threads which were not created are stood in for */
+	for(i=created; i<threads; i++)
+		pthread_barrier_wait(&barrier);
+
+	pthread_barrier_wait(&barrier);
+	for(i=0; i<created; i++){
+		pthread_join(bt[i].thread, NULL);
+		failed |= bt[i].failed;
+
+		if(i == 0 || bench_before(&bt[i].span.start, &t.start))
+			t.start = bt[i].span.start;
+		if(i == 0 || bench_before(&t.end, &bt[i].span.end))
+			t.end = bt[i].span.end;
+	}
+
+	if(failed || created != threads)
+		fprintf(stderr, "# %s %s %u: allocation failed\n", test, type->name, threads);
+	else{
+		bench_record(test, type->name, size, threads, "ops", (double)threads * iterations / timer_get_value(&t), "1/s");
+		if(!slab)
+			bench_percentiles(test, type->name, size, threads, "alloc_free", latency, threads * iterations);
+	}
+
+	pthread_barrier_destroy(&barrier);
+	free(bt);
+	free(latency);
+}
+
+
+int main(int argc, char *argv[])
+{
+	size_t size, max_size = BENCH_MAX_SIZE, words;
+	unsigned long long mib;
+	unsigned *seq, *rnd, threads, max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	char *buf;
+	int i, opt;
+
+	while( (opt = getopt(argc, argv, "f:s:t:")) != -1 ){
+		switch(opt){
+		case 'f':
+			bench_json = !strcmp(optarg, "json");
+			break;
+		case 's':
+			mib = strtoull(optarg, NULL, 0);
+			max_size = mib > SIZE_MAX / (1024*1024) ? SIZE_MAX : mib * 1024 * 1024;
+			break;
+		case 't':
+			max_threads = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-f csv|json] [-s max size in MiB] [-t max threads]\n", argv[0]);
+			return 2;
+		}
+	}
+	if(max_threads == 0)
+		max_threads = 1;
+
+	/* word indices, random ones cover the whole buffer */
+	words 	= BENCH_ACCESS_SIZE / sizeof(unsigned);
+	seq 	= malloc(BENCH_ACCESSES * sizeof(unsigned));
+	rnd 	= malloc(BENCH_ACCESSES * sizeof(unsigned));
+	buf 	= malloc(BENCH_BW_SIZE);
+	if(seq == NULL || rnd == NULL || buf == NULL){
+		fprintf(stderr, "malloc failed\n");
+		return 4;
+	}
+	for(i=0; i<BENCH_ACCESSES; i++){
+		seq[i] = i % words;
+		rnd[i] = ((unsigned)rand() * (RAND_MAX + 1U) + rand()) % words;
+	}
+	memset(buf, 0x5a, BENCH_BW_SIZE);
+
+	if( cma_init() == -1 ){
+		fprintf(stderr, "cma_init failed\n");
+		return 4;
+	}
+
+	bench_header();
+
+	/* sizes stop before they would wrap around */
+	for(i=0; i<bench_type_count; i++){
+		for(size=BENCH_MIN_SIZE; size<=max_size; size*=4){
+			bench_latency(&bench_types[i], size);
+			if(size > max_size / 4)
+				break;
+		}
+	}
+
+	for(i=0; i<bench_type_count; i++)
+		bench_bandwidth(&bench_types[i], BENCH_BW_SIZE, buf);
+
+	for(i=0; i<bench_type_count; i++)
+		bench_access(&bench_types[i], BENCH_ACCESS_SIZE, seq, rnd);
+
+	for(i=0; i<bench_type_count; i++){
+		for(threads=1; threads<=max_threads; threads*=2){
+			bench_contention(&bench_types[i], threads, 0);
+			bench_contention(&bench_types[i], threads, 1);
+			if(threads > max_threads / 2)
+				break;
+		}
+	}
+
+	bench_footer();
+
+	cma_release();
+
+	free(seq);
+	free(rnd);
+	free(buf);
+
+	return 0;
+}
@@ -0,0 +1,65 @@
+#include <stdio.h>
+#include <stdarg.h>
+
+#include "cma_api.h"
+
+#include "bench_util.h"
+
+
+
+/* memory types in the order they are reported, ACP is allocated only if the
+ * driver has the ACP window configured */
+const struct bench_type bench_types[] = {
+	{"cached", 			CMA_FLAG_CACHED},
+	{"noncached", 		CMA_FLAG_NONCACHED},
+	{"writecombine", 	CMA_FLAG_WRITECOMBINE},
+	{"acp", 			CMA_FLAG_ACP}
+};
+const int bench_type_count = sizeof(bench_types)/sizeof(bench_types[0]);
+
+
+void tap_plan(int test_count)
+{
+	printf("TAP version 13\n");
+	printf("1..%d\n", test_count);
+}
+
+void tap_ok(int test_num, const char *name)
+{
+	printf("ok %d %s\n", test_num, name);
+}
+
+void tap_not_ok(int test_num, const char *name, const char *fmt, ...)
+{
+	va_list args;
+
+	printf("not ok %d %s # ", test_num, name);
+	va_start(args, fmt);
+	vprintf(fmt, args);
+	va_end(args);
+	printf("\n");
+}
+
+void tap_skip(int test_num, const char *name, const char *fmt, ...)
+{
+	va_list args;
+
+	printf("ok %d %s # SKIP ", test_num, name);
+	va_start(args, fmt);
+	vprintf(fmt, args);
+	va_end(args);
+	printf("\n");
+}
+
+int tap_bail_out(const char *fmt, ...)
+{
+	va_list args;
+
+	printf("Bail out! ");
+	va_start(args, fmt);
+	vprintf(fmt, args);
+	va_end(args);
+	printf("\n");
+
+	return 4;
+}
@@ -0,0 +1,32 @@
+#ifndef BENCH_UTIL_H_
+#define BENCH_UTIL_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+
+/* memory type measured by the benchmarks */
+struct bench_type{
+	const char 	*name;
+	unsigned 	flags;		/* CMA_FLAG_* of the allocation */
+};
+
+extern const struct bench_type bench_types[];
+extern const int bench_type_count;
+
+
+/* TAP output of the kselftest framework, Bail out! returns exit code of it */
+void tap_plan(int test_count);
+void tap_ok(int test_num, const char *name);
+void tap_not_ok(int test_num, const char *name, const char *fmt, ...);
+void tap_skip(int test_num, const char *name, const char *fmt, ...);
+int tap_bail_out(const char *fmt, ...);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
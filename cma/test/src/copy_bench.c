@@ -0,0 +1,140 @@
+/* copy_bench.c - throughput of the copy routines of the api.
+ *
+ * Measures cma_memcpy_to_dma(), cma_memcpy_from_dma() and cma_memset()
+ * against memcpy() and memset() of the C library for every memory type and
+ * sizes from a page to a few megabytes, after verifying the api routines with
+ * unaligned buffers and lengths. Baselines use block aligned buffers since
+ * unaligned C library accesses may fault on noncached ARM memory.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cma_api.h"
+
+#include "timer/timer.h"
+#include "bench_util/bench_util.h"
+
+#define BENCH_MAX_SIZE 		(4*1024*1024)
+#define BENCH_TOTAL 		(16*1024*1024)	/* bytes moved per measurement */
+
+
+/* measured routine, memset() ones are called with c in place of src */
+enum bench_op{
+	BENCH_TO_DMA,
+	BENCH_FROM_DMA,
+	BENCH_FILL
+};
+
+
+static double bench_rate(enum bench_op op, int api, char *mem, char *buf, size_t size)
+{
+	struct custom_timer t = {"Copy"};
+	size_t r, repeat = BENCH_TOTAL / size;
+
+	timer_start(&t);
+	for(r=0; r<repeat; r++){
+		switch(op){
+		case BENCH_TO_DMA:
+			api ? cma_memcpy_to_dma(mem, buf, size) : memcpy(mem, buf, size);
+			break;
+		case BENCH_FROM_DMA:
+			api ? cma_memcpy_from_dma(buf, mem, size) : memcpy(buf, mem, size);
+			break;
+		case BENCH_FILL:
+			api ? cma_memset(mem, r, size) : memset(mem, r, size);
+			break;
+		}
+	}
+	timer_end(&t);
+
+	return (double)size * repeat / timer_get_value(&t) / (1024*1024);
+}
+
+
+/* odd offsets and lengths exercise head and tail of every routine */
+static int bench_verify(char *mem, char *buf, char *ref)
+{
+	const size_t offset = 3, size = 64*1024 + 13;
+	size_t i;
+
+	for(i=0; i<size; i++)
+		ref[i] = i * 7;
+
+	cma_memset(mem, 0xa5, offset + size + 1);
+	cma_memcpy_to_dma(mem + offset, ref, size);
+	cma_memcpy_from_dma(buf, mem, offset + size + 1);
+	if( buf[offset-1] != (char)0xa5 || buf[offset+size] != (char)0xa5 || memcmp(buf + offset, ref, size) )
+		return -1;
+
+	cma_memset(mem + offset, 0x3c, size);
+	cma_memcpy_from_dma(buf + 1, mem + offset, size);
+	for(i=0; i<size; i++)
+		if( buf[i+1] != 0x3c )
+			return -1;
+
+	return 0;
+}
+
+
+static int bench_type(int test_num, const struct bench_type *type, char *buf, char *ref)
+{
+	const size_t sizes[] = {4*1024, 64*1024, 1024*1024, BENCH_MAX_SIZE};
+	const int size_count = sizeof(sizes)/sizeof(sizes[0]);
+	char *mem;
+	int i;
+
+	mem = cma_alloc_ext(BENCH_MAX_SIZE, type->flags);
+	if(mem == NULL){
+		tap_skip(test_num, type->name, "allocation failed");
+		return 0;
+	}
+
+	if( bench_verify(mem, buf, ref) == -1 ){
+		tap_not_ok(test_num, type->name, "copied data differs");
+		cma_free(mem);
+		return -1;
+	}
+
+	printf("# %-12s %8s %10s %10s %10s %10s %10s %10s MiB/s\n", type->name, "size",
+		"memcpy_to", "cma_to", "memcpy_fr", "cma_from", "memset", "cma_set");
+	for(i=0; i<size_count; i++)
+		printf("# %-12s %8zu %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n", type->name, sizes[i],
+			bench_rate(BENCH_TO_DMA, 0, mem, buf, sizes[i]), bench_rate(BENCH_TO_DMA, 1, mem, buf, sizes[i]),
+			bench_rate(BENCH_FROM_DMA, 0, mem, buf, sizes[i]), bench_rate(BENCH_FROM_DMA, 1, mem, buf, sizes[i]),
+			bench_rate(BENCH_FILL, 0, mem, buf, sizes[i]), bench_rate(BENCH_FILL, 1, mem, buf, sizes[i]));
+	tap_ok(test_num, type->name);
+
+	cma_free(mem);
+	return 0;
+}
+
+
+int main(void)
+{
+	int i, err = 0;
+	char *buf, *ref;
+
+	tap_plan(bench_type_count);
+
+	buf = malloc(BENCH_MAX_SIZE);
+	ref = malloc(BENCH_MAX_SIZE);
+	if(buf == NULL || ref == NULL)
+		return tap_bail_out("malloc failed");
+	memset(buf, 0, BENCH_MAX_SIZE);
+
+	if( cma_init() == -1 )
+		return tap_bail_out("cma_init failed");
+
+	for(i=0; i<bench_type_count; i++)
+		if(bench_type(i+1, &bench_types[i], buf, ref))
+			err = 1;
+
+	cma_release();
+
+	free(buf);
+	free(ref);
+
+	return err;
+}
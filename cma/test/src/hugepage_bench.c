@@ -0,0 +1,187 @@
+/* hugepage_bench.c - TLB cost of small page and large page mappings.
+ *
+ * Measures the average time of sequential and random word reads from a 16 MB
+ * cached buffer mapped with and without CMA_FLAG_HUGEPAGE. Random accesses
+ * over a buffer larger than TLB reach show what large pages save. Also checks
+ * that private mappings of large page memory are refused by the driver.
+ */
+
+#define _FILE_OFFSET_BITS 64
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "cma_api.h"
+#include "cma.h"
+
+#include "timer/timer.h"
+#include "bench_util/bench_util.h"
+
+#define BENCH_SIZE 			(16*1024*1024)
+#define BENCH_ACCESSES 		(4*1024*1024)
+
+#ifndef DRIVER_NODE_NAME
+	#define DRIVER_NODE_NAME 	"cma"
+#endif
+
+
+static unsigned bench_read(volatile unsigned *mem, const unsigned *idx, struct custom_timer *t)
+{
+	unsigned i, sum = 0;
+
+	timer_start(t);
+	for(i=0; i<BENCH_ACCESSES; i++)
+		sum += mem[idx[i]];
+	timer_end(t);
+
+	return sum;
+}
+
+
+static int bench_mapping(int test_num, unsigned flags, const unsigned *seq, const unsigned *rnd)
+{
+	unsigned *mem;
+	int granted;
+	struct custom_timer t_seq = {"Sequential"};
+	struct custom_timer t_rnd = {"Random"};
+	const char *name = (flags & CMA_FLAG_HUGEPAGE) ? "hugepage" : "small_page";
+
+	mem = cma_alloc_ext(BENCH_SIZE, flags);
+	if(mem == NULL){
+		tap_skip(test_num, name, "allocation failed");
+		return 0;
+	}
+
+	granted = cma_get_flags(mem);
+	if(granted == -1){
+		tap_not_ok(test_num, name, "cma_get_flags failed");
+		cma_free(mem);
+		return -1;
+	}
+
+	if( (flags & CMA_FLAG_HUGEPAGE) && !(granted & CMA_FLAG_HUGEPAGE) ){
+		tap_skip(test_num, name, "large pages not granted by the driver");
+		cma_free(mem);
+		return 0;
+	}
+
+	/* first pass populates the mapping, page faults are not measured */
+	bench_read(mem, seq, &t_seq);
+
+	bench_read(mem, seq, &t_seq);
+	bench_read(mem, rnd, &t_rnd);
+
+	printf("# %-10s: %.2f ns sequential, %.2f ns random per access\n", name,
+		timer_get_value(&t_seq) * 1e9 / BENCH_ACCESSES,
+		timer_get_value(&t_rnd) * 1e9 / BENCH_ACCESSES);
+	tap_ok(test_num, name);
+
+	cma_free(mem);
+	return 0;
+}
+
+
+/* returns 0 if a private mapping is refused with EINVAL, the mapping is
+ * never touched, as copy-on-write of it would not be handled */
+static int check_private(int fd, off_t offset, size_t size, const char **err)
+{
+	void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, offset);
+
+	if(map != MAP_FAILED){
+		munmap(map, size);
+		*err = "accepted";
+		return -1;
+	}
+
+	*err = strerror(errno);
+	return errno == EINVAL ? 0 : -1;
+}
+
+
+static int test_private(int test_num)
+{
+	const char *name = "private_mapping", *err;
+	const off_t offset = CMA_MMAP_ALLOC_OFFSET | ((off_t)(CMA_FLAG_CACHED | CMA_FLAG_HUGEPAGE) << CMA_MMAP_FLAGS_SHIFT);
+	void *mem;
+	int fd, dmabuf_fd, ret = -1;
+
+	fd = open("/dev/" DRIVER_NODE_NAME, O_RDWR);
+	if(fd == -1){
+		tap_skip(test_num, name, "no /dev/" DRIVER_NODE_NAME " device");
+		return 0;
+	}
+
+	if( check_private(fd, offset, BENCH_SIZE, &err) == -1 ){
+		tap_not_ok(test_num, name, "device mapping %s", err);
+		goto close_fd;
+	}
+
+	mem = cma_alloc_ext(BENCH_SIZE, CMA_FLAG_CACHED | CMA_FLAG_HUGEPAGE);
+	if(mem == NULL){
+		tap_skip(test_num, name, "allocation failed");
+		ret = 0;
+		goto close_fd;
+	}
+
+	dmabuf_fd = cma_export_fd(mem);
+	if(dmabuf_fd == -1){
+		tap_not_ok(test_num, name, "cma_export_fd failed");
+		goto free_mem;
+	}
+
+	if( check_private(dmabuf_fd, 0, BENCH_SIZE, &err) == -1 )
+		tap_not_ok(test_num, name, "dma-buf mapping %s", err);
+	else{
+		tap_ok(test_num, name);
+		ret = 0;
+	}
+
+	close(dmabuf_fd);
+free_mem:
+	cma_free(mem);
+close_fd:
+	close(fd);
+	return ret;
+}
+
+
+int main(void)
+{
+	unsigned *seq, *rnd, i;
+	const unsigned words = BENCH_SIZE / sizeof(unsigned);
+	int err = 0;
+
+	tap_plan(3);
+
+	seq = malloc(BENCH_ACCESSES * sizeof(unsigned));
+	rnd = malloc(BENCH_ACCESSES * sizeof(unsigned));
+	if(seq == NULL || rnd == NULL)
+		return tap_bail_out("malloc failed");
+
+	/* strided sequential walk and uniform random indices over the buffer */
+	for(i=0; i<BENCH_ACCESSES; i++){
+		seq[i] = (i * 16) % words;
+		rnd[i] = ((unsigned)rand() * 16) % words;
+	}
+
+	if( cma_init() == -1 )
+		return tap_bail_out("cma_init failed");
+
+	if(bench_mapping(1, CMA_FLAG_CACHED, seq, rnd))
+		err = 1;
+	if(bench_mapping(2, CMA_FLAG_CACHED | CMA_FLAG_HUGEPAGE, seq, rnd))
+		err = 1;
+	if(test_private(3))
+		err = 1;
+
+	cma_release();
+
+	free(seq);
+	free(rnd);
+
+	return err;
+}
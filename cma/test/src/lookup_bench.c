@@ -0,0 +1,195 @@
+/* lookup_bench.c - cost of resolving physical addresses of CMA buffers.
+ *
+ * Measures how the average lookup time scales with 10, 1k and 10k live single
+ * page buffers, in the driver and in the library. Driver lookup by user-space
+ * address in the per-file tree is timed with the CMA_GET_PHY_ADDR64 ioctl on
+ * buffers allocated through an own file of the device, as the library answers
+ * cma_get_phy_addr() from its index. Index is timed with cma_get_phy_addr(),
+ * cma_virt_to_phys() and cma_virt_to_phys_bulk(). Driver column is left out
+ * when the device can not be opened.
+ */
+
+#define _FILE_OFFSET_BITS 64
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+#include "cma_api.h"
+#include "cma.h"
+
+#include "timer/timer.h"
+#include "bench_util/bench_util.h"
+
+#define LOOKUP_ITERATIONS 	100000
+#define LOOKUP_BULK 		64
+
+#ifndef DRIVER_NODE_NAME
+	#define DRIVER_NODE_NAME 	"cma"
+#endif
+
+
+/* average ns of a driver lookup, -1 if the buffers could not be allocated */
+static double bench_driver(int fd, int buffer_count)
+{
+	struct custom_timer t = {"Driver"};
+	struct cma_query64 query;
+	void **mem;
+	int i, allocated;
+	double ns = -1;
+
+	mem = malloc(buffer_count * sizeof(void*));
+	if(mem == NULL)
+		return -1;
+
+	/* allocated by mmap(), released by munmap() */
+	for(allocated=0; allocated<buffer_count; allocated++){
+		mem[allocated] = mmap(NULL, getpagesize(), PROT_READ | PROT_WRITE, MAP_SHARED, fd, CMA_MMAP_ALLOC_OFFSET);
+		if(mem[allocated] == MAP_FAILED)
+			break;
+	}
+	if(allocated != buffer_count)
+		goto release;
+
+	memset(&query, 0, sizeof(query));
+	timer_start(&t);
+	for(i=0; i<LOOKUP_ITERATIONS; i++){
+		query.v_usr_addr = (uintptr_t)mem[rand() % buffer_count];
+		if( ioctl(fd, CMA_GET_PHY_ADDR64, &query) == -1 )
+			break;
+	}
+	timer_end(&t);
+
+	if(i == LOOKUP_ITERATIONS)
+		ns = timer_get_value(&t) * 1e9 / LOOKUP_ITERATIONS;
+
+release:
+	for(i=0; i<allocated; i++)
+		munmap(mem[i], getpagesize());
+
+	free(mem);
+	return ns;
+}
+
+
+static int bench_lookup(int test_num, int buffer_count, int fd)
+{
+	void **mem, *ptrs[LOOKUP_BULK];
+	uint64_t phy_addrs[LOOKUP_BULK];
+	int i, j, allocated, err = 0;
+	struct custom_timer t = {"Lookup"};
+	struct custom_timer t_interior = {"Interior"};
+	struct custom_timer t_bulk = {"Bulk"};
+	char name[32], driver[32] = "";
+	double driver_ns;
+
+	snprintf(name, sizeof(name), "lookup_%d", buffer_count);
+
+	mem = malloc(buffer_count * sizeof(void*));
+	if(mem == NULL){
+		tap_not_ok(test_num, name, "malloc failed");
+		return -1;
+	}
+
+	for(allocated=0; allocated<buffer_count; allocated++){
+		mem[allocated] = cma_alloc_cached(getpagesize());
+		if(mem[allocated] == NULL)
+			break;
+	}
+
+	if(allocated != buffer_count){
+		tap_skip(test_num, name, "only %d buffers could be allocated", allocated);
+		goto release;
+	}
+
+	timer_start(&t);
+	for(i=0; i<LOOKUP_ITERATIONS; i++){
+		if(cma_get_phy_addr(mem[rand() % buffer_count]) == 0){
+			err = -1;
+			break;
+		}
+	}
+	timer_end(&t);
+
+	if(err){
+		tap_not_ok(test_num, name, "cma_get_phy_addr failed");
+		goto release;
+	}
+
+	timer_start(&t_interior);
+	for(i=0; i<LOOKUP_ITERATIONS; i++){
+		if(cma_virt_to_phys((char*)mem[rand() % buffer_count] + rand() % getpagesize()) == 0){
+			err = -1;
+			break;
+		}
+	}
+	timer_end(&t_interior);
+
+	for(j=0; j<LOOKUP_BULK; j++)
+		ptrs[j] = (char*)mem[rand() % buffer_count] + rand() % getpagesize();
+
+	timer_start(&t_bulk);
+	for(i=0; i<LOOKUP_ITERATIONS/LOOKUP_BULK && !err; i++)
+		if(cma_virt_to_phys_bulk(ptrs, phy_addrs, LOOKUP_BULK) != LOOKUP_BULK)
+			err = -1;
+	timer_end(&t_bulk);
+
+	if(err){
+		tap_not_ok(test_num, name, "cma_virt_to_phys failed");
+		goto release;
+	}
+
+	if(fd != -1){
+		driver_ns = bench_driver(fd, buffer_count);
+		if(driver_ns < 0){
+			tap_not_ok(test_num, name, "driver lookup failed");
+			err = -1;
+			goto release;
+		}
+		snprintf(driver, sizeof(driver), "%.0f ns driver, ", driver_ns);
+	}
+
+	printf("# %5d buffers: %s%.0f ns index, %.0f ns interior, %.0f ns bulk\n", buffer_count, driver,
+		timer_get_value(&t) * 1e9 / LOOKUP_ITERATIONS,
+		timer_get_value(&t_interior) * 1e9 / LOOKUP_ITERATIONS,
+		timer_get_value(&t_bulk) * 1e9 / (LOOKUP_ITERATIONS/LOOKUP_BULK*LOOKUP_BULK));
+	tap_ok(test_num, name);
+
+release:
+	for(i=0; i<allocated; i++)
+		cma_free(mem[i]);
+
+	free(mem);
+	return err;
+}
+
+
+int main(void)
+{
+	const int buffer_counts[] = {10, 1000, 10000};
+	const int test_count = sizeof(buffer_counts)/sizeof(buffer_counts[0]);
+	int i, fd, err = 0;
+
+	tap_plan(test_count);
+
+	if( cma_init() == -1 )
+		return tap_bail_out("cma_init failed");
+
+	/* own file, entries of the api are not in its tree */
+	fd = open("/dev/" DRIVER_NODE_NAME, O_RDWR);
+
+	for(i=0; i<test_count; i++)
+		if(bench_lookup(i+1, buffer_counts[i], fd))
+			err = 1;
+
+	if(fd != -1)
+		close(fd);
+
+	cma_release();
+
+	return err;
+}
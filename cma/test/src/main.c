@@ -8,64 +8,70 @@
 #define CMA_ALLOC_SIZE 		(2*1024*1024+1)
 
 
+struct mem_type{
+	char 			*name;
+	void 			*(*alloc)(size_t size);
+	int 			*mem;
+	struct custom_timer timer;
+};
+
+
 int main(void)
 {
-	int *mem_cached, *mem_noncached;
-	struct custom_timer t_cached = {"Cached memory"};
-	struct custom_timer t_noncached = {"Noncached memory"};
+	int i;
+	struct mem_type *type;
+	struct mem_type types[] = {
+		{"Cached memory", 			cma_alloc_cached, 		NULL, {"Cached memory"}},
+		{"Noncached memory", 		cma_alloc_noncached, 	NULL, {"Noncached memory"}},
+		{"Write-combined memory", 	cma_alloc_writecombine, NULL, {"Write-combined memory"}}
+	};
+	const int type_count = sizeof(types)/sizeof(types[0]);
 
 	printf("Initializing CMA API\n");
 	if( cma_init() == -1){
-		printf("FAILED!\n");
-		return -1;		
-	}
-
-	printf("Allocating 0x%x bytes contigous memory, cached\n",CMA_ALLOC_SIZE);
-	mem_cached = cma_alloc_cached(CMA_ALLOC_SIZE);
-	if(mem_cached == NULL){
-		printf("FAILED!\n");
-		return -1;
-	}
-	
-	printf("Allocating 0x%x bytes contigous memory, noncached\n",CMA_ALLOC_SIZE);
-	mem_noncached = cma_alloc_noncached(CMA_ALLOC_SIZE);
-	if(mem_noncached == NULL){
 		printf("FAILED!\n");
 		return -1;
 	}
 
-	printf("Initializing cached memory\n");
-	timer_start(&t_cached);
-	for(int i=0; i<CMA_ALLOC_SIZE/sizeof(int); i++)
-		mem_cached[i] = i;
-	timer_end(&t_cached);
+	for(type=types; type<types+type_count; type++){
+		printf("Allocating 0x%x bytes contigous memory, %s\n", CMA_ALLOC_SIZE, type->name);
+		type->mem = type->alloc(CMA_ALLOC_SIZE);
+		if(type->mem == NULL){
+			printf("FAILED!\n");
+			return -1;
+		}
+	}
 
-	printf("Initializing noncached memory\n");
-	timer_start(&t_noncached);
-	for(int i=0; i<CMA_ALLOC_SIZE/sizeof(int); i++)
-		mem_noncached[i] = i;
-	timer_end(&t_noncached);
+	for(type=types; type<types+type_count; type++){
+		printf("Initializing %s\n", type->name);
+		timer_start(&type->timer);
+		for(i=0; i<CMA_ALLOC_SIZE/sizeof(int); i++)
+			type->mem[i] = i;
+		timer_end(&type->timer);
+	}
 
 	printf("Initialization timings\n");
-	print_timer(&t_cached);
-	print_timer(&t_noncached);
+	for(type=types; type<types+type_count; type++)
+		print_timer(&type->timer);
 
-	printf("Releasing contigous memory, cached\n");
-	if(cma_free(mem_cached) == -1){
-		printf("FAILED!\n");
-		return -1;
-	}
+	printf("Fill bandwidth\n");
+	for(type=types; type<types+type_count; type++)
+		printf("%-40s: %.1f MiB/s\n", type->name,
+			CMA_ALLOC_SIZE / timer_get_value(&type->timer) / (1024*1024));
 
-	printf("Releasing contigous memory, noncached\n");
-	if(cma_free(mem_noncached) == -1){
-		printf("FAILED!\n");
-		return -1;
+	for(type=types; type<types+type_count; type++){
+		printf("Releasing contigous memory, %s\n", type->name);
+		if(cma_free(type->mem) == -1){
+			printf("FAILED!\n");
+			return -1;
+		}
 	}
 
 	printf("Releasing CMA API\n");
-	if( cma_release() == -1)
+	if( cma_release() == -1){
 		printf("FAILED!\n");
 		return -1;
+	}
 
 	return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,126 @@
+/* odirect_bench.c - O_DIRECT write throughput straight from CMA buffers.
+ *
+ * Measures writes of a cached buffer mapped with CMA_FLAG_PAGES, which is
+ * passed to write() as is, against the default mapping, which can not be
+ * pinned by the kernel and goes through a bounce buffer. File system of the
+ * output file has to support O_DIRECT.
+ *
+ * Usage: cma_odirect_bench.elf [output file]
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "cma_api.h"
+
+#include "timer/timer.h"
+#include "bench_util/bench_util.h"
+
+#define BENCH_SIZE 			(16*1024*1024)
+#define BENCH_REPEAT 		8
+#define BENCH_ALIGN 		4096
+
+
+/* returns -1 and errno of the first failing write */
+static int bench_write(int fd, const void *src, void *bounce, struct custom_timer *t)
+{
+	int i;
+	const void *buf = bounce != NULL ? bounce : src;
+
+	timer_start(t);
+	for(i=0; i<BENCH_REPEAT; i++){
+		if(bounce != NULL)
+			memcpy(bounce, src, BENCH_SIZE);
+
+		if( pwrite(fd, buf, BENCH_SIZE, (off_t)i * BENCH_SIZE) != BENCH_SIZE )
+			return -1;
+	}
+	if( fdatasync(fd) == -1 )
+		return -1;
+	timer_end(t);
+
+	return 0;
+}
+
+
+static int bench_mapping(int test_num, int fd, unsigned flags, void *bounce)
+{
+	char *mem;
+	int granted;
+	struct custom_timer t = {"Write"};
+	const char *name = (flags & CMA_FLAG_PAGES) ? "pages_direct" : "pfnmap_bounce";
+
+	mem = cma_alloc_ext(BENCH_SIZE, flags);
+	if(mem == NULL){
+		tap_skip(test_num, name, "allocation failed");
+		return 0;
+	}
+
+	granted = cma_get_flags(mem);
+	if( (flags & CMA_FLAG_PAGES) && (granted == -1 || !(granted & CMA_FLAG_PAGES)) ){
+		tap_skip(test_num, name, "page-backed mapping not supported by the driver");
+		cma_free(mem);
+		return 0;
+	}
+
+	memset(mem, 0x5a, BENCH_SIZE);
+
+	/* default mapping is expected to be refused, which is why bounce is used */
+	if( !(flags & CMA_FLAG_PAGES) ){
+		if( pwrite(fd, mem, BENCH_SIZE, 0) == BENCH_SIZE )
+			printf("# %-14s: direct write was accepted\n", name);
+		else
+			printf("# %-14s: direct write refused (%s)\n", name, strerror(errno));
+	}
+
+	if( bench_write(fd, mem, bounce, &t) == -1 ){
+		tap_not_ok(test_num, name, "write failed (%s)", strerror(errno));
+		cma_free(mem);
+		return -1;
+	}
+
+	printf("# %-14s: %.1f MiB/s\n", name,
+		(double)BENCH_SIZE * BENCH_REPEAT / timer_get_value(&t) / (1024*1024));
+	tap_ok(test_num, name);
+
+	cma_free(mem);
+	return 0;
+}
+
+
+int main(int argc, char *argv[])
+{
+	const char *path = argc > 1 ? argv[1] : "cma_odirect_bench.dat";
+	void *bounce;
+	int fd, err = 0;
+
+	tap_plan(2);
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+	if(fd == -1)
+		return tap_bail_out("can not open %s with O_DIRECT (%s)", path, strerror(errno));
+
+	if( posix_memalign(&bounce, BENCH_ALIGN, BENCH_SIZE) )
+		return tap_bail_out("bounce buffer allocation failed");
+
+	if( cma_init() == -1 )
+		return tap_bail_out("cma_init failed");
+
+	if(bench_mapping(1, fd, CMA_FLAG_CACHED | CMA_FLAG_PAGES, NULL))
+		err = 1;
+	if(bench_mapping(2, fd, CMA_FLAG_CACHED, bounce))
+		err = 1;
+
+	cma_release();
+
+	free(bounce);
+	close(fd);
+	unlink(path);
+
+	return err;
+}
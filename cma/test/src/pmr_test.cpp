@@ -0,0 +1,139 @@
+/* pmr_test.cpp - checks of the C++ interface in cma_api.hpp.
+ *
+ * Fills std::pmr containers allocated from cma::memory_resource of the
+ * accepted memory types, checks that noncached memory is refused, and moves
+ * cma::buffer owners around.
+ */
+
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include "cma_api.hpp"
+
+#include "bench_util/bench_util.h"
+
+#define TEST_ELEMENTS 		(64*1024)
+
+
+static int test_resource(int test_num, const char *name, unsigned flags)
+{
+	try{
+		cma::memory_resource resource(flags);
+		cma::memory_resource other(flags);
+		std::pmr::vector<uint32_t> v(&resource);
+		uint32_t i;
+
+		for(i=0; i<TEST_ELEMENTS; i++)
+			v.push_back(i);
+
+		for(i=0; i<TEST_ELEMENTS; i++){
+			if( v[i] != i ){
+				tap_not_ok(test_num, name, "element %u differs", i);
+				return -1;
+			}
+		}
+
+		if( cma::phy_addr(v.data()) == 0 ){
+			tap_not_ok(test_num, name, "no physical address");
+			return -1;
+		}
+
+		if( !resource.is_equal(other) ){
+			tap_not_ok(test_num, name, "resources with the same flags differ");
+			return -1;
+		}
+	}
+	catch(const std::exception &e){
+		tap_not_ok(test_num, name, "%s", e.what());
+		return -1;
+	}
+
+	tap_ok(test_num, name);
+	return 0;
+}
+
+
+static int test_noncached(int test_num)
+{
+	const char *name = "resource_noncached";
+
+	try{
+		cma::memory_resource resource(CMA_FLAG_NONCACHED);
+	}
+	catch(const std::system_error &e){
+		if( e.code().value() != EINVAL ){
+			tap_not_ok(test_num, name, "%s", e.what());
+			return -1;
+		}
+
+		tap_ok(test_num, name);
+		return 0;
+	}
+
+	tap_not_ok(test_num, name, "noncached memory accepted");
+	return -1;
+}
+
+
+static int test_buffer(int test_num)
+{
+	const char *name = "buffer_move";
+
+	try{
+		cma::buffer a(4096), b;
+		void *mem = a.data();
+		uint64_t phy_addr = a.phy_addr();
+
+		if( !a || phy_addr == 0 ){
+			tap_not_ok(test_num, name, "allocation without physical address");
+			return -1;
+		}
+		std::memset(a.data(), 0x5a, a.size());
+
+		b = std::move(a);
+		if( a || b.data() != mem || b.phy_addr() != phy_addr || b.size() != 4096 ){
+			tap_not_ok(test_num, name, "ownership not moved");
+			return -1;
+		}
+
+		std::vector<cma::buffer> owners;
+		owners.push_back(std::move(b));
+		owners.emplace_back(4096, CMA_FLAG_WRITECOMBINE);
+		if( owners[0].data() != mem || owners[1].flags() != CMA_FLAG_WRITECOMBINE ){
+			tap_not_ok(test_num, name, "ownership lost in a container");
+			return -1;
+		}
+	}
+	catch(const std::exception &e){
+		tap_not_ok(test_num, name, "%s", e.what());
+		return -1;
+	}
+
+	tap_ok(test_num, name);
+	return 0;
+}
+
+
+int main(void)
+{
+	int err = 0;
+
+	tap_plan(4);
+
+	if( cma_init() == -1 )
+		return tap_bail_out("cma_init failed");
+
+	if(test_resource(1, "resource_cached", CMA_FLAG_CACHED))
+		err = 1;
+	if(test_resource(2, "resource_writecombine", CMA_FLAG_WRITECOMBINE))
+		err = 1;
+	if(test_noncached(3))
+		err = 1;
+	if(test_buffer(4))
+		err = 1;
+
+	cma_release();
+
+	return err;
+}